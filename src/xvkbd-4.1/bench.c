@@ -0,0 +1,243 @@
+/*
+ * xvkbd-bench - microbenchmark of the keymap lookup and the planner
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * SendKeyPressedEvent() and SendString() are run in dry run (see
+ * -dry-run of xvkbd) with synthetic keymaps of 2 to 8 keysyms per
+ * keycode, sparse and dense, and with texts in several scripts, and
+ * the time and the number of the allocations for each character are
+ * reported.  No X server is needed.  "make bench" builds and runs it.
+ *
+ * Usage: xvkbd-bench [-n repeat]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <X11/Intrinsic.h>
+#include <X11/keysym.h>
+
+#include "resources.h"
+
+#define MIN_KEYCODE    8
+#define MAX_KEYCODE    255
+#define FREE_KEYCODES  8  /* left empty for AddKeysym() */
+
+/*
+ * Count the allocations, by replacing malloc() and its friends
+ * (only with glibc, which allows to call the originals).
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+# define COUNT_ALLOCATIONS 1
+#else
+static unsigned long allocations = 0;
+# define COUNT_ALLOCATIONS 0
+#endif
+
+static const struct {
+  const char *name;
+  const char *text;
+} inputs[] = {
+  { "ascii", "The quick brown fox jumps over the lazy dog. 0123456789 (x+y)*z=[a]{b};" },
+  { "latin1", "Voix ambiguë d'un cœur qui au zéphyr préfère les jattes de kiwis. Ärger über Straße" },
+  { "cyrillic", "Съешь же ещё этих мягких французских булок, да выпей чаю" },
+  { "greek", "Ξεσκεπάζω την ψυχοφθόρα βδελυγμία" },
+  { "mixed", "Hello, Привет, Γειά σου, ça va? Grüße 日本語" },
+  { "escapes", "\\Ca\\Cc\\[Return]\\{Tab}\\Sx\\r\\t\\[s:F1]\\{+Shift_L}a\\{-Shift_L}\\Ax\\e\\b" },
+};
+
+static KeySym *pool = NULL;  /* keysyms to fill the keymaps */
+static int pool_size = 0;
+
+static void AddPool(KeySym first, KeySym last)
+{
+  KeySym keysym;
+
+  pool = realloc(pool, sizeof(KeySym) * (pool_size + last - first + 1));
+  for (keysym = first; keysym <= last; keysym++) pool[pool_size++] = keysym;
+}
+
+/*
+ * Write a keymap in the format of "xmodmap -pke" and "xmodmap -pm".
+ * Keycodes from MIN_KEYCODE have the modifiers and some special keys,
+ * and the others have keysyms from the pool; all of them in the dense
+ * keymap, and Shift levels of every third keycode in the sparse one.
+ */
+static void WriteKeymap(FILE *fp, int keysym_per_keycode, Boolean dense)
+{
+  static const KeySym special_keys[] = {
+    XK_Shift_L, XK_Control_L, XK_Alt_L, XK_Super_L, XK_ISO_Level3_Shift, XK_Mode_switch,
+    XK_Return, XK_Tab, XK_BackSpace, XK_Escape, XK_Delete, XK_Linefeed, XK_F1, XK_space,
+  };
+  int keycode, level, levels, n;
+  KeySym keysym;
+
+  n = 0;
+  for (keycode = MIN_KEYCODE; keycode <= MAX_KEYCODE; keycode++) {
+    fprintf(fp, "keycode %3d =", keycode);
+    if (keycode - MIN_KEYCODE < XtNumber(special_keys)) {
+      fprintf(fp, " %s", XKeysymToString(special_keys[keycode - MIN_KEYCODE]));
+    } else if (keycode <= MAX_KEYCODE - FREE_KEYCODES && (dense || keycode % 3 == 0)) {
+      levels = dense ? keysym_per_keycode : 2;
+      for (level = 0; level < keysym_per_keycode; level++) {
+	keysym = (level < levels) ? pool[n++ % pool_size] : NoSymbol;
+	if (keysym == NoSymbol) fprintf(fp, " NoSymbol");
+	else fprintf(fp, " 0x%lx", (long)keysym);
+      }
+    }
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "shift   Shift_L (0x%x)\n", MIN_KEYCODE);
+  fprintf(fp, "control Control_L (0x%x)\n", MIN_KEYCODE + 1);
+  fprintf(fp, "mod1    Alt_L (0x%x)\n", MIN_KEYCODE + 2);
+  fprintf(fp, "mod3    Mode_switch (0x%x)\n", MIN_KEYCODE + 5);
+  fprintf(fp, "mod4    Super_L (0x%x)\n", MIN_KEYCODE + 3);
+  fprintf(fp, "mod5    ISO_Level3_Shift (0x%x)\n", MIN_KEYCODE + 4);
+}
+
+/*
+ * Keysyms of the characters in the UTF-8 text, as SendString() makes.
+ */
+static int TextKeysyms(const char *text, KeySym *keysyms)
+{
+  const unsigned char *cp = (const unsigned char *)text;
+  unsigned int ch;
+  int n = 0, len, i;
+
+  while (*cp != '\0') {
+    len = (*cp < 0xC0) ? 1 : (*cp < 0xE0) ? 2 : (*cp < 0xF0) ? 3 : 4;
+    ch = (len == 1) ? *cp : (*cp & (0x7F >> len));
+    for (i = 1; i < len && cp[i] != '\0'; i++) ch = (ch << 6) | (cp[i] & 0x3F);
+    cp += i;
+    keysyms[n++] = (ch < 0x100) ? ch : (0x01000000 | ch);
+  }
+  return n;
+}
+
+static double Now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void Report(const char *keymap, const char *input, const char *path,
+		   double ns, unsigned long allocs, long chars)
+{
+  fprintf(stdout, "%-14s %-9s %-7s %10.1f", keymap, input, path, ns / chars);
+  if (COUNT_ALLOCATIONS) fprintf(stdout, " %12.3f\n", (double)allocs / chars);
+  else fprintf(stdout, " %12s\n", "-");
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  static const int keysym_per_keycodes[] = { 2, 4, 6, 8 };
+  char path[] = "/tmp/xvkbd-bench-XXXXXX";
+  char keymap[30];
+  KeySym keysyms[200];
+  int repeat = 2000;
+  int fd, i, j, k, r, n, dense;
+  unsigned long allocs;
+  double start;
+  FILE *fp;
+
+  if (argc == 3 && strcmp(argv[1], "-n") == 0 && 0 < atoi(argv[2])) {
+    repeat = atoi(argv[2]);
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: %s [-n repeat]\n", argv[0]);
+    exit(1);
+  }
+
+  AddPool(0x21, 0x7E);              /* ASCII */
+  AddPool(0xA1, 0xFF);              /* Latin-1 */
+  AddPool(0x6C0, 0x6FF);            /* Cyrillic */
+  AddPool(0x7E1, 0x7F9);            /* Greek small letters */
+  AddPool(0x7C1, 0x7D9);            /* Greek capital letters */
+  AddPool(0x1000100, 0x100017F);    /* Latin Extended-A */
+  AddPool(0x1000400, 0x10004FF);    /* rest of Cyrillic */
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "%s: can't create the file: %s\n", PROGRAM_NAME, path);
+    exit(1);
+  }
+  close(fd);
+
+  appres.text_delay = 0;
+  appres.compose = FALSE;  /* not to depend on the locale */
+  appres.dry_run = path;
+  dry_run_quiet = TRUE;
+
+  fprintf(stdout, "%-14s %-9s %-7s %10s %12s\n", "keymap", "input", "path", "ns/char", "allocs/char");
+  for (i = 0; i < XtNumber(keysym_per_keycodes); i++) {
+    for (dense = 0; dense < 2; dense++) {
+      fp = fopen(path, "w");
+      WriteKeymap(fp, keysym_per_keycodes[i], dense);
+      fclose(fp);
+      need_read_keymap = FALSE;
+      ReadKeymap();
+      snprintf(keymap, sizeof(keymap), "%d/%s", keysym_per_keycodes[i], dense ? "dense" : "sparse");
+
+      for (j = 0; j < XtNumber(inputs); j++) {
+	/* keysyms to be remapped are added before the measurement */
+	SendString(inputs[j].text);
+
+	if (strcmp(inputs[j].name, "escapes") != 0) {
+	  n = TextKeysyms(inputs[j].text, keysyms);
+	  allocs = allocations;
+	  start = Now();
+	  for (r = 0; r < repeat; r++) {
+	    for (k = 0; k < n; k++) SendKeyPressedEvent(keysyms[k], 0, 0);
+	  }
+	  Report(keymap, inputs[j].name, "keysym", Now() - start,
+		 allocations - allocs, (long)n * repeat);
+	}
+
+	n = TextKeysyms(inputs[j].text, keysyms);
+	allocs = allocations;
+	start = Now();
+	for (r = 0; r < repeat; r++) SendString(inputs[j].text);
+	Report(keymap, inputs[j].name, "string", Now() - start,
+	       allocations - allocs, (long)n * repeat);
+      }
+    }
+  }
+  unlink(path);
+  exit(0);
+}
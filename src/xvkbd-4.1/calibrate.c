@@ -0,0 +1,418 @@
+/*
+ * xvkbd - Virtual Keyboard for X Window System
+ *
+ * Copyright (C) 2000 by Tom Sato <VEF00200@nifty.ne.jp>
+ * http://homepage3.nifty.com/tsato/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Calibration (-calibrate): type a test pattern with decreasing delays,
+ * check what arrived, and find the shortest delay with no lost keys.
+ * Keys are read from a local probe window, or, with -window, from the
+ * XVKBD_ECHO property which the target window must keep updated with
+ * the text it received.  The result is kept for the WM_CLASS of the
+ * target, and used as the default delay of later -text, -file and
+ * -follow to windows of that class (see CalibratedDelay()).  The result
+ * with the probe window only tells how fast xvkbd itself can read the
+ * keys, so it is not kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <X11/Intrinsic.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include "resources.h"
+
+#define PATTERN "The quick brown fox jumps over the lazy dog 0123456789"
+#define PATTERN_MAX 100
+#define SETTLE_TIME 1000  /* give up waiting for keys after 1sec */
+
+static const int calibration_delays[] = { 50, 20, 10, 5, 2, 1, 0 };
+
+static const double histogram_bounds[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500 };
+#define HISTOGRAM_BUCKETS (XtNumber(histogram_bounds) + 1)
+
+struct calibration {
+  Display *dpy;
+  Window window;        /* probe window or target window */
+  Boolean echo;         /* read XVKBD_ECHO property of the window */
+  Atom echo_atom;
+  int len;
+  char got[PATTERN_MAX + 1];
+  int got_len;
+  int sent;
+  int arrived;          /* keys with latency measured */
+  double sent_at[PATTERN_MAX];
+  double latency[PATTERN_MAX];
+};
+
+static double Now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/*
+ * Wait until an event is available, up to timeout milliseconds.
+ */
+static Boolean WaitForEvent(Display *dpy, int timeout)
+{
+  struct pollfd pfd;
+
+  if (XPending(dpy)) return TRUE;
+  pfd.fd = ConnectionNumber(dpy);
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout) <= 0) return FALSE;
+  return XPending(dpy) != 0;
+}
+
+static void ReadEcho(struct calibration *c)
+{
+  Atom type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+
+  c->got_len = 0;
+  if (XGetWindowProperty(c->dpy, c->window, c->echo_atom, 0, PATTERN_MAX / 4 + 1,
+			 False, AnyPropertyType, &type, &format,
+			 &nitems, &after, &data) == Success && data != NULL) {
+    if (format == 8) {
+      c->got_len = (PATTERN_MAX < nitems) ? PATTERN_MAX : nitems;
+      memcpy(c->got, data, c->got_len);
+    }
+    XFree(data);
+  }
+}
+
+/*
+ * Take the keys arrived so far, and measure latency of the keys
+ * which arrived for the first time.
+ */
+static void CollectArrivals(struct calibration *c)
+{
+  XEvent event;
+  KeySym keysym;
+  char buf[10];
+  double now;
+
+  while (XCheckWindowEvent(c->dpy, c->window,
+			   c->echo ? PropertyChangeMask : KeyPressMask, &event)) {
+    if (c->echo) {
+      if (event.xproperty.atom == c->echo_atom) ReadEcho(c);
+    } else if (XLookupString(&event.xkey, buf, sizeof(buf), &keysym, NULL) == 1
+	       && c->got_len < PATTERN_MAX) {
+      c->got[c->got_len++] = buf[0];
+    }
+  }
+  now = Now();
+  while (c->arrived < c->got_len && c->arrived < c->sent) {
+    c->latency[c->arrived] = now - c->sent_at[c->arrived];
+    c->arrived++;
+  }
+}
+
+/*
+ * Type the pattern with the delay, and return number of the keys
+ * which arrived in order (extra keys are left in c->got).
+ */
+static int TypePattern(struct calibration *c, int delay,
+		       int (*send_key)(Window window, KeySym keysym))
+{
+  int last_arrived;
+  double last_change;
+  int i, matched;
+
+  c->got_len = 0;
+  c->sent = 0;
+  c->arrived = 0;
+  if (c->echo) {
+    XDeleteProperty(c->dpy, c->window, c->echo_atom);
+    XSync(c->dpy, FALSE);
+  }
+  CollectArrivals(c);
+  c->got_len = 0;
+
+  for (i = 0; i < c->len && !interrupted; i++) {
+    if (0 < i && 0 < delay) usleep(delay * 1000);
+    c->sent_at[i] = Now();
+    c->sent = i + 1;
+    if (send_key(c->echo ? None : c->window, (unsigned char)PATTERN[i]) != 0) break;
+    CollectArrivals(c);
+  }
+
+  last_arrived = -1;
+  last_change = Now();
+  while (c->arrived < c->sent && !interrupted) {
+    if (c->arrived != last_arrived) {
+      last_arrived = c->arrived;
+      last_change = Now();
+    } else if (SETTLE_TIME < Now() - last_change) {
+      break;
+    }
+    WaitForEvent(c->dpy, 50);
+    CollectArrivals(c);
+  }
+
+  matched = 0;
+  for (i = 0; i < c->got_len && matched < c->len; i++) {
+    if (c->got[i] == PATTERN[matched]) matched++;
+  }
+  return matched;
+}
+
+static void PrintHistogram(const double *latency, int count, int lost)
+{
+  int bucket[HISTOGRAM_BUCKETS];
+  int i, j, max, width;
+
+  memset(bucket, 0, sizeof(bucket));
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < XtNumber(histogram_bounds); j++) {
+      if (latency[i] < histogram_bounds[j]) break;
+    }
+    bucket[j]++;
+  }
+  max = 1;
+  for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+    if (max < bucket[j]) max = bucket[j];
+  }
+
+  fprintf(stdout, "latency:\n");
+  for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+    if (j < XtNumber(histogram_bounds))
+      fprintf(stdout, "  < %3.0f ms %4d ", histogram_bounds[j], bucket[j]);
+    else
+      fprintf(stdout, " >= %3.0f ms %4d ", histogram_bounds[j - 1], bucket[j]);
+    width = (bucket[j] * 40 + max - 1) / max;
+    while (0 < width--) fputc('#', stdout);
+    fputc('\n', stdout);
+  }
+  if (0 < lost) fprintf(stdout, "      lost %4d\n", lost);
+}
+
+/*
+ * Find WM_CLASS of the window or of its nearest ancestor which has one.
+ */
+static Boolean WindowClass(Display *dpy, Window w, char *buf, size_t size)
+{
+  XClassHint hint;
+  Window root, parent, *children;
+  unsigned int nchildren;
+  Boolean found = FALSE;
+
+  while (w != None && !found) {
+    if (XGetClassHint(dpy, w, &hint)) {
+      if (hint.res_class != NULL) {
+	snprintf(buf, size, "%s", hint.res_class);
+	found = TRUE;
+      }
+      if (hint.res_name) XFree(hint.res_name);
+      if (hint.res_class) XFree(hint.res_class);
+    }
+    if (found || !XQueryTree(dpy, w, &root, &parent, &children, &nchildren)) break;
+    if (children != NULL) XFree(children);
+    w = (parent == root) ? None : parent;
+  }
+  return found;
+}
+
+/*
+ * Replace the delay for the class in the file of the results.
+ */
+static void SaveDelay(Display *dpy, const char *class, int delay)
+{
+  char path[PATH_MAX], new_path[PATH_MAX + 10];
+  char *line = NULL;
+  size_t line_size = 0;
+  size_t len;
+  FILE *fp, *new_fp;
+
+  if (!CacheFileName(dpy, "delays", path, sizeof(path))) return;
+  snprintf(new_path, sizeof(new_path), "%s.new", path);
+  new_fp = fopen(new_path, "w");
+  if (new_fp == NULL) {
+    fprintf(stderr, "%s: can't write the file: %s\n", PROGRAM_NAME, new_path);
+    return;
+  }
+
+  len = strlen(class);
+  fp = fopen(path, "r");
+  if (fp != NULL) {
+    while (getline(&line, &line_size, fp) != -1) {
+      if (strncmp(line, class, len) == 0 && line[len] == '\t') continue;
+      fputs(line, new_fp);
+    }
+    free(line);
+    fclose(fp);
+  }
+  fprintf(new_fp, "%s\t%d\n", class, delay);
+
+  if (fclose(new_fp) != 0 || rename(new_path, path) != 0) {
+    fprintf(stderr, "%s: can't write the file: %s\n", PROGRAM_NAME, path);
+    unlink(new_path);
+    return;
+  }
+  fprintf(stdout, "saved for class %s in %s\n", class, path);
+}
+
+/*
+ * Returns the delay calibrated for the class of the window (the input
+ * focus if None), or -1 when not calibrated.
+ */
+int CalibratedDelay(Display *dpy, Window window)
+{
+  char path[PATH_MAX], class[256];
+  char *line = NULL;
+  size_t line_size = 0;
+  size_t len;
+  int revert_to;
+  int delay;
+  FILE *fp;
+
+  if (!CacheFileName(dpy, "delays", path, sizeof(path))) return -1;
+  if ((fp = fopen(path, "r")) == NULL) return -1;
+
+  if (window == None) XGetInputFocus(dpy, &window, &revert_to);
+  if (window == None || window == PointerRoot
+      || !WindowClass(dpy, window, class, sizeof(class))) {
+    fclose(fp);
+    return -1;
+  }
+  len = strlen(class);
+
+  delay = -1;
+  while (getline(&line, &line_size, fp) != -1) {
+    if (strncmp(line, class, len) == 0 && line[len] == '\t')
+      delay = atoi(line + len + 1);
+  }
+  free(line);
+  fclose(fp);
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: CalibratedDelay: class=%s delay=%d\n", class, delay);
+  return delay;
+}
+
+static Window CreateProbeWindow(Display *dpy)
+{
+  XClassHint hint;
+  XEvent event;
+  Window w;
+  int scr = DefaultScreen(dpy);
+  double start;
+
+  w = XCreateSimpleWindow(dpy, RootWindow(dpy, scr), 0, 0, 400, 40, 1,
+			  BlackPixel(dpy, scr), WhitePixel(dpy, scr));
+  hint.res_name = "xvkbd";
+  hint.res_class = "XVkbdCalibration";
+  XSetClassHint(dpy, w, &hint);
+  XStoreName(dpy, w, "xvkbd calibration");
+  XSelectInput(dpy, w, KeyPressMask | ExposureMask);
+  XMapRaised(dpy, w);
+
+  /* the window must be viewable to get the input focus */
+  start = Now();
+  while (Now() - start < 5000) {
+    if (XCheckTypedWindowEvent(dpy, w, Expose, &event)) break;
+    WaitForEvent(dpy, 100);
+  }
+  return w;
+}
+
+/*
+ * Run the calibration, typing the keys with send_key() to the window
+ * (None for the window of the session).  Returns the shortest delay
+ * with no lost keys, or -1.
+ */
+int Calibrate(Display *dpy, Window target, int (*send_key)(Window window, KeySym keysym))
+{
+  static struct calibration c;
+  double best_latency[PATTERN_MAX], rate;
+  int best_count = 0, best_lost = 0;
+  int best = -1;
+  int i, matched;
+  char class[256];
+  XWindowAttributes attr;
+
+  memset(&c, 0, sizeof(c));
+  c.dpy = dpy;
+  c.len = strlen(PATTERN);
+  if (target == None) {
+    c.window = CreateProbeWindow(dpy);
+    class[0] = '\0';
+  } else {
+    c.window = target;
+    c.echo = TRUE;
+    c.echo_atom = XInternAtom(dpy, "XVKBD_ECHO", False);
+    if (!WindowClass(dpy, target, class, sizeof(class))) class[0] = '\0';
+    XGetWindowAttributes(dpy, target, &attr);
+    XSelectInput(dpy, target, attr.your_event_mask | PropertyChangeMask);
+  }
+
+  for (i = 0; i < XtNumber(calibration_delays) && !interrupted; i++) {
+    matched = TypePattern(&c, calibration_delays[i], send_key);
+    rate = 0;
+    if (1 < c.sent && c.sent_at[0] < c.sent_at[c.sent - 1])
+      rate = (c.sent - 1) * 1000.0 / (c.sent_at[c.sent - 1] - c.sent_at[0]);
+    fprintf(stdout, "delay %2d ms: %3d/%d keys, %6.1f keys/sec\n",
+	    calibration_delays[i], matched, c.len, rate);
+    fflush(stdout);
+
+    if (matched < c.len || c.got_len != c.len) {
+      /* keep the histogram of the failed run if none succeeded */
+      if (best < 0) {
+	best_count = c.arrived;
+	best_lost = c.len - c.arrived;
+	memcpy(best_latency, c.latency, sizeof(double) * c.arrived);
+      }
+      break;
+    }
+    best = calibration_delays[i];
+    best_count = c.arrived;
+    best_lost = 0;
+    memcpy(best_latency, c.latency, sizeof(double) * c.arrived);
+  }
+
+  if (target == None) {
+    XDestroyWindow(dpy, c.window);
+  } else {
+    XGetWindowAttributes(dpy, target, &attr);
+    XSelectInput(dpy, target, attr.your_event_mask & ~PropertyChangeMask);
+  }
+  XSync(dpy, FALSE);
+
+  if (best < 0) {
+    if (target != None && c.arrived == 0)
+      fprintf(stderr, "%s: nothing echoed in XVKBD_ECHO property of the window\n",
+	      PROGRAM_NAME);
+    fprintf(stdout, "no loss-free delay found\n");
+  } else {
+    fprintf(stdout, "highest loss-free rate with delay %d ms\n", best);
+  }
+  PrintHistogram(best_latency, best_count, best_lost);
+  if (0 <= best && !interrupted) {
+    if (class[0] != '\0') SaveDelay(dpy, class, best);
+    else if (target == None) fprintf(stdout, "measured with the probe window, not saved\n");
+    else fprintf(stderr, "%s: the window has no WM_CLASS, not saved\n", PROGRAM_NAME);
+  }
+  fflush(stdout);
+  return best;
+}
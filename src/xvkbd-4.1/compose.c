@@ -0,0 +1,455 @@
+/*
+ * xvkbd - Virtual Keyboard for X Window System
+ *
+ * Copyright (C) 2000 by Tom Sato <VEF00200@nifty.ne.jp>
+ * http://homepage3.nifty.com/tsato/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Find Compose (Multi_key) and dead key sequences to type keysyms
+ * which are not in the keymap, from the Compose file of the locale.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#include <locale.h>
+#include <sys/stat.h>
+#include <X11/Intrinsic.h>
+
+#include "resources.h"
+
+#define COMPOSE_CACHE_MAGIC  "xvkbd-compose-3\n"
+
+#define MAX_COMPOSE_FILES   16
+#define MAX_INCLUDE_DEPTH   8
+
+/*
+ * Entries of the Compose table, sorted by the result (as Unicode
+ * keysym if it has the equivalent, see UnicodeKeysym()) and then
+ * length of the sequence, so that the shortest sequence will be
+ * found first for each result.
+ */
+static struct compose_entry {
+  unsigned int result;
+  unsigned int sequence[MAX_COMPOSE_LENGTH];
+  unsigned char length;
+} *compose_table = NULL;
+static int num_compose_table = 0;
+static int size_compose_table = 0;
+
+/*
+ * Files read to make the table - the cache will be used only
+ * when none of them are modified.
+ */
+static struct compose_file {
+  char path[PATH_MAX];
+  time_t mtime;
+  off_t size;
+} compose_files[MAX_COMPOSE_FILES];
+static int num_compose_files = 0;
+
+/*
+ * The cache also records which file was chosen for which locale, as
+ * another file may be chosen while all the files are unchanged.
+ */
+struct compose_cache_header {
+  char magic[16];
+  char file[PATH_MAX];
+  char locale[100];
+  int num_files;
+  int num_entries;
+};
+
+static const char *LocaleDir(void)
+{
+  const char *dir = getenv("XLOCALEDIR");
+  return (dir != NULL && dir[0] != '\0') ? dir : "/usr/share/X11/locale";
+}
+
+/*
+ * Find the Compose file of the locale from compose.dir - en_US.UTF-8
+ * will be used if there is none for the locale.
+ */
+static const char *ComposeLocale(void)
+{
+  const char *locale;
+
+  locale = setlocale(LC_CTYPE, NULL);
+  if (locale == NULL || strcmp(locale, "C") == 0 || strcmp(locale, "POSIX") == 0) {
+    if ((locale = getenv("LC_ALL")) == NULL || locale[0] == '\0')
+      if ((locale = getenv("LC_CTYPE")) == NULL || locale[0] == '\0')
+	locale = getenv("LANG");
+  }
+  return (locale != NULL && locale[0] != '\0') ? locale : "en_US.UTF-8";
+}
+
+static Boolean SystemComposeFile(char *buf, size_t size)
+{
+  const char *names[2];
+  char path[PATH_MAX], line[500], file[300], name[200];
+  FILE *fp;
+  int i;
+
+  names[0] = ComposeLocale();
+  names[1] = "en_US.UTF-8";
+
+  snprintf(path, sizeof(path), "%s/compose.dir", LocaleDir());
+  for (i = 0; i < 2; i++) {
+    if ((fp = fopen(path, "r")) == NULL) return FALSE;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (line[0] == '#') continue;
+      if (sscanf(line, "%299s %199s", file, name) != 2) continue;
+      if (file[strlen(file) - 1] == ':') file[strlen(file) - 1] = '\0';
+      if (strcmp(name, names[i]) == 0) {
+	fclose(fp);
+	snprintf(buf, size, "%s/%s", LocaleDir(), file);
+	return TRUE;
+      }
+    }
+    fclose(fp);
+  }
+  return FALSE;
+}
+
+/*
+ * Decode a UTF-8 string which is a single character.
+ */
+static KeySym StringToKeysym(const char *str)
+{
+  const unsigned char *cp = (const unsigned char *)str;
+  unsigned int ch;
+  int n;
+
+  if (cp[0] < 0x80) {
+    ch = cp[0];
+    n = 0;
+  } else if ((cp[0] & 0xE0) == 0xC0) {
+    ch = cp[0] & 0x1F;
+    n = 1;
+  } else if ((cp[0] & 0xF0) == 0xE0) {
+    ch = cp[0] & 0x0F;
+    n = 2;
+  } else if ((cp[0] & 0xF8) == 0xF0) {
+    ch = cp[0] & 0x07;
+    n = 3;
+  } else {
+    return NoSymbol;
+  }
+  for (cp++; 0 < n; n--, cp++) {
+    if ((*cp & 0xC0) != 0x80) return NoSymbol;
+    ch = (ch << 6) | (*cp & 0x3F);
+  }
+  if (*cp != '\0' || ch == 0) return NoSymbol;
+  return (ch < 0x100) ? ch : (0x01000000 | ch);
+}
+
+static void AddComposeEntry(KeySym result, KeySym *sequence, int length)
+{
+  struct compose_entry *ep;
+  int i;
+
+  if (size_compose_table <= num_compose_table) {
+    size_compose_table = (size_compose_table == 0) ? 4096 : size_compose_table * 2;
+    compose_table = realloc(compose_table, sizeof(*compose_table) * size_compose_table);
+  }
+  ep = &compose_table[num_compose_table++];
+  memset(ep, 0, sizeof(*ep));
+  ep->result = result;
+  for (i = 0; i < length; i++) ep->sequence[i] = sequence[i];
+  ep->length = length;
+}
+
+/*
+ * Expand %L (Compose file of the locale), %H (home directory)
+ * and %S (system directory) in the name of the included file.
+ */
+static Boolean ExpandIncludeName(const char *name, char *buf, size_t size)
+{
+  char system_file[PATH_MAX];
+  const char *home;
+  size_t len = 0;
+
+  buf[0] = '\0';
+  for (; *name != '\0'; name++) {
+    if (*name != '%') {
+      if (size <= len + 1) return FALSE;
+      buf[len++] = *name;
+      buf[len] = '\0';
+      continue;
+    }
+    switch (*++name) {
+    case 'L':
+      if (!SystemComposeFile(system_file, sizeof(system_file))) return FALSE;
+      len += snprintf(buf + len, size - len, "%s", system_file);
+      break;
+    case 'H':
+      if ((home = getenv("HOME")) == NULL) return FALSE;
+      len += snprintf(buf + len, size - len, "%s", home);
+      break;
+    case 'S':
+      len += snprintf(buf + len, size - len, "%s", LocaleDir());
+      break;
+    case '%':
+      len += snprintf(buf + len, size - len, "%%");
+      break;
+    default:
+      return FALSE;
+    }
+    if (size <= len) return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * Read a Compose file.  Lines are in the form of:
+ *   <Multi_key> <apostrophe> <e> : "\303\251" eacute  # comment
+ * and lines with modifiers before the events are ignored.
+ */
+static void ReadComposeFile(const char *path, int depth)
+{
+  FILE *fp;
+  struct stat st;
+  char line[1000], name[100], str[50], include_path[PATH_MAX];
+  char *cp, *cp2;
+  KeySym sequence[MAX_COMPOSE_LENGTH];
+  KeySym keysym, result;
+  int length, len;
+
+  if (MAX_INCLUDE_DEPTH < depth) return;
+  if ((fp = fopen(path, "r")) == NULL) {
+    if (appres.debug) fprintf(stderr, "xvkbd: can't read compose file %s\n", path);
+    return;
+  }
+  if (num_compose_files < MAX_COMPOSE_FILES && fstat(fileno(fp), &st) == 0) {
+    snprintf(compose_files[num_compose_files].path, PATH_MAX, "%s", path);
+    compose_files[num_compose_files].mtime = st.st_mtime;
+    compose_files[num_compose_files].size = st.st_size;
+    num_compose_files++;
+  }
+  if (appres.debug) fprintf(stderr, "xvkbd: reading compose file %s\n", path);
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    cp = line;
+    while (*cp == ' ' || *cp == '\t') cp++;
+    if (*cp == '#' || *cp == '\n' || *cp == '\0') continue;
+
+    if (strncmp(cp, "include", 7) == 0) {
+      cp = strchr(cp, '"');
+      if (cp == NULL || (cp2 = strchr(cp + 1, '"')) == NULL) continue;
+      *cp2 = '\0';
+      if (ExpandIncludeName(cp + 1, include_path, sizeof(include_path)))
+	ReadComposeFile(include_path, depth + 1);
+      continue;
+    }
+
+    length = 0;
+    while (*cp == '<') {
+      cp2 = strchr(cp, '>');
+      if (cp2 == NULL || sizeof(name) <= cp2 - cp) break;
+      strncpy(name, cp + 1, cp2 - cp - 1);
+      name[cp2 - cp - 1] = '\0';
+      keysym = XStringToKeysym(name);
+      if (keysym == NoSymbol) length = MAX_COMPOSE_LENGTH + 1;
+      if (length < MAX_COMPOSE_LENGTH) sequence[length] = keysym;
+      length++;
+      for (cp = cp2 + 1; *cp == ' ' || *cp == '\t'; cp++);
+    }
+    if (*cp != ':' || length == 0 || MAX_COMPOSE_LENGTH < length) continue;
+    for (cp++; *cp == ' ' || *cp == '\t'; cp++);
+
+    str[0] = '\0';
+    if (*cp == '"') {
+      len = 0;
+      for (cp++; *cp != '"' && *cp != '\0'; cp++) {
+	if (*cp == '\\' && cp[1] != '\0') {
+	  cp++;
+	  if ('0' <= *cp && *cp <= '7') {
+	    int val = 0, n;
+	    for (n = 0; n < 3 && '0' <= *cp && *cp <= '7'; n++, cp++) val = val * 8 + *cp - '0';
+	    cp--;
+	    if (len < sizeof(str) - 1) str[len++] = val;
+	    continue;
+	  } else if (*cp == 'x' || *cp == 'X') {
+	    int val = 0, n;
+	    for (n = 0, cp++; n < 2 && isxdigit((unsigned char)*cp); n++, cp++)
+	      val = val * 16 + (isdigit((unsigned char)*cp) ? *cp - '0' : tolower(*cp) - 'a' + 10);
+	    cp--;
+	    if (len < sizeof(str) - 1) str[len++] = val;
+	    continue;
+	  }
+	}
+	if (len < sizeof(str) - 1) str[len++] = *cp;
+      }
+      str[len] = '\0';
+      if (*cp == '"') cp++;
+      while (*cp == ' ' || *cp == '\t') cp++;
+    }
+
+    result = NoSymbol;
+    if (isalnum((unsigned char)*cp) || *cp == '_') {
+      for (cp2 = cp; isalnum((unsigned char)*cp2) || *cp2 == '_'; cp2++);
+      *cp2 = '\0';
+      result = XStringToKeysym(cp);
+    }
+    if (result == NoSymbol && str[0] != '\0') result = StringToKeysym(str);
+    if (result != NoSymbol) AddComposeEntry(UnicodeKeysym(result), sequence, length);
+  }
+  fclose(fp);
+}
+
+static int CompareComposeEntry(const void *p1, const void *p2)
+{
+  const struct compose_entry *e1 = p1, *e2 = p2;
+
+  if (e1->result != e2->result) return (e1->result < e2->result) ? -1 : 1;
+  return e1->length - e2->length;
+}
+
+/*
+ * The table is saved in binary form under the cache directory.
+ */
+static Boolean LoadComposeCache(const char *path, const char *compose_file)
+{
+  struct compose_cache_header header;
+  struct compose_file file;
+  struct stat st;
+  FILE *fp;
+  int i;
+
+  if ((fp = fopen(path, "r")) == NULL) return FALSE;
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || strncmp(header.magic, COMPOSE_CACHE_MAGIC, sizeof(header.magic)) != 0
+      || strncmp(header.file, compose_file, sizeof(header.file)) != 0
+      || strncmp(header.locale, ComposeLocale(), sizeof(header.locale)) != 0
+      || header.num_files <= 0 || MAX_COMPOSE_FILES < header.num_files
+      || header.num_entries <= 0) {
+    fclose(fp);
+    return FALSE;
+  }
+  for (i = 0; i < header.num_files; i++) {
+    if (fread(&file, sizeof(file), 1, fp) != 1
+	|| stat(file.path, &st) != 0
+	|| st.st_mtime != file.mtime || st.st_size != file.size) {
+      fclose(fp);
+      return FALSE;
+    }
+  }
+  compose_table = malloc(sizeof(*compose_table) * header.num_entries);
+  if (fread(compose_table, sizeof(*compose_table), header.num_entries, fp)
+      != header.num_entries) {
+    free(compose_table);
+    compose_table = NULL;
+    fclose(fp);
+    return FALSE;
+  }
+  fclose(fp);
+  num_compose_table = size_compose_table = header.num_entries;
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: %d compose sequences loaded from %s\n", num_compose_table, path);
+  return TRUE;
+}
+
+static void SaveComposeCache(const char *path, const char *compose_file)
+{
+  char tmp_path[PATH_MAX + 20];
+  struct compose_cache_header header;
+  FILE *fp;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+  if ((fp = fopen(tmp_path, "w")) == NULL) return;
+
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, COMPOSE_CACHE_MAGIC, sizeof(header.magic));
+  strncpy(header.file, compose_file, sizeof(header.file) - 1);
+  strncpy(header.locale, ComposeLocale(), sizeof(header.locale) - 1);
+  header.num_files = num_compose_files;
+  header.num_entries = num_compose_table;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(compose_files, sizeof(compose_files[0]), num_compose_files, fp)
+         != num_compose_files
+      || fwrite(compose_table, sizeof(*compose_table), num_compose_table, fp)
+         != num_compose_table) {
+    fclose(fp);
+    unlink(tmp_path);
+    return;
+  }
+  if (fclose(fp) != 0 || rename(tmp_path, path) != 0) unlink(tmp_path);
+}
+
+/*
+ * Load the Compose file: $XCOMPOSEFILE, ~/.XCompose, or the one
+ * for the locale, as Xlib does.  Returns number of the sequences.
+ */
+int LoadComposeTable(void)
+{
+  char path[PATH_MAX], cache_path[PATH_MAX];
+  const char *file, *home;
+  Boolean use_cache;
+
+  if (compose_table != NULL) return num_compose_table;
+
+  file = getenv("XCOMPOSEFILE");
+  if (file == NULL || file[0] == '\0') {
+    file = NULL;
+    if ((home = getenv("HOME")) != NULL) {
+      snprintf(path, sizeof(path), "%s/.XCompose", home);
+      if (access(path, R_OK) == 0) file = path;
+    }
+    if (file == NULL && SystemComposeFile(path, sizeof(path))) file = path;
+  }
+  if (file == NULL) return 0;
+
+  use_cache = appres.keymap_cache
+    && CacheFileName(NULL, "compose", cache_path, sizeof(cache_path));
+  if (use_cache && LoadComposeCache(cache_path, file)) return num_compose_table;
+
+  ReadComposeFile(file, 0);
+  if (num_compose_table == 0) return 0;
+
+  qsort(compose_table, num_compose_table, sizeof(*compose_table), CompareComposeEntry);
+  if (appres.debug) fprintf(stderr, "xvkbd: %d compose sequences\n", num_compose_table);
+  if (use_cache) SaveComposeCache(cache_path, file);
+  return num_compose_table;
+}
+
+/*
+ * Find the shortest sequence to compose the keysym, of which all the
+ * keysyms are mapped (mapped() returns TRUE).  The sequence will be
+ * stored in sequence[] and its length will be returned, or 0 if
+ * there is no such sequence.
+ */
+int FindComposeSequence(KeySym keysym, Boolean (*mapped)(KeySym), KeySym *sequence)
+{
+  int low, high, mid, i, j;
+
+  low = 0;
+  high = num_compose_table;
+  while (low < high) {  /* find the first entry for the keysym */
+    mid = (low + high) / 2;
+    if (compose_table[mid].result < keysym) low = mid + 1;
+    else high = mid;
+  }
+  for (i = low; i < num_compose_table && compose_table[i].result == keysym; i++) {
+    for (j = 0; j < compose_table[i].length; j++) {
+      if (!mapped(compose_table[i].sequence[j])) break;
+    }
+    if (j == compose_table[i].length) {
+      for (j = 0; j < compose_table[i].length; j++)
+	sequence[j] = compose_table[i].sequence[j];
+      return compose_table[i].length;
+    }
+  }
+  return 0;
+}
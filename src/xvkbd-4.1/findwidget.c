@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xmu/EditresP.h>
 
@@ -60,6 +61,175 @@ static struct WidgetList {
   char *path;
 } *widget_list = NULL;
 
+/*
+ * In batch mode, widget trees which have been read are kept for each
+ * client window, so that following lookups for the same client don't
+ * have to repeat the Editres protocol.  Structure of the windows of
+ * the client will be watched, and the cached tree will be discarded
+ * when a window is created, destroyed or reparented in the client.
+ * There is no toolkit event loop in batch mode, so the events are
+ * read (and the others of the windows discarded) at each lookup.
+ * They are not waited for with a round trip:  a widget window which
+ * has gone meanwhile makes sending fail with BadWindow, and then
+ * ForgetWidgetTree() discards the tree to find the widget again.
+ * Otherwise, the tree is read for each lookup and is not kept.
+ */
+#define MAX_CACHED_CLIENTS 16
+
+static int num_widget_cache = 0;
+static Boolean widget_list_cached = FALSE;  /* widget_list is owned by the cache */
+
+static struct WidgetCache {
+  Window client;
+  int num_widget_list;
+  struct WidgetList *widget_list;
+} widget_cache[MAX_CACHED_CLIENTS];
+
+static void FreeWidgetList(struct WidgetList *list, int num)
+{
+  int i;
+
+  for (i = 0; i < num; i++) {
+    XtFree(list[i].name);
+    XtFree(list[i].class);
+    XtFree(list[i].path);
+  }
+  XtFree((void *)list);
+}
+
+static void DropWidgetCache(int inx)
+{
+  if (appres.debug)
+    fprintf(stderr, "%s: discard cached widget tree of window 0x%lx\n",
+            PROGRAM_NAME, (long)widget_cache[inx].client);
+
+  FreeWidgetList(widget_cache[inx].widget_list, widget_cache[inx].num_widget_list);
+  num_widget_cache--;
+  if (inx < num_widget_cache)
+    memmove(&widget_cache[inx], &widget_cache[inx + 1],
+            sizeof(widget_cache[0]) * (num_widget_cache - inx));
+}
+
+/*
+ * Store the widget list just received from the client to the cache,
+ * and start watching structure of the windows of the client.
+ * The oldest entry will be discarded when the cache is full.
+ */
+static void StoreWidgetCache(Display *dpy, Window client)
+{
+  struct WidgetCache *cp;
+  int i;
+
+  if (num_widget_cache == MAX_CACHED_CLIENTS) DropWidgetCache(0);
+
+  cp = &widget_cache[num_widget_cache++];
+  cp->client = client;
+  cp->widget_list = widget_list;
+  cp->num_widget_list = num_widget_list;
+
+  XSelectInput(dpy, client, StructureNotifyMask | SubstructureNotifyMask);
+  for (i = 0; i < num_widget_list; i++) {
+    if (widget_list[i].window != None && widget_list[i].window != client)
+      XSelectInput(dpy, widget_list[i].window, SubstructureNotifyMask);
+  }
+}
+
+/*
+ * Index of the cached tree which has the window, or -1.
+ */
+static int FindCachedWindow(Window window)
+{
+  int inx, i;
+
+  for (inx = 0; inx < num_widget_cache; inx++) {
+    if (widget_cache[inx].client == window) return inx;
+    for (i = 0; i < widget_cache[inx].num_widget_list; i++) {
+      if (widget_cache[inx].widget_list[i].window == window) return inx;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Discard cached widget tree if the event tells that structure
+ * of windows of the client has been changed.
+ */
+static void CheckWidgetCache(XEvent *event)
+{
+  int inx;
+
+  if (event->type != CreateNotify && event->type != DestroyNotify
+      && event->type != ReparentNotify) return;
+
+  if ((inx = FindCachedWindow(event->xany.window)) != -1) DropWidgetCache(inx);
+}
+
+/*
+ * Events selected by StoreWidgetCache() - those of other types, such
+ * as ConfigureNotify, are only discarded.
+ */
+static Bool IsStructureEvent(Display *dpy, XEvent *event, XPointer arg)
+{
+  switch (event->type) {
+  case CreateNotify:
+  case DestroyNotify:
+  case ReparentNotify:
+  case ConfigureNotify:
+  case MapNotify:
+  case UnmapNotify:
+  case GravityNotify:
+  case CirculateNotify:
+    return FindCachedWindow(event->xany.window) != -1;
+  }
+  return False;
+}
+
+/*
+ * Look up the cache for the client.  Structure change events which
+ * have arrived are processed before that, so that stale tree is not
+ * used.
+ */
+static Boolean LookupWidgetCache(Display *dpy, Window client)
+{
+  XEvent event;
+  int inx;
+
+  if (num_widget_cache == 0) return FALSE;
+
+  while (XCheckIfEvent(dpy, &event, IsStructureEvent, NULL))
+    CheckWidgetCache(&event);
+
+  for (inx = 0; inx < num_widget_cache; inx++) {
+    if (widget_cache[inx].client == client) {
+      widget_list = widget_cache[inx].widget_list;
+      num_widget_list = widget_cache[inx].num_widget_list;
+      widget_list_cached = TRUE;
+      if (appres.debug)
+        fprintf(stderr, "%s: use cached widget tree of window 0x%lx\n",
+                PROGRAM_NAME, (long)client);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * Discard the cached tree of the client (when sending to a widget
+ * in it failed).  Returns TRUE if the tree was cached.
+ */
+Boolean ForgetWidgetTree(Window client)
+{
+  int inx;
+
+  for (inx = 0; inx < num_widget_cache; inx++) {
+    if (widget_cache[inx].client == client) {
+      DropWidgetCache(inx);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
 
 /*
  * This function will be called when the client requests the
@@ -126,12 +296,7 @@ static void GetClientValue(Widget w, XtPointer data,
   switch ((int) error_code) {
   case PartialSuccess:
     if (widget_list != NULL) {
-      for (i = 0; i < num_widget_list; i++) {
-        XtFree(widget_list[i].name);
-        XtFree(widget_list[i].class);
-        XtFree(widget_list[i].path);
-      }
-      XtFree((void *)widget_list);
+      FreeWidgetList(widget_list, num_widget_list);
       widget_list = NULL;
     }
 
@@ -302,18 +467,37 @@ Window FindWidget(Widget w, Window client, const char *name)
     atom_client_value = XInternAtom(dpy, EDITRES_CLIENT_VALUE, False);
   }
 
-  client_window = client;
-  effective_protocol_version = EDITRES_PROTOCOL_VERSION;
-  app_con = XtWidgetToApplicationContext(w);
+  if (appres.list_widgets || !LookupWidgetCache(XtDisplay(w), client)) {
+    if (!widget_list_cached) FreeWidgetList(widget_list, num_widget_list);
+    widget_list = NULL;
+    num_widget_list = 0;
+    widget_list_cached = FALSE;
+
+    client_window = client;
+    effective_protocol_version = EDITRES_PROTOCOL_VERSION;
+    app_con = XtWidgetToApplicationContext(w);
+
+    timer_id = XtAppAddTimeOut(app_con, CLIENT_TIME_OUT, ClientTimeOut, NULL);
+    waiting_response = TRUE;
+    RequestSendWidgetTree(w);
+    while (waiting_response) {
+      XtAppNextEvent(app_con, &event);
+      CheckWidgetCache(&event);
+      XtDispatchEvent(&event);
+    }
+    XtRemoveTimeOut(timer_id);
 
-  timer_id = XtAppAddTimeOut(app_con, CLIENT_TIME_OUT, ClientTimeOut, NULL);
-  waiting_response = TRUE;
-  RequestSendWidgetTree(w);
-  while (waiting_response) {
-    XtAppNextEvent(app_con, &event);
-    XtDispatchEvent(&event);
+    if (widget_list != NULL && strlen(appres.batch) != 0) {
+      for (i = 0; i < num_widget_cache; i++) {
+        if (widget_cache[i].client == client) {
+          DropWidgetCache(i);
+          break;
+        }
+      }
+      StoreWidgetCache(XtDisplay(w), client);
+      widget_list_cached = TRUE;
+    }
   }
-  XtRemoveTimeOut(timer_id);
 
   if (widget_list != NULL && strlen(name) != 0) {
     pattern = name;
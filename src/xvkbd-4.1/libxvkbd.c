@@ -0,0 +1,4151 @@
+/*
+ * xvkbd - Virtual Keyboard for X Window System
+ *
+ * Copyright (C) 2000-2020 by Tom Sato <VEF00200@nifty.com>
+ * http://t-sato.in.coocan.jp/xvkbd/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Keymap reader, planner and event senders of xvkbd, which are
+ * built into the xvkbd program and into libxvkbd.  The interface
+ * of the library is declared in libxvkbd.h and defined at the end
+ * of this file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <X11/Intrinsic.h>
+#include <X11/keysym.h>
+#include <X11/XKBlib.h>
+
+#ifdef USE_XTEST
+# include <X11/extensions/XTest.h>
+#else
+# undef USE_XI2  /* keys are sent to the device with XTEST */
+#endif
+#ifdef USE_XI2
+# include <X11/extensions/XInput.h>
+# include <X11/extensions/XInput2.h>
+#endif
+
+/* libxvkbd is built with -fvisibility=hidden, and only the functions
+   declared in libxvkbd.h are exported */
+#if defined(XVKBD_LIBRARY) && defined(__GNUC__)
+# pragma GCC visibility push(default)
+#endif
+#include "libxvkbd.h"
+#if defined(XVKBD_LIBRARY) && defined(__GNUC__)
+# pragma GCC visibility pop
+#endif
+#include "resources.h"
+#include "keysym2ucs.h"
+
+#ifndef PATH_MAX
+# define PATH_MAX 300
+#endif
+
+/*
+ * Global variables
+ *
+ * appres is set from the resources by the xvkbd program; the values
+ * below are the defaults of the resources, for the library.
+ */
+struct appres_struct appres = {
+#ifdef USE_XTEST
+  .xtest = TRUE,
+#endif
+  .num_lock_state = TRUE,
+  .keypad_keysym = TRUE,
+  .auto_add_keysym = TRUE,
+  .compose = TRUE,
+  .restore_keymap = TRUE,
+  .jump_pointer_policy = "request",
+  .positive_modifiers = "",
+  .text = "",
+  .file = "",
+  .batch = "",
+  .follow = "",
+  .dry_run = "",
+  .paste = "never",
+  .paste_threshold = 256,
+  .paste_selection = "CLIPBOARD",
+  .paste_key = "\\Cv",
+  .paste_timeout = 2000,
+  .window = "",
+  .widget = "",
+  .text_delay = 10,
+  .restore_delay = 100,
+  .motion_rate = 100,
+};
+
+/* hooks for the xvkbd program, for the keyboard on the screen */
+void (*press_key_hook)(const char *key) = NULL;
+void (*read_keymap_hook)(int last_altgr_mask) = NULL;
+
+static KeySym *keysym_table = NULL;
+static int min_keycode, max_keycode;
+static int keysym_per_keycode;
+static Boolean error_detected;
+int send_errors = 0;  /* count of errors detected in SendEvent() */
+
+int alt_mask = 0;
+int meta_mask = 0;
+int super_mask = 0;
+int altgr_mask = 0;
+static int level3_shift_mask = 0;
+static KeySym altgr_keysym = NoSymbol;
+
+int shift_state = 0;
+
+Display *target_dpy = NULL;
+static Boolean shared_display = FALSE;  /* passed to XvkbdOpenDisplay() */
+
+Window focused_window = None;
+Window focused_subwindow = None;
+Window own_window = None;  /* keys are not sent while this window is focused */
+static Window own_window_parent = None;
+
+/*
+ * Input focus used when no window is set explicitly (and needed, see
+ * SendKeyPressedEvent()).  It is read once for each request, and read
+ * again only when FocusIn/FocusOut is reported on the focused window
+ * or on the root window, or _NET_ACTIVE_WINDOW of the root window is
+ * changed.
+ */
+static Boolean focus_tracking = FALSE;
+static Boolean focus_valid = FALSE;
+static Window input_focus = None;
+static Window watched_window = None;
+static long watched_mask = 0;   /* our original event masks of the windows */
+static long root_mask = 0;
+static unsigned long focus_serial = 0;
+static Atom atom_net_active_window = None;
+
+/*
+ * When the window is set explicitly, the input focus is set once
+ * for each request, and set again only when the window loses it.
+ */
+#define FOCUS_CHECK_INTERVAL 50  /* events between XGetInputFocus() checks */
+
+static Boolean focus_set = FALSE;
+static int focus_check_count = 0;
+
+/*
+ * With jumpPointer, the pointer is moved to the window when the first
+ * event of a request is sent and moved back at the end of the request.
+ * jumpPointerPolicy "focus" moves it again when the focus is changed,
+ * and "event" moves it for each event as old versions did.
+ */
+static Boolean pointer_jumped = FALSE;
+static Window jump_window = None;
+static Window jump_root = None;
+static int jump_root_x, jump_root_y;
+
+/*
+ * With xi2Device, a master device pair is created for the process with
+ * XIChangeHierarchy(), and the keys are sent through its XTEST keyboard
+ * instead of the one of the core keyboard.  The new master keyboard has
+ * its own modifier and lock state, so that the modifiers held by the
+ * user need not be released before each key and the user can go on
+ * typing while the keys are sent.  It also has its own input focus and
+ * keymap, which follow the core keyboard.
+ */
+#ifdef USE_XI2
+static XDevice *send_device = NULL;  /* XTEST keyboard of the pair */
+static int send_device_master = 0;   /* master keyboard of the pair */
+static Boolean send_device_tried = FALSE;
+static Boolean send_device_stale = FALSE;  /* keymap is to be copied again */
+static Window send_device_focus = None;
+# define SENDING_TO_DEVICE (send_device != NULL)
+#else
+# define SENDING_TO_DEVICE FALSE
+#endif
+
+/*
+ * With dryRun, the keymap is read from the file instead of the X server,
+ * and the events and the keymap changes are printed to stdout instead
+ * of being sent, so that the planner can be run without a display.
+ */
+#define DRY_RUN (appres.dry_run[0] != '\0')
+
+#define MAX_DRY_RUN_ADDED 32
+
+Boolean dry_run_quiet = FALSE;  /* only count the events (for xvkbd-bench) */
+
+static XModifierKeymap *dry_run_modifiers = NULL;
+static struct {
+  int presses, releases, buttons, motions;
+  int pasted;  /* characters */
+  long delay;  /* ms */
+  int modifiers_added;
+  int keysyms_added;
+  KeySym added[MAX_DRY_RUN_ADDED];
+} dry_run_count;
+
+static void DryRunPrint(const char *format, ...)
+{
+  va_list ap;
+
+  if (dry_run_quiet) return;
+  va_start(ap, format);
+  vfprintf(stdout, format, ap);
+  va_end(ap);
+}
+
+/*
+ * Search for window which has specified instance name (WM_NAME)
+ * or class name (WM_CLASS).
+ */
+static Window FindWindow(Window top, char *name)
+{
+  Window w;
+  Window *children, dummy;
+  unsigned int nchildren;
+  int i;
+  XClassHint hint;
+  char *win_name;
+
+  w = None;
+
+  if (appres.debug) fprintf(stderr, "xvkbd: FindWindow: id=0x%lX", (long)top);
+
+  if (XGetClassHint(target_dpy, top, &hint)) {
+    if (hint.res_name) {
+      if (appres.debug) fprintf(stderr, " instance=\"%s\"", hint.res_name);
+      if (fnmatch(name, hint.res_name, 0) == 0) w = top;
+      XFree(hint.res_name);
+    }
+    if (hint.res_class) {
+      if (appres.debug) fprintf(stderr, " class=\"%s\"", hint.res_class);
+      if (fnmatch(name, hint.res_class, 0) == 0) w = top;
+      XFree(hint.res_class);
+    }
+  }
+  if (XFetchName(target_dpy, top, &win_name)) { /* window title */
+    if (appres.debug) fprintf(stderr, " title=\"%s\"", win_name);
+    if (fnmatch(name, win_name, 0) == 0) w = top;
+    XFree(win_name);
+  }
+
+  if (appres.debug) fprintf(stderr, "%s\n", (w == None) ? "" : " [matched]");
+
+  if (w == None &&
+      XQueryTree(target_dpy, top, &dummy, &dummy, &children, &nchildren)) {
+    for (i = 0; i < nchildren; i++) {
+      w = FindWindow(children[i], name);
+      if (w != None) break;
+    }
+    if (children) XFree((char *)children);
+  }
+
+  return(w);
+}
+
+/*
+ * Get window specified as "root", window ID (hexadecimal value leaded
+ * with "0x", or decimal value), or name or title of the window.
+ */
+Window ResolveWindow(const char *spec)
+{
+  Window w;
+  char ch;
+
+  if (strcmp(spec, "root") == 0)
+    return RootWindow(target_dpy, DefaultScreen(target_dpy));
+  if (sscanf(spec, "0x%lX%c", &w, &ch) == 1 || sscanf(spec, "%ld%c", &w, &ch) == 1)
+    return w;
+  return FindWindow(RootWindow(target_dpy, DefaultScreen(target_dpy)), (char *)spec);
+}
+
+/*
+ * Read keyboard mapping and modifier mapping.
+ * Keyboard mapping is used to know what keys are in shifted position.
+ * Modifier mapping is required because we should know Alt and Meta
+ * key are used as which modifier.
+ */
+static void AddModifier(KeySym keysym);
+static void RecoverKeymapJournals(void);
+#ifdef USE_XI2
+static void CreateSendDevice(void);
+#endif
+
+Boolean need_read_keymap = TRUE;
+static int keymap_changes = 0;  /* count of changes made by AddKeysym/AddModifier */
+
+/*
+ * Keysyms in each XKB group, which may not be in keysym_table[]
+ * (the core keymap).  Only the positions which can be reached with
+ * Shift, AltGr and Level3 are recorded, with the modifiers.
+ */
+static struct group_entry {
+  KeySym keysym;
+  unsigned char keycode;
+  unsigned char group;
+  unsigned char mods;
+} *group_table = NULL;
+static int num_group_table = 0;
+static int num_groups = 0;
+
+static int send_group = -1;  /* XKB group selected with SelectGroup(), or -1 */
+static int original_group = 0;
+
+/*
+ * Index to find position of keysyms in keysym_table[] without scanning
+ * all of the keymap for each character.  For each keysym, the first
+ * position in the 1st-2nd keysyms (normal and Shift) and the first
+ * position in the 3rd-6th keysyms (AltGr and Level3) are recorded,
+ * in the same order as SendKeyPressedEvent() used to search for them,
+ * and the first position in each XKB group from group_table[].
+ * The index is an open addressing hash table, and keycode 0 means
+ * the position is not available.  Keysyms which have Unicode
+ * equivalents are also recorded as the Unicode keysyms
+ * (0x01000000 + UCS), so that characters can be found in the
+ * keymap by the Unicode keysyms.
+ */
+#define INDEX_NORMAL  0
+#define INDEX_ALTGR   1
+
+static struct keysym_index {
+  KeySym keysym;
+  unsigned char keycode[2];
+  unsigned char level[2];
+  unsigned char group_keycode[XkbNumKbdGroups];
+  unsigned char group_mods[XkbNumKbdGroups];
+} *keysym_index = NULL;
+static unsigned int keysym_index_mask = 0;
+static unsigned int keysym_index_count = 0;  /* entries used */
+
+/*
+ * Returns the Unicode keysym for the keysym if it has the equivalent
+ * (or Latin-1 keysym for U+0000 - U+00FF), or the keysym itself.
+ */
+KeySym UnicodeKeysym(KeySym keysym)
+{
+  int low, high, mid;
+
+  if (keysym < 0x100 || 0xFF00 <= keysym) return keysym;
+  low = 0;
+  high = XtNumber(keysym_ucs_table) - 1;
+  while (low <= high) {
+    mid = (low + high) / 2;
+    if (keysym_ucs_table[mid].keysym == keysym) {
+      if (keysym_ucs_table[mid].ucs < 0x100) return keysym_ucs_table[mid].ucs;
+      return 0x01000000 | keysym_ucs_table[mid].ucs;
+    }
+    if (keysym_ucs_table[mid].keysym < keysym) low = mid + 1;
+    else high = mid - 1;
+  }
+  return keysym;
+}
+
+static struct keysym_index *FindKeysymIndex(KeySym keysym, Boolean add)
+{
+  unsigned int inx;
+
+  if (keysym_index == NULL) return NULL;
+  inx = (unsigned int)(keysym * 2654435761u) & keysym_index_mask;
+  while (keysym_index[inx].keysym != NoSymbol) {
+    if (keysym_index[inx].keysym == keysym) return &keysym_index[inx];
+    inx = (inx + 1) & keysym_index_mask;
+  }
+  if (!add) return NULL;
+  keysym_index[inx].keysym = keysym;
+  keysym_index_count++;
+  return &keysym_index[inx];
+}
+
+/*
+ * Record that the keysym is at the specified position of the keymap,
+ * unless the keysym is already known at a preceding position.
+ */
+static void IndexKeysym(int keycode, int level)
+{
+  struct keysym_index *ip;
+  KeySym keysym;
+  int slot, alias;
+
+  keysym = keysym_table[(keycode - min_keycode) * keysym_per_keycode + level];
+  if (keysym == NoSymbol || 6 <= level) return;
+
+  slot = (level < 2) ? INDEX_NORMAL : INDEX_ALTGR;
+  for (alias = 0; alias < 2; alias++) {
+    if (alias) {
+      if (UnicodeKeysym(keysym) == keysym) break;
+      keysym = UnicodeKeysym(keysym);
+    }
+    ip = FindKeysymIndex(keysym, TRUE);
+    if (ip->keycode[slot] == 0 || keycode < ip->keycode[slot]
+	|| (keycode == ip->keycode[slot] && level < ip->level[slot])) {
+      ip->keycode[slot] = keycode;
+      ip->level[slot] = level;
+    }
+  }
+}
+
+static void IndexGroupKeysym(struct group_entry *gp)
+{
+  struct keysym_index *ip;
+  KeySym keysym = gp->keysym;
+  int alias;
+
+  for (alias = 0; alias < 2; alias++) {
+    if (alias) {
+      if (UnicodeKeysym(keysym) == keysym) break;
+      keysym = UnicodeKeysym(keysym);
+    }
+    ip = FindKeysymIndex(keysym, TRUE);
+    if (ip->group_keycode[gp->group] == 0) {
+      ip->group_keycode[gp->group] = gp->keycode;
+      ip->group_mods[gp->group] = gp->mods;
+    }
+  }
+}
+
+static void BuildKeysymIndex(void)
+{
+  unsigned int size;
+  int keycode, level, i;
+
+  size = 64;
+  while (size < ((max_keycode - min_keycode + 1) * keysym_per_keycode + num_group_table) * 4)
+    size *= 2;
+  if (keysym_index != NULL) free(keysym_index);
+  keysym_index = calloc(size, sizeof(struct keysym_index));
+  keysym_index_mask = size - 1;
+  keysym_index_count = 0;
+
+  for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
+    for (level = 0; level < keysym_per_keycode; level++)
+      IndexKeysym(keycode, level);
+  }
+  for (i = 0; i < num_group_table; i++)
+    IndexGroupKeysym(&group_table[i]);
+}
+
+/*
+ * Find position of the keysym in the keymap.  Positions for AltGr
+ * and Level3 will be used only if AltGr is available.
+ */
+static Boolean LookupKeysym(KeySym keysym, int *keycode, int *level)
+{
+  struct keysym_index *ip;
+
+  ip = FindKeysymIndex(keysym, FALSE);
+  if (ip == NULL && UnicodeKeysym(keysym) != keysym)
+    ip = FindKeysymIndex(UnicodeKeysym(keysym), FALSE);
+  if (ip == NULL) return FALSE;
+  if (ip->keycode[INDEX_NORMAL] != 0) {
+    *keycode = ip->keycode[INDEX_NORMAL];
+    *level = ip->level[INDEX_NORMAL];
+    return TRUE;
+  }
+  if (ip->keycode[INDEX_ALTGR] != 0 && altgr_mask && 3 <= keysym_per_keycode) {
+    *keycode = ip->keycode[INDEX_ALTGR];
+    *level = ip->level[INDEX_ALTGR];
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * Find the keysym in the XKB group, and the modifiers to be pressed.
+ */
+static Boolean LookupGroupKeysym(KeySym keysym, int group, int *keycode, unsigned int *mods)
+{
+  struct keysym_index *ip;
+
+  if (group < 0 || num_groups <= group) return FALSE;
+  ip = FindKeysymIndex(keysym, FALSE);
+  if ((ip == NULL || ip->group_keycode[group] == 0) && UnicodeKeysym(keysym) != keysym)
+    ip = FindKeysymIndex(UnicodeKeysym(keysym), FALSE);
+  if (ip == NULL || ip->group_keycode[group] == 0) return FALSE;
+  *keycode = ip->group_keycode[group];
+  *mods = ip->group_mods[group];
+  return TRUE;
+}
+
+/*
+ * Select the XKB group to send following keys (-1 to restore the original
+ * group).  With XTEST, the group is locked with XkbLockGroup(), otherwise
+ * it will be set in the state of the events.
+ */
+static void SelectGroup(int group)
+{
+  XkbStateRec state;
+  unsigned int device = XkbUseCoreKbd;
+
+  if (group == send_group) return;
+  if (DRY_RUN) {
+    DryRunPrint("group: %d\n", (group < 0) ? original_group : group);
+  } else if (appres.xtest) {
+#ifdef USE_XI2
+    if (send_device != NULL) device = send_device->device_id;
+#endif
+    if (send_group < 0) {
+      if (XkbGetState(target_dpy, device, &state) != Success) return;
+      original_group = state.locked_group;
+    }
+    XkbLockGroup(target_dpy, device, (group < 0) ? original_group : group);
+  }
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: SelectGroup: group %d\n", (group < 0) ? original_group : group);
+  send_group = group;
+}
+
+static Boolean IsKeysymMapped(KeySym keysym)
+{
+  int keycode, level;
+  return LookupKeysym(keysym, &keycode, &level);
+}
+
+/*
+ * XKeysymToKeycode(), which looks up the keymap read from the file
+ * in dry run.
+ */
+static KeyCode KeysymToKeycode(KeySym keysym)
+{
+  int keycode, level;
+
+  if (!DRY_RUN) return XKeysymToKeycode(target_dpy, keysym);
+  return LookupKeysym(keysym, &keycode, &level) ? keycode : NoSymbol;
+}
+
+/*
+ * Find the shortest Compose or dead key sequence over the keysyms in
+ * the keymap, to send a keysym which is not in the keymap without
+ * changing the keymap.  The Compose table is loaded when required first.
+ */
+static int ComposeSequence(KeySym keysym, KeySym *sequence)
+{
+  static Boolean loaded = FALSE;
+
+  if (!appres.compose) return 0;
+  if (!loaded) {
+    loaded = TRUE;
+    LoadComposeTable();
+  }
+  return FindComposeSequence(UnicodeKeysym(keysym), IsKeysymMapped, sequence);
+}
+
+/*
+ * The processed keymap (keysym_table[] and the modifier masks) is saved
+ * in a file for each user and display, so that following invocations
+ * can skip reading keymap from the X server.  The file will be used
+ * only when the fingerprint of the server keymap, which is made from
+ * _XKB_RULES_NAMES property of the root window and range of keycodes,
+ * is unchanged.  The cache is used only with -keymap-cache, which must
+ * not be used where the keymap is changed with xmodmap or the like, as
+ * such changes can't be detected with the fingerprint.
+ */
+#define KEYMAP_CACHE_MAGIC  "xvkbd-keymap-3\n"
+
+struct keymap_cache_header {
+  char magic[16];
+  unsigned long long fingerprint;
+  int min_keycode, max_keycode;
+  int keysym_per_keycode;
+  int alt_mask, meta_mask, super_mask, altgr_mask, level3_shift_mask;
+  KeySym altgr_keysym;
+  int num_groups, num_group_table;
+};
+
+static unsigned long long HashBytes(unsigned long long hash, const void *data, size_t len)
+{
+  const unsigned char *cp = data;
+
+  if (hash == 0) hash = 14695981039346656037ULL;
+  while (0 < len--) {
+    hash ^= *cp++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ * Make name of the file to keep data for the display under
+ * $XDG_CACHE_HOME/xvkbd (or ~/.cache/xvkbd), creating the directory
+ * if required.  Returns FALSE if the directory is not available.
+ */
+Boolean CacheFileName(Display *my_dpy, const char *kind, char *buf, size_t size)
+{
+  const char *dir, *home;
+  char *cp;
+  int len;
+
+  dir = getenv("XDG_CACHE_HOME");
+  home = getenv("HOME");
+  if (dir != NULL && dir[0] == '/') {
+    len = snprintf(buf, size, "%s/xvkbd", dir);
+  } else if (home != NULL) {
+    snprintf(buf, size, "%s/.cache", home);
+    mkdir(buf, 0700);
+    len = snprintf(buf, size, "%s/.cache/xvkbd", home);
+  } else {
+    return FALSE;
+  }
+  if (size <= len + 2) return FALSE;
+  if (mkdir(buf, 0700) != 0 && errno != EEXIST) return FALSE;
+
+  snprintf(buf + len, size - len, "/%s-%s", kind,
+	   (my_dpy != NULL) ? DisplayString(my_dpy) : "none");
+  for (cp = buf + len + 1; *cp != '\0'; cp++) {
+    if (*cp == '/') *cp = '_';
+  }
+  return TRUE;
+}
+
+static void GetHostName(char *host, size_t size)
+{
+  if (gethostname(host, size) != 0) snprintf(host, size, "localhost");
+  host[size - 1] = '\0';
+}
+
+static unsigned long long KeymapFingerprint(void)
+{
+  Atom rules, type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+  unsigned long long hash;
+  int range[2];
+
+  range[0] = min_keycode;
+  range[1] = max_keycode;
+  hash = HashBytes(0, range, sizeof(range));
+  rules = XInternAtom(target_dpy, "_XKB_RULES_NAMES", True);
+  if (rules != None
+      && XGetWindowProperty(target_dpy, RootWindow(target_dpy, DefaultScreen(target_dpy)),
+			    rules, 0, 1024, False, AnyPropertyType,
+			    &type, &format, &nitems, &after, &data) == Success
+      && data != NULL) {
+    hash = HashBytes(hash, data, nitems * format / 8);
+    XFree(data);
+  }
+  return hash;
+}
+
+/*
+ * Read the saved keymap from the file.  If fingerprint is NULL,
+ * the keymap is taken regardless of the fingerprint and the range
+ * of the keycodes (for dry run).
+ */
+static Boolean ReadKeymapCache(FILE *fp, const unsigned long long *fingerprint)
+{
+  struct keymap_cache_header header;
+  KeySym *table;
+  struct group_entry *groups;
+  size_t len;
+
+  table = NULL;
+  groups = NULL;
+  if (fread(&header, sizeof(header), 1, fp) == 1
+      && strncmp(header.magic, KEYMAP_CACHE_MAGIC, sizeof(header.magic)) == 0
+      && (fingerprint == NULL
+	  || (header.fingerprint == *fingerprint
+	      && header.min_keycode == min_keycode && header.max_keycode == max_keycode))
+      && 0 < header.min_keycode && header.min_keycode <= header.max_keycode
+      && header.max_keycode <= 255
+      && 0 < header.keysym_per_keycode && 0 <= header.num_group_table) {
+    len = (header.max_keycode - header.min_keycode + 1) * header.keysym_per_keycode;
+    table = malloc(sizeof(KeySym) * len);
+    groups = malloc(sizeof(*groups) * (header.num_group_table + 1));
+    if (fread(table, sizeof(KeySym), len, fp) != len
+	|| fread(groups, sizeof(*groups), header.num_group_table, fp)
+	   != header.num_group_table) {
+      free(table);
+      free(groups);
+      table = NULL;
+    }
+  }
+  if (table == NULL) return FALSE;
+
+  if (keysym_table != NULL) XFree(keysym_table);
+  keysym_table = table;
+  min_keycode = header.min_keycode;
+  max_keycode = header.max_keycode;
+  keysym_per_keycode = header.keysym_per_keycode;
+  alt_mask = header.alt_mask;
+  meta_mask = header.meta_mask;
+  super_mask = header.super_mask;
+  altgr_mask = header.altgr_mask;
+  level3_shift_mask = header.level3_shift_mask;
+  altgr_keysym = header.altgr_keysym;
+  free(group_table);
+  group_table = groups;
+  num_group_table = header.num_group_table;
+  num_groups = header.num_groups;
+  return TRUE;
+}
+
+static Boolean LoadKeymapCache(unsigned long long fingerprint)
+{
+  char path[PATH_MAX];
+  Boolean loaded;
+  FILE *fp;
+
+  if (!CacheFileName(target_dpy, "keymap", path, sizeof(path))) return FALSE;
+  if ((fp = fopen(path, "r")) == NULL) return FALSE;
+  loaded = ReadKeymapCache(fp, &fingerprint);
+  fclose(fp);
+
+  if (loaded && appres.debug) fprintf(stderr, "xvkbd: keymap loaded from %s\n", path);
+  return loaded;
+}
+
+static void SaveKeymapCache(unsigned long long fingerprint)
+{
+  char path[PATH_MAX], tmp_path[PATH_MAX + 20];
+  struct keymap_cache_header header;
+  size_t len;
+  FILE *fp;
+
+  if (!CacheFileName(target_dpy, "keymap", path, sizeof(path))) return;
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+  if ((fp = fopen(tmp_path, "w")) == NULL) return;
+
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, KEYMAP_CACHE_MAGIC, sizeof(header.magic));
+  header.fingerprint = fingerprint;
+  header.min_keycode = min_keycode;
+  header.max_keycode = max_keycode;
+  header.keysym_per_keycode = keysym_per_keycode;
+  header.alt_mask = alt_mask;
+  header.meta_mask = meta_mask;
+  header.super_mask = super_mask;
+  header.altgr_mask = altgr_mask;
+  header.level3_shift_mask = level3_shift_mask;
+  header.altgr_keysym = altgr_keysym;
+  header.num_groups = num_groups;
+  header.num_group_table = num_group_table;
+
+  len = (max_keycode - min_keycode + 1) * keysym_per_keycode;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(keysym_table, sizeof(KeySym), len, fp) != len
+      || fwrite(group_table, sizeof(*group_table), num_group_table, fp) != num_group_table) {
+    fclose(fp);
+    unlink(tmp_path);
+    return;
+  }
+  if (fclose(fp) != 0 || rename(tmp_path, path) != 0) unlink(tmp_path);
+  else if (appres.debug) fprintf(stderr, "xvkbd: keymap saved to %s\n", path);
+}
+
+/*
+ * Remove the saved keymap, when the server keymap has been changed.
+ */
+static void RemoveKeymapCache(void)
+{
+  char path[PATH_MAX];
+
+  if (appres.keymap_cache && CacheFileName(target_dpy, "keymap", path, sizeof(path)))
+    unlink(path);
+}
+
+/*
+ * Read keysyms in all of the XKB groups into group_table[].  Keys with
+ * less groups than others are treated as the XKB server does, according
+ * to their out-of-range group action.  Nothing will be recorded if there
+ * is only one group.
+ */
+static void FetchKeyboardGroups(void)
+{
+  XkbDescPtr xkb;
+  XkbKeyTypePtr type;
+  int keycode, group, key_group, key_groups, level, i, size;
+  unsigned int usable_mods, mods, info;
+  KeySym keysym;
+
+  free(group_table);
+  group_table = NULL;
+  num_group_table = 0;
+  num_groups = 0;
+
+  xkb = XkbGetMap(target_dpy, XkbKeyTypesMask | XkbKeySymsMask, XkbUseCoreKbd);
+  if (xkb == NULL) return;
+
+  for (keycode = xkb->min_key_code; keycode <= xkb->max_key_code; keycode++) {
+    if (num_groups < XkbKeyNumGroups(xkb, keycode))
+      num_groups = XkbKeyNumGroups(xkb, keycode);
+  }
+  if (num_groups < 2) {
+    num_groups = 0;
+    XkbFreeKeyboard(xkb, 0, True);
+    return;
+  }
+
+  usable_mods = ShiftMask | altgr_mask | level3_shift_mask;
+  size = 0;
+  for (keycode = xkb->min_key_code; keycode <= xkb->max_key_code; keycode++) {
+    /* keys out of keysym_table[] are left, as they are for the core keymap */
+    if (keycode < min_keycode || max_keycode < keycode) continue;
+    key_groups = XkbKeyNumGroups(xkb, keycode);
+    if (key_groups == 0) continue;
+    info = XkbKeyGroupInfo(xkb, keycode);
+    for (group = 0; group < num_groups; group++) {
+      key_group = group;
+      if (key_groups <= group) {
+	switch (XkbOutOfRangeGroupAction(info)) {
+	case XkbClampIntoRange:
+	  key_group = key_groups - 1;
+	  break;
+	case XkbRedirectIntoRange:
+	  key_group = XkbOutOfRangeGroupNumber(info);
+	  if (key_groups <= key_group) key_group = 0;
+	  break;
+	default:
+	  key_group = group % key_groups;
+	  break;
+	}
+      }
+      type = XkbKeyKeyType(xkb, keycode, key_group);
+      for (level = 0; level < type->num_levels; level++) {
+	keysym = XkbKeySymEntry(xkb, keycode, level, key_group);
+	if (keysym == NoSymbol) continue;
+	if (level == 0) {
+	  mods = 0;
+	} else {
+	  for (i = 0; i < type->map_count; i++) {
+	    if (type->map[i].active && type->map[i].level == level
+		&& (type->map[i].mods.mask & ~usable_mods) == 0) break;
+	  }
+	  if (type->map_count <= i) continue;
+	  mods = type->map[i].mods.mask;
+	}
+	if (size <= num_group_table) {
+	  size = (size == 0) ? 1024 : size * 2;
+	  group_table = realloc(group_table, sizeof(*group_table) * size);
+	}
+	group_table[num_group_table].keysym = keysym;
+	group_table[num_group_table].keycode = keycode;
+	group_table[num_group_table].group = group;
+	group_table[num_group_table].mods = mods;
+	num_group_table++;
+      }
+    }
+  }
+  XkbFreeKeyboard(xkb, 0, True);
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: %d keysyms in %d XKB groups\n", num_group_table, num_groups);
+}
+
+/*
+ * If the first keysym is alphabet and the second keysym is NoSymbol,
+ * it is equivalent to pair of lowercase and uppercase alphabet.
+ */
+static void NormalizeKeycode(int keycode)
+{
+  int inx = (keycode - min_keycode) * keysym_per_keycode;
+
+  if (keysym_table[inx + 1] == NoSymbol
+      && ((XK_A <= keysym_table[inx] && keysym_table[inx] <= XK_Z)
+	  || (XK_a <= keysym_table[inx] && keysym_table[inx] <= XK_z))) {
+    if (XK_A <= keysym_table[inx] && keysym_table[inx] <= XK_Z)
+      keysym_table[inx] = keysym_table[inx] - XK_A + XK_a;
+    keysym_table[inx + 1] = keysym_table[inx] - XK_a + XK_A;
+  }
+}
+
+/*
+ * Find the modifier masks of Alt, Meta, Super and AltGr
+ * in the modifier mapping.
+ */
+static void ReadModifiers(XModifierKeymap *modifiers)
+{
+  int i;
+  int keycode, pos;
+  KeySym keysym;
+  int mode_switch_mask;
+
+  alt_mask = 0;
+  meta_mask = 0;
+  altgr_mask = 0;
+  super_mask = 0;
+  mode_switch_mask = 0;
+  level3_shift_mask = 0;
+  altgr_keysym = NoSymbol;
+
+  if (appres.debug) fprintf(stderr, "xvkbd: ReadKeymap: max_keypermod=%d\n", modifiers->max_keypermod);
+
+  for (i = 0; i < 8; i++) {
+    for (pos = 0; pos < modifiers->max_keypermod; pos++) {
+      keycode = modifiers->modifiermap[i * modifiers->max_keypermod + pos];
+      if (keycode < min_keycode || max_keycode < keycode) continue;
+
+      keysym = keysym_table[(keycode - min_keycode) * keysym_per_keycode];
+      if (alt_mask == 0 && (keysym == XK_Alt_L || keysym == XK_Alt_R)) {
+	alt_mask = 1 << i;
+	if (i != 3) fprintf(stderr, "%s: warning: Alt is assigned to modifier %d instead of %d\n",
+			    PROGRAM_NAME, i - 2, 1);
+      } else if (meta_mask == 0 && (keysym == XK_Meta_L || keysym == XK_Meta_R)) {
+	meta_mask = 1 << i;
+	if (i != 5) fprintf(stderr, "%s: warning: Meta is assigned to modifier %d instead of %d\n",
+			    PROGRAM_NAME, i - 4, 3);
+      } else if (super_mask == 0 && (keysym == XK_Super_L || keysym == XK_Super_R)) {
+	super_mask = 1 << i;
+	if (i != 6) fprintf(stderr, "%s: warning: Super is assigned to modifier %d instead of %d\n",
+			    PROGRAM_NAME, i - 5, 4);
+      } else if (mode_switch_mask == 0 && keysym == XK_Mode_switch) {
+	mode_switch_mask = 1 << i;
+      } else if (level3_shift_mask == 0 && keysym == XK_ISO_Level3_Shift) {
+	level3_shift_mask = 1 << i;
+      }
+    }
+  }
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: alt_mask = 0x%x, meta_mask = 0x%x, super_mask = 0x%x, "
+	    "altgr_mask = 0x%x, mode_switch_mask = 0x%x, level3_shift_mask = 0x%x\n",
+	    alt_mask, meta_mask, super_mask, altgr_mask, mode_switch_mask, level3_shift_mask);
+
+  if (level3_shift_mask == mode_switch_mask) {
+    mode_switch_mask = 0x2000;
+    if (appres.debug) {
+      fprintf(stderr, "xvkbd: both ISO_Level3_Shift and Mode_switch found\n");
+      fprintf(stderr, "xvkbd: assuming ISO_Level3_Shift=0x%x, Mode_switch=0x%x\n",
+	      level3_shift_mask, mode_switch_mask);
+    }
+  }
+
+  if (mode_switch_mask != 0) {
+    altgr_keysym = XK_Mode_switch;
+    altgr_mask = mode_switch_mask;
+  } else {
+    fprintf(stderr, "%s: Mode_switch not available as a modifier\n", PROGRAM_NAME);
+    if (level3_shift_mask == 0) {
+      fprintf(stderr, "%s: AltGr can't be used\n", PROGRAM_NAME);
+    } else {
+      fprintf(stderr, "%s: although ISO_Level3_Shift is used instead, AltGr may not work correctly\n", PROGRAM_NAME);
+      altgr_keysym = XK_ISO_Level3_Shift;
+      altgr_mask = level3_shift_mask;
+    }
+  }
+}
+
+/*
+ * Read keymap from the X server.
+ */
+static void FetchKeymap(void)
+{
+  int keycode;
+  XModifierKeymap *modifiers;
+
+  /* workaround for wrong keys caused after Shift key is pressed in German locale - xvkbd-3.8 */
+  SendKeyPressedEvent(NoSymbol, !shift_state, 0);
+  SendKeyPressedEvent(NoSymbol, shift_state, 0);
+
+  if (keysym_table != NULL) XFree(keysym_table);
+  keysym_table = XGetKeyboardMapping(target_dpy,
+                             min_keycode, max_keycode - min_keycode + 1,
+                             &keysym_per_keycode);
+  for (keycode = min_keycode; keycode <= max_keycode; keycode++)
+    NormalizeKeycode(keycode);
+
+  modifiers = XGetModifierMapping(target_dpy);
+  ReadModifiers(modifiers);
+  XFreeModifiermap(modifiers);
+
+  FetchKeyboardGroups();
+}
+
+/*
+ * Modifier mapping for dry run when the file doesn't have one,
+ * made from the modifier keys in the keymap as usual X servers do.
+ */
+static XModifierKeymap *DefaultModifiers(void)
+{
+  static const struct {
+    KeySym keysym;
+    int modifier;
+  } default_modifiers[] = {
+    { XK_Shift_L, ShiftMapIndex }, { XK_Shift_R, ShiftMapIndex },
+    { XK_Caps_Lock, LockMapIndex },
+    { XK_Control_L, ControlMapIndex }, { XK_Control_R, ControlMapIndex },
+    { XK_Alt_L, Mod1MapIndex }, { XK_Alt_R, Mod1MapIndex },
+    { XK_Meta_L, Mod1MapIndex }, { XK_Meta_R, Mod1MapIndex },
+    { XK_Num_Lock, Mod2MapIndex },
+    { XK_Super_L, Mod4MapIndex }, { XK_Super_R, Mod4MapIndex },
+    { XK_ISO_Level3_Shift, Mod5MapIndex }, { XK_Mode_switch, Mod5MapIndex },
+  };
+  XModifierKeymap *modifiers;
+  int keycode, i;
+
+  modifiers = XNewModifiermap(0);
+  for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
+    for (i = 0; i < XtNumber(default_modifiers); i++) {
+      if (keysym_table[(keycode - min_keycode) * keysym_per_keycode]
+	  == default_modifiers[i].keysym)
+	modifiers = XInsertModifiermapEntry(modifiers, keycode, default_modifiers[i].modifier);
+    }
+  }
+  return modifiers;
+}
+
+/*
+ * Read the keymap for dry run from the file, which is output of
+ * "xmodmap -pke" (optionally with output of "xmodmap -pm" for the
+ * modifier mapping) or a keymap saved in the cache directory.
+ * If the file can't be read, the keymap will be empty.
+ */
+#define MAX_FILE_KEYSYMS 16
+
+static Boolean LoadKeymapFile(const char *path)
+{
+  static const char *modifier_names[] = {
+    "shift", "lock", "control", "mod1", "mod2", "mod3", "mod4", "mod5"
+  };
+  static KeySym rows[256][MAX_FILE_KEYSYMS];
+  char *line = NULL;
+  size_t line_size = 0;
+  char name[20];
+  char *cp, *word;
+  int keycode, n, i;
+  FILE *fp;
+  Boolean modifiers_found = FALSE;
+  Boolean loaded;
+  XModifierKeymap *modifiers;
+
+  if (dry_run_modifiers != NULL) XFreeModifiermap(dry_run_modifiers);
+  dry_run_modifiers = NULL;
+  free(group_table);
+  group_table = NULL;
+  num_group_table = 0;
+  num_groups = 0;
+
+  fp = fopen(path, "r");
+  if (fp != NULL && ReadKeymapCache(fp, NULL)) {
+    /* the modifier masks are saved with the keymap */
+    fclose(fp);
+    dry_run_modifiers = DefaultModifiers();
+    if (appres.debug) fprintf(stderr, "xvkbd: keymap loaded from %s\n", path);
+    return TRUE;
+  }
+
+  memset(rows, 0, sizeof(rows));
+  min_keycode = 256;
+  max_keycode = 0;
+  keysym_per_keycode = 2;
+  modifiers = XNewModifiermap(0);
+  if (fp != NULL) {
+    rewind(fp);
+    while (getline(&line, &line_size, fp) != -1) {
+      if (sscanf(line, " keycode %d =%n", &keycode, &n) == 1) {
+	if (keycode < 8 || 255 < keycode) continue;
+	if (keycode < min_keycode) min_keycode = keycode;
+	if (max_keycode < keycode) max_keycode = keycode;
+	i = 0;
+	for (word = strtok(line + n, " \t\n"); word != NULL && i < MAX_FILE_KEYSYMS;
+	     word = strtok(NULL, " \t\n")) {
+	  if (strncmp(word, "0x", 2) == 0)
+	    rows[keycode][i] = strtoul(word, NULL, 16);
+	  else if (strcmp(word, "NoSymbol") != 0
+		   && (rows[keycode][i] = XStringToKeysym(word)) == NoSymbol)
+	    fprintf(stderr, "%s: no such keysym: %s\n", PROGRAM_NAME, word);
+	  i++;
+	}
+	if (keysym_per_keycode < i) keysym_per_keycode = i;
+      } else if (sscanf(line, " %19s", name) == 1) {
+	for (i = 0; i < XtNumber(modifier_names); i++) {
+	  if (strcmp(name, modifier_names[i]) == 0) break;
+	}
+	if (XtNumber(modifier_names) <= i) continue;
+	modifiers_found = TRUE;
+	for (cp = strstr(line, "(0x"); cp != NULL; cp = strstr(cp + 1, "(0x")) {
+	  keycode = strtol(cp + 1, NULL, 16);
+	  if (0 < keycode && keycode < 256)
+	    modifiers = XInsertModifiermapEntry(modifiers, keycode, i);
+	}
+      }
+    }
+    free(line);
+    fclose(fp);
+  }
+  loaded = (min_keycode <= max_keycode);
+  if (!loaded) {
+    fprintf(stderr, (fp == NULL) ? "%s: can't read the file: %s\n"
+	    : "%s: no keymap in the file: %s\n", PROGRAM_NAME, path);
+    min_keycode = 8;
+    max_keycode = 255;
+  }
+
+  if (keysym_table != NULL) XFree(keysym_table);
+  keysym_table = calloc((max_keycode - min_keycode + 1) * keysym_per_keycode, sizeof(KeySym));
+  for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
+    memcpy(&keysym_table[(keycode - min_keycode) * keysym_per_keycode], rows[keycode],
+	   sizeof(KeySym) * keysym_per_keycode);
+    NormalizeKeycode(keycode);
+  }
+
+  if (!modifiers_found) {
+    XFreeModifiermap(modifiers);
+    modifiers = DefaultModifiers();
+  }
+  ReadModifiers(modifiers);
+  dry_run_modifiers = modifiers;
+  if (appres.debug && loaded) fprintf(stderr, "xvkbd: keymap loaded from %s\n", path);
+  return loaded;
+}
+
+void ReadKeymap(void)
+{
+  int last_altgr_mask;
+  unsigned long long fingerprint = 0;
+  Boolean cached;
+  int last_keymap_changes;
+  static Boolean keymap_read = FALSE;
+
+  if (appres.debug) fprintf(stderr, "xvkbd: ReadKeymap()\n");
+
+  if (!DRY_RUN) RecoverKeymapJournals();
+#ifdef USE_XI2
+  if (appres.xi2_device && appres.xtest && !send_device_tried && !DRY_RUN)
+    CreateSendDevice();
+  send_device_stale = TRUE;
+#endif
+
+  last_altgr_mask = altgr_mask;
+  last_keymap_changes = keymap_changes;
+  cached = FALSE;
+  if (DRY_RUN) {
+    LoadKeymapFile(appres.dry_run);
+  } else {
+    XDisplayKeycodes(target_dpy, &min_keycode, &max_keycode);
+    /* the cache can't tell changes of the modifiers and the changes
+       made while running, so it is used only for the first read */
+    if (appres.keymap_cache && !keymap_read) {
+      fingerprint = KeymapFingerprint();
+      cached = LoadKeymapCache(fingerprint);
+    }
+    if (!cached) FetchKeymap();
+  }
+  keymap_read = TRUE;
+
+  BuildKeysymIndex();
+
+  if (read_keymap_hook != NULL) read_keymap_hook(last_altgr_mask);
+
+  /* keymap which was modified before now will be read again next time,
+     unless the modification is to be restored at exit */
+  if (appres.keymap_cache && !cached && !DRY_RUN
+      && (appres.restore_keymap || keymap_changes == last_keymap_changes))
+    SaveKeymapCache(fingerprint);
+
+  if (appres.auto_add_keysym) {
+    if (!altgr_mask) AddModifier(XK_Mode_switch);
+  }
+}
+
+/*
+ * Read the keycodes changed by another client again, and update the
+ * index in place.  The whole index is rebuilt only when it is getting
+ * full, or when the XKB groups are used as they must be read again.
+ */
+static void RefreshKeycodes(int first, int count)
+{
+  KeySym *syms;
+  struct keysym_index *ip;
+  int per_keycode, keycode, level, slot;
+  unsigned int i;
+  Boolean rescan;
+
+  if (first < min_keycode) {
+    count -= min_keycode - first;
+    first = min_keycode;
+  }
+  if (max_keycode < first + count - 1) count = max_keycode - first + 1;
+  if (keysym_table == NULL || count <= 0) return;
+
+  syms = XGetKeyboardMapping(target_dpy, first, count, &per_keycode);
+  if (syms == NULL) return;
+  if (per_keycode != keysym_per_keycode) {
+    XFree(syms);
+    need_read_keymap = TRUE;
+    return;
+  }
+  memcpy(&keysym_table[(first - min_keycode) * keysym_per_keycode], syms,
+	 sizeof(KeySym) * count * keysym_per_keycode);
+  XFree(syms);
+  for (keycode = first; keycode < first + count; keycode++)
+    NormalizeKeycode(keycode);
+#ifdef USE_XI2
+  send_device_stale = TRUE;
+#endif
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: RefreshKeycodes: keycode %d-%d\n", first, first + count - 1);
+
+  if (0 < num_groups || keysym_index_mask < keysym_index_count * 2) {
+    FetchKeyboardGroups();
+    BuildKeysymIndex();
+    return;
+  }
+
+  /* forget the positions in the changed keycodes, and if there were
+     any, find the keysyms again in the rest of the keymap */
+  rescan = FALSE;
+  for (i = 0; i <= keysym_index_mask; i++) {
+    ip = &keysym_index[i];
+    if (ip->keysym == NoSymbol) continue;
+    for (slot = 0; slot < 2; slot++) {
+      if (first <= ip->keycode[slot] && ip->keycode[slot] < first + count) {
+	ip->keycode[slot] = 0;
+	rescan = TRUE;
+      }
+    }
+  }
+  for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
+    if (!rescan && (keycode < first || first + count <= keycode)) continue;
+    for (level = 0; level < keysym_per_keycode; level++)
+      IndexKeysym(keycode, level);
+  }
+}
+
+static void HandleMappingNotify(XMappingEvent *event)
+{
+  if (event->request == MappingPointer) return;
+  XRefreshKeyboardMapping(event);
+  if (need_read_keymap) return;
+  if (event->request == MappingKeyboard)
+    RefreshKeycodes(event->first_keycode, event->count);
+  else
+    need_read_keymap = TRUE;
+}
+
+/*
+ * When the display is shared with the program using the library, its
+ * toolkit has to see MappingNotify too, so the events are only peeked
+ * and left in the queue; those handled before are skipped by the serial.
+ */
+#define MAX_PEEKED_MAPPINGS 32
+
+struct peeked_mappings {
+  XMappingEvent event[MAX_PEEKED_MAPPINGS];
+  int count;
+};
+
+static Bool PeekMappingNotify(Display *my_dpy, XEvent *event, XPointer arg)
+{
+  struct peeked_mappings *peeked = (struct peeked_mappings *)arg;
+
+  if (event->type == MappingNotify && peeked->count < MAX_PEEKED_MAPPINGS)
+    peeked->event[peeked->count++] = event->xmapping;
+  return False;
+}
+
+/*
+ * Process MappingNotify events already received, without waiting
+ * for the X server.  Changes of the keyboard mapping are applied
+ * to the keycodes, and the whole keymap is read again before
+ * the next key if the modifier mapping is changed.
+ */
+static void CheckMappingNotify(void)
+{
+  static unsigned long last_serial = 0;  /* of the last event handled */
+  static int handled = 0;                /* events handled with last_serial */
+  struct peeked_mappings peeked;
+  XEvent event;
+  int i, same;
+
+  if (target_dpy == NULL || XEventsQueued(target_dpy, QueuedAfterReading) == 0) return;
+  if (!shared_display) {
+    while (XCheckTypedEvent(target_dpy, MappingNotify, &event))
+      HandleMappingNotify(&event.xmapping);
+    return;
+  }
+
+  peeked.count = 0;
+  XCheckIfEvent(target_dpy, &event, PeekMappingNotify, (XPointer)&peeked);
+  same = 0;
+  for (i = 0; i < peeked.count; i++) {
+    if (peeked.event[i].serial < last_serial) continue;
+    if (peeked.event[i].serial == last_serial && same++ < handled) continue;
+    if (peeked.event[i].serial != last_serial) {
+      last_serial = peeked.event[i].serial;
+      handled = 0;
+      same = 1;
+    }
+    handled++;
+    HandleMappingNotify(&peeked.event[i]);
+  }
+}
+
+/*
+ * Requests made by SendEvent() are recorded with their sequence
+ * numbers, so that errors reported later can be attributed to the
+ * event and the position in the text without XSync() for each event.
+ */
+#define SENT_FOCUS  0  /* XSetInputFocus() */
+#define SENT_EVENT  1  /* XSendEvent() */
+#define SENT_FAKE   2  /* XTestFakeKeyEvent() */
+
+#define SENT_RING_SIZE 256
+
+static struct sent_request {
+  unsigned long serial;
+  int type;
+  int offset;  /* offset in the text, or -1 */
+  Boolean failed;
+  XKeyEvent event;
+} sent_ring[SENT_RING_SIZE];
+static unsigned int sent_count = 0;
+static unsigned int drained_count = 0;  /* sent_count when the errors were read */
+
+static const char *send_text = NULL;  /* text being sent by SendString() */
+static int send_offset = -1;
+
+static void RecordRequest(int type, XKeyEvent *event)
+{
+  struct sent_request *rp = &sent_ring[sent_count++ % SENT_RING_SIZE];
+
+  rp->serial = NextRequest(target_dpy);
+  rp->type = type;
+  rp->offset = send_offset;
+  rp->failed = FALSE;
+  rp->event = *event;
+}
+
+static struct sent_request *FindSentRequest(unsigned long serial)
+{
+  unsigned int i;
+  struct sent_request *rp;
+
+  for (i = 1; i <= SENT_RING_SIZE && i <= sent_count; i++) {
+    rp = &sent_ring[(sent_count - i) % SENT_RING_SIZE];
+    if (rp->serial == serial) return rp;
+    if (rp->serial < serial) break;
+  }
+  return NULL;
+}
+
+/*
+ * The error handler is installed once for the session, as it is
+ * shared by all the threads and connections of the process.  Errors
+ * which are not of our requests (those of the other connections, and
+ * those of the program using the library while nothing is sent) are
+ * passed to the handler which was installed before, if any.
+ */
+static int (*host_error_handler)(Display *, XErrorEvent *) = NULL;
+static Boolean sending = FALSE;        /* in SendRequest() */
+
+/*
+ * Errors of the requests to watch the input focus are ignored, as the
+ * window may be destroyed at any time.  They are not waited for, so
+ * the ranges of the serials of the last few such requests are kept.
+ */
+#define IGNORED_RANGES 8
+
+static struct {
+  unsigned long first, last;
+} ignored_ranges[IGNORED_RANGES];
+static unsigned int num_ignored_ranges = 0;
+static Boolean ignoring_errors = FALSE;
+
+static void BeginIgnoreErrors(void)
+{
+  ignored_ranges[num_ignored_ranges % IGNORED_RANGES].first = NextRequest(target_dpy);
+  ignoring_errors = TRUE;
+}
+
+static void EndIgnoreErrors(void)
+{
+  ignored_ranges[num_ignored_ranges++ % IGNORED_RANGES].last = NextRequest(target_dpy) - 1;
+  ignoring_errors = FALSE;
+}
+
+static Boolean IgnoredError(unsigned long serial)
+{
+  unsigned int i;
+
+  if (ignoring_errors
+      && ignored_ranges[num_ignored_ranges % IGNORED_RANGES].first <= serial)
+    return TRUE;
+  for (i = 1; i <= IGNORED_RANGES && i <= num_ignored_ranges; i++) {
+    if (ignored_ranges[(num_ignored_ranges - i) % IGNORED_RANGES].first <= serial
+	&& serial <= ignored_ranges[(num_ignored_ranges - i) % IGNORED_RANGES].last)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * This will called when X error is detected when attempting to
+ * send a event to a client window;  this will normally caused
+ * when the client window is destroyed.  Errors caused by the
+ * requests of SendEvent() will be handled by HandleSendErrors().
+ */
+int MyErrorHandler(Display *my_dpy, XErrorEvent *event)
+{
+  char msg[200];
+  struct sent_request *rp;
+
+  rp = (my_dpy == target_dpy) ? FindSentRequest(event->serial) : NULL;
+  if (rp == NULL && host_error_handler != NULL && (my_dpy != target_dpy || !sending))
+    return host_error_handler(my_dpy, event);
+  if (rp == NULL && my_dpy == target_dpy && IgnoredError(event->serial)) return 0;
+  if (rp != NULL) {
+    rp->failed = TRUE;
+    error_detected = TRUE;
+  }
+  if (event->error_code == BadWindow) {
+    if (appres.debug) {
+      fprintf(stderr, "xvkbd: BadWindow - couldn't find target window 0x%lX (destroyed?)\n",
+	      (long)event->resourceid);
+      if (rp != NULL && 0 <= rp->offset)
+	fprintf(stderr, "xvkbd:   caused by the key at offset %d of the text\n", rp->offset);
+    }
+    return 0;
+  }
+  XGetErrorText(my_dpy, event->error_code, msg, sizeof(msg) - 1);
+  fprintf(stderr, "xvkbd: X error trapped: %s, request-code=%d\n", msg, event->request_code);
+  if (rp != NULL && 0 <= rp->offset)
+    fprintf(stderr, "xvkbd:   caused by the key at offset %d of the text\n", rp->offset);
+  if (appres.debug) abort();
+  return 0;
+}
+
+/*
+ * Check if the event tells change of the input focus, and remove it
+ * from the queue if it is delivered only because we selected it.
+ */
+static Bool IsFocusChange(Display *my_dpy, XEvent *event, XPointer arg)
+{
+  Window root = RootWindow(my_dpy, DefaultScreen(my_dpy));
+  long mask;
+
+  if (event->type == FocusIn || event->type == FocusOut) {
+    if (event->xfocus.window == root) mask = root_mask;
+    else if (event->xfocus.window == watched_window) mask = watched_mask;
+    else return False;
+    mask &= FocusChangeMask;
+  } else if (event->type == PropertyNotify && event->xproperty.window == root) {
+    mask = root_mask & PropertyChangeMask;
+    if (event->xproperty.atom != atom_net_active_window) return mask == 0;
+  } else {
+    return False;
+  }
+  if (focus_serial <= event->xany.serial) *(Boolean *)arg = TRUE;
+  return mask == 0;
+}
+
+/*
+ * Stop watching the focused window, and also the root window
+ * if "all" is TRUE.
+ */
+static void UnwatchFocus(Boolean all)
+{
+  Window root = RootWindow(target_dpy, DefaultScreen(target_dpy));
+  XEvent event;
+  Boolean changed;
+
+  BeginIgnoreErrors();
+  if (watched_window != None)
+    XSelectInput(target_dpy, watched_window, watched_mask);
+  if (all) XSelectInput(target_dpy, root, root_mask);
+  XSync(target_dpy, FALSE);
+  while (XCheckIfEvent(target_dpy, &event, IsFocusChange, (XPointer)&changed)) ;
+  EndIgnoreErrors();
+
+  watched_window = None;
+  if (all) focus_tracking = FALSE;
+  focus_valid = FALSE;
+}
+
+/*
+ * Read the input focus, and select FocusChangeMask on the focused
+ * window to know when it is changed.
+ */
+static void WatchFocus(void)
+{
+  Window root = RootWindow(target_dpy, DefaultScreen(target_dpy));
+  XWindowAttributes attr;
+  int revert_to;
+
+  BeginIgnoreErrors();
+  if (!focus_tracking) {
+    if (atom_net_active_window == None)
+      atom_net_active_window = XInternAtom(target_dpy, "_NET_ACTIVE_WINDOW", False);
+    root_mask = 0;
+    if (XGetWindowAttributes(target_dpy, root, &attr)) root_mask = attr.your_event_mask;
+    XSelectInput(target_dpy, root, root_mask | FocusChangeMask | PropertyChangeMask);
+    focus_tracking = TRUE;
+  }
+
+  focus_serial = NextRequest(target_dpy);
+  XGetInputFocus(target_dpy, &input_focus, &revert_to);
+  if (input_focus != None && input_focus != PointerRoot && input_focus != root
+      && XGetWindowAttributes(target_dpy, input_focus, &attr)) {
+    watched_window = input_focus;
+    watched_mask = attr.your_event_mask;
+    XSelectInput(target_dpy, watched_window, watched_mask | FocusChangeMask);
+  }
+  EndIgnoreErrors();
+  focus_valid = TRUE;
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: WatchFocus: input focus is 0x%lX\n", (long)input_focus);
+}
+
+/*
+ * Input focus, read by XGetInputFocus() only when it may be changed.
+ */
+static Window TrackedInputFocus(void)
+{
+  XEvent event;
+  Boolean changed = FALSE;
+
+  if (DRY_RUN) return PointerRoot;
+  if (focus_valid) {
+    while (XCheckIfEvent(target_dpy, &event, IsFocusChange, (XPointer)&changed)) ;
+    if (!changed) return input_focus;
+    UnwatchFocus(FALSE);
+  }
+  WatchFocus();
+  return input_focus;
+}
+
+/*
+ * Select FocusChangeMask on the window set explicitly, after the
+ * input focus is set to it.
+ */
+static void WatchFocusedWindow(void)
+{
+  XWindowAttributes attr;
+
+  if (watched_window != focused_window) {
+    BeginIgnoreErrors();
+    if (XGetWindowAttributes(target_dpy, focused_window, &attr)) {
+      watched_window = focused_window;
+      watched_mask = attr.your_event_mask;
+      XSelectInput(target_dpy, watched_window, watched_mask | FocusChangeMask);
+      XSync(target_dpy, FALSE);
+    }
+    EndIgnoreErrors();
+  }
+  focus_serial = NextRequest(target_dpy);
+  focus_check_count = 0;
+  focus_set = TRUE;
+}
+
+/*
+ * Check if the window set explicitly lost the input focus.
+ * FocusOut is checked for each event, and the focus is read only
+ * when it is reported, or once in FOCUS_CHECK_INTERVAL events
+ * in case the window couldn't be watched.
+ */
+static Boolean FocusLost(void)
+{
+  XEvent event;
+  Boolean changed = FALSE;
+  Window focus;
+  int revert_to;
+
+  while (XCheckIfEvent(target_dpy, &event, IsFocusChange, (XPointer)&changed)) ;
+  if (!changed && ++focus_check_count < FOCUS_CHECK_INTERVAL) return FALSE;
+
+  focus_check_count = 0;
+  focus_serial = NextRequest(target_dpy);
+  XGetInputFocus(target_dpy, &focus, &revert_to);
+  if (focus == focused_window || focus == focused_subwindow) return FALSE;
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: input focus moved to 0x%lX\n", (long)focus);
+  return TRUE;
+}
+
+/*
+ * Forget the input focus at the end of a request.
+ */
+static void EndFocusTracking(void)
+{
+  if (focus_tracking || watched_window != None) UnwatchFocus(focus_tracking);
+  focus_set = FALSE;
+#ifdef USE_XI2
+  send_device_focus = None;
+#endif
+}
+
+/*
+ * Move the pointer to the window, remembering the original position.
+ */
+static void JumpPointer(Window w)
+{
+  Window child;
+  int x, y;
+  unsigned int mask;
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: JumpPointer: jump pointer to window 0x%lx\n", (long)w);
+  if (!pointer_jumped)
+    XQueryPointer(target_dpy, w, &jump_root, &child,
+		  &jump_root_x, &jump_root_y, &x, &y, &mask);
+  XWarpPointer(target_dpy, None, w, 0, 0, 0, 0, 1, 1);
+  XFlush(target_dpy);
+  pointer_jumped = TRUE;
+  jump_window = w;
+}
+
+/*
+ * Move the pointer back to the position before JumpPointer().
+ */
+static void JumpPointerBack(void)
+{
+  if (pointer_jumped && appres.jump_pointer_back) {
+    XWarpPointer(target_dpy, None, jump_root, 0, 0, 0, 0, jump_root_x, jump_root_y);
+    XFlush(target_dpy);
+  }
+  pointer_jumped = FALSE;
+  jump_window = None;
+}
+
+#ifdef USE_XI2
+static void RemoveMasterDevice(int deviceid)
+{
+  XIRemoveMasterInfo remove;
+
+  remove.type = XIRemoveMaster;
+  remove.deviceid = deviceid;
+  remove.return_mode = XIFloating;
+  XIChangeHierarchy(target_dpy, (XIAnyHierarchyChangeInfo *)&remove, 1);
+}
+
+/*
+ * Remove the device pairs left by xvkbd processes on this host which
+ * have been terminated without removing them.  The pairs are named
+ * "xvkbd-PID@HOST".
+ */
+static void RemoveStaleDevices(const char *host)
+{
+  XIDeviceInfo *info;
+  char name[256];
+  int ndevices, pid, i;
+
+  info = XIQueryDevice(target_dpy, XIAllMasterDevices, &ndevices);
+  if (info == NULL) return;
+  for (i = 0; i < ndevices; i++) {
+    if (info[i].use != XIMasterKeyboard
+	|| sscanf(info[i].name, "xvkbd-%d@%255[^ ]", &pid, name) != 2
+	|| strcmp(name, host) != 0
+	|| pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH) continue;
+    if (appres.debug) fprintf(stderr, "xvkbd: remove device \"%s\"\n", info[i].name);
+    RemoveMasterDevice(info[i].deviceid);
+  }
+  XIFreeDeviceInfo(info);
+}
+
+/*
+ * Remove the master device pair.  This is called when the session
+ * is closed.
+ */
+static void RemoveSendDevice(void)
+{
+  if (send_device != NULL) XCloseDevice(target_dpy, send_device);
+  send_device = NULL;
+  if (send_device_master != 0) {
+    if (appres.debug) fprintf(stderr, "xvkbd: RemoveSendDevice: master %d\n", send_device_master);
+    RemoveMasterDevice(send_device_master);
+    XSync(target_dpy, FALSE);
+  }
+  send_device_master = 0;
+  send_device_focus = None;
+}
+
+/*
+ * Create the master device pair, and open its XTEST keyboard.
+ * If it fails, the keys are sent with the core XTEST keyboard.
+ */
+static void CreateSendDevice(void)
+{
+  XIAddMasterInfo add;
+  XIDeviceInfo *info;
+  char host[256], name[300], keyboard[320], slave[330];
+  int opcode, event, error, major = 2, minor = 0;
+  int ndevices, slave_id, i;
+
+  send_device_tried = TRUE;
+  if (!XQueryExtension(target_dpy, "XInputExtension", &opcode, &event, &error)
+      || XIQueryVersion(target_dpy, &major, &minor) != Success) {
+    fprintf(stderr, "%s: XInput 2 is not supported by the X server\n", PROGRAM_NAME);
+    return;
+  }
+  GetHostName(host, sizeof(host));
+  RemoveStaleDevices(host);
+
+  snprintf(name, sizeof(name), "xvkbd-%d@%s", (int)getpid(), host);
+  add.type = XIAddMaster;
+  add.name = name;
+  add.send_core = True;
+  add.enable = True;
+  XIChangeHierarchy(target_dpy, (XIAnyHierarchyChangeInfo *)&add, 1);
+
+  /* the X server names the master keyboard "NAME keyboard", and
+     attaches the XTEST keyboard "NAME XTEST keyboard" to it */
+  snprintf(keyboard, sizeof(keyboard), "%s keyboard", name);
+  snprintf(slave, sizeof(slave), "%s XTEST keyboard", name);
+  slave_id = 0;
+  info = XIQueryDevice(target_dpy, XIAllDevices, &ndevices);
+  for (i = 0; info != NULL && i < ndevices; i++) {
+    if (info[i].use == XIMasterKeyboard && strcmp(info[i].name, keyboard) == 0)
+      send_device_master = info[i].deviceid;
+    else if (info[i].use == XISlaveKeyboard && strcmp(info[i].name, slave) == 0)
+      slave_id = info[i].deviceid;
+  }
+  if (info != NULL) XIFreeDeviceInfo(info);
+
+  if (slave_id != 0) send_device = XOpenDevice(target_dpy, slave_id);
+  if (send_device == NULL) {
+    fprintf(stderr, "%s: couldn't create the XInput 2 device \"%s\"\n", PROGRAM_NAME, name);
+    RemoveSendDevice();
+    return;
+  }
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: CreateSendDevice: \"%s\" (master %d, XTEST keyboard %d)\n",
+	    name, send_device_master, slave_id);
+  send_device_stale = TRUE;
+}
+
+/*
+ * Copy the keymap of the core keyboard to the XTEST keyboard of the
+ * pair, as the changes of the keymap are applied only to the core
+ * keyboard and the devices attached to it.
+ */
+static void CopyKeymapToDevice(void)
+{
+  XkbDescPtr xkb;
+
+  send_device_stale = FALSE;
+  xkb = XkbGetMap(target_dpy, XkbAllClientInfoMask | XkbAllServerInfoMask, XkbUseCoreKbd);
+  if (xkb == NULL) return;
+  xkb->device_spec = send_device->device_id;
+  if (!XkbSetMap(target_dpy, XkbAllClientInfoMask | XkbAllServerInfoMask, xkb))
+    fprintf(stderr, "%s: couldn't copy the keymap to the XInput 2 device\n", PROGRAM_NAME);
+  XkbFreeKeyboard(xkb, 0, True);
+  if (appres.debug) fprintf(stderr, "xvkbd: CopyKeymapToDevice()\n");
+}
+
+/*
+ * Set the input focus of the master keyboard to the window.  As the
+ * pointer of the pair is not where the user's is, PointerRoot is
+ * replaced with the window under the core pointer.  The focus is set
+ * again when the window changes, and for each request.
+ */
+static void FocusSendDevice(Window w)
+{
+  Window root, child;
+  int root_x, root_y, x, y;
+  unsigned int mask;
+
+  if (w == send_device_focus) return;
+  send_device_focus = w;
+  if (w == PointerRoot) {
+    w = RootWindow(target_dpy, DefaultScreen(target_dpy));
+    while (XQueryPointer(target_dpy, w, &root, &child, &root_x, &root_y, &x, &y, &mask)
+	   && child != None)
+      w = child;
+  }
+  if (w == None) return;
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: FocusSendDevice: focus window 0x%lx\n", (long)w);
+  XISetFocus(target_dpy, send_device_master, w, CurrentTime);
+}
+#endif
+
+/*
+ * Handle the errors reported for the requests of SendEvent().
+ * XSendEvent() to a window other than focused_subwindow is retried
+ * for focused_subwindow, and for other errors, the focus is reset
+ * because focused window is (probably) no longer exist.
+ */
+static void HandleSendErrors(void)
+{
+  static XKeyEvent retry[SENT_RING_SIZE];
+  int n_retry, i;
+  unsigned int n;
+  struct sent_request *rp;
+  Boolean failed = FALSE;
+
+  error_detected = FALSE;
+  n_retry = 0;
+  for (n = (sent_count < SENT_RING_SIZE) ? sent_count : SENT_RING_SIZE; 0 < n; n--) {
+    rp = &sent_ring[(sent_count - n) % SENT_RING_SIZE];
+    if (!rp->failed) continue;
+    rp->failed = FALSE;
+    if (rp->type == SENT_EVENT
+	&& focused_subwindow != None && focused_subwindow != rp->event.window) {
+      retry[n_retry] = rp->event;
+      retry[n_retry].window = focused_subwindow;
+      n_retry++;
+    } else {
+      failed = TRUE;
+    }
+  }
+
+  if (failed) {
+    send_errors++;
+    XBell(target_dpy, 0);
+    EndFocusTracking();
+    focused_window = None;
+    focused_subwindow = None;
+    return;
+  }
+  for (i = 0; i < n_retry; i++) {
+    if (appres.debug)
+      fprintf(stderr, "   retry: send event to window 0x%lX (0x%lX)\n",
+	      (long)focused_window, (long)retry[i].window);
+    RecordRequest(SENT_EVENT, &retry[i]);
+    XSendEvent(target_dpy, retry[i].window, TRUE, KeyPressMask, (XEvent *)&retry[i]);
+  }
+}
+
+/*
+ * Send event to the focused window.
+ * If input focus is specified explicitly, select the window
+ * before send event to the window.
+ * Errors are handled when they are reported, at the next call or
+ * at the end of the request.
+ */
+void SendEvent(XKeyEvent *event)
+{
+#ifdef USE_XTEST
+  Boolean refocused = FALSE;
+#endif
+  KeySym keysym;
+  int i;
+
+  if (DRY_RUN) {
+    if (event->type == KeyPress) dry_run_count.presses++;
+    else dry_run_count.releases++;
+    if (dry_run_quiet) return;
+
+    /* name the key with its first keysym */
+    keysym = NoSymbol;
+    for (i = 0; i < keysym_per_keycode && keysym == NoSymbol
+	   && min_keycode <= event->keycode && event->keycode <= max_keycode; i++)
+      keysym = keysym_table[(event->keycode - min_keycode) * keysym_per_keycode + i];
+    fprintf(stdout, "%-7s %3d %s", (event->type == KeyPress) ? "press" : "release",
+	    event->keycode, (keysym != NoSymbol) ? XKeysymToString(keysym) : "NoSymbol");
+    if (!appres.xtest && event->state != 0) fprintf(stdout, " state=0x%x", event->state);
+    fprintf(stdout, "\n");
+    return;
+  }
+  /* errors must be read before their requests are overwritten in the ring */
+  if (SENT_RING_SIZE / 2 <= sent_count - drained_count) {
+    drained_count = sent_count;
+    XEventsQueued(event->display, QueuedAfterReading);
+    if (!appres.no_sync
+	&& LastKnownRequestProcessed(event->display) < NextRequest(event->display) - 1)
+      XSync(event->display, FALSE);
+  }
+  if (error_detected) HandleSendErrors();
+  if (focused_window != None && !SENDING_TO_DEVICE && (!focus_set || FocusLost())) {
+    /* set input focus if input focus is set explicitly */
+    if (appres.debug)
+      fprintf(stderr, "xvkbd: set input focus to window 0x%lX (0x%lX)\n",
+              (long)focused_window, (long)event->window);
+    RecordRequest(SENT_FOCUS, event);
+    XSetInputFocus(event->display, focused_window, RevertToParent, CurrentTime);
+    /* not for the ring: the focus is set once for a request (and again
+       if it was lost), and the round trip tells whether the window still
+       exists before the key is sent, which would go to another window
+       with XTEST if it didn't */
+    if (!appres.no_sync) XSync(event->display, FALSE);
+    if (error_detected) {
+      HandleSendErrors();
+      return;
+    }
+    WatchFocusedWindow();
+#ifdef USE_XTEST
+    refocused = TRUE;
+#endif
+  }
+  {
+    if (appres.xtest) {
+#ifdef USE_XTEST
+      if (appres.debug)
+	fprintf(stderr, "xvkbd: XTestFakeKeyEvent(0x%lx, %ld, %d)\n",
+		(long)event->display, (long)event->keycode, event->type == KeyPress);
+#ifdef USE_XI2
+      if (send_device != NULL) {
+	/* the focus of the device is set instead of jumping the pointer */
+	if (send_device_stale) CopyKeymapToDevice();
+	FocusSendDevice((focused_window != None) ? focused_window : event->window);
+	RecordRequest(SENT_FAKE, event);
+	XTestFakeDeviceKeyEvent(event->display, send_device, event->keycode,
+				event->type == KeyPress, NULL, 0, 0);
+	XFlush(event->display);
+      } else
+#endif
+      if (appres.jump_pointer) {
+	Window w;
+
+	w = focused_subwindow;
+	if (w == None && appres.jump_pointer_always) w = TrackedInputFocus();
+	if (w == PointerRoot) w = None;
+
+	if (w != None
+	    && (!pointer_jumped || strcmp(appres.jump_pointer_policy, "event") == 0
+		|| (strcmp(appres.jump_pointer_policy, "focus") == 0
+		    && (refocused || w != jump_window))))
+	  JumpPointer(w);
+
+	RecordRequest(SENT_FAKE, event);
+	XTestFakeKeyEvent(event->display, event->keycode, event->type == KeyPress, 0);
+	XFlush(event->display);
+
+	if (strcmp(appres.jump_pointer_policy, "event") == 0) JumpPointerBack();
+      } else {
+	RecordRequest(SENT_FAKE, event);
+	XTestFakeKeyEvent(event->display, event->keycode, event->type == KeyPress, 0);
+ 	XFlush(event->display);
+      }
+#else
+      fprintf(stderr, "%s: this binary is compiled without XTEST support\n",
+	      PROGRAM_NAME);
+#endif
+    } else {
+      RecordRequest(SENT_EVENT, event);
+      XSendEvent(event->display, event->window, TRUE, KeyPressMask, (XEvent *)event);
+    }
+  }
+}
+
+/*
+ * Changes made to the keymap by AddKeysym() and AddModifier() are
+ * recorded in a journal, and they will be restored when xvkbd
+ * terminates: the keys changed by us are rewritten, and the keys added
+ * as modifiers are removed from the modifier mapping.  The journal is
+ * also written to a file for each process ("journal-DISPLAY.PID@HOST"),
+ * so that the changes can be restored by the next invocation on the
+ * same host if xvkbd is terminated without restoring the keymap.
+ */
+#define JOURNAL_MAGIC  "xvkbd-journal-2"
+
+#define MAX_JOURNAL_MODIFIERS 8
+
+static KeySym *journal_table = NULL;  /* original keysym_table[] */
+static char *journal_changed = NULL;  /* TRUE for the keycodes changed */
+static int journal_keysym_per_keycode;
+static int journal_first_keycode = 0, journal_last_keycode = 0;
+static struct {
+  int modifier;  /* index in the modifier mapping (3 for Mod1) */
+  int keycode;
+} journal_modifiers[MAX_JOURNAL_MODIFIERS];
+static int journal_num_modifiers = 0;
+static char journal_file[PATH_MAX] = "";
+
+volatile sig_atomic_t interrupted = 0;
+
+/*
+ * The journal is written to a temporary file and renamed, so that
+ * a journal broken by a crash while writing won't be replayed.
+ */
+static void WriteKeymapJournal(void)
+{
+  FILE *fp;
+  char host[256], tmp[PATH_MAX + 10];
+  int keycode, inx, i;
+
+  if (strlen(journal_file) == 0) {
+    GetHostName(host, sizeof(host));
+    if (!CacheFileName(target_dpy, "journal", journal_file, sizeof(journal_file) - 300))
+      return;
+    snprintf(journal_file + strlen(journal_file), 300, ".%d@%s", (int)getpid(), host);
+  }
+  snprintf(tmp, sizeof(tmp), "%s.tmp", journal_file);
+  if ((fp = fopen(tmp, "w")) == NULL) return;
+
+  fprintf(fp, "%s\n%d\n", JOURNAL_MAGIC, journal_keysym_per_keycode);
+  for (keycode = journal_first_keycode;
+       journal_first_keycode != 0 && keycode <= journal_last_keycode; keycode++) {
+    if (!journal_changed[keycode - min_keycode]) continue;
+    fprintf(fp, "k %d", keycode);
+    inx = (keycode - min_keycode) * journal_keysym_per_keycode;
+    for (i = 0; i < journal_keysym_per_keycode; i++)
+      fprintf(fp, " %lx", (long)journal_table[inx + i]);
+    fprintf(fp, "\n");
+  }
+  for (i = 0; i < journal_num_modifiers; i++)
+    fprintf(fp, "m %d %d\n", journal_modifiers[i].modifier, journal_modifiers[i].keycode);
+  if (fclose(fp) != 0 || rename(tmp, journal_file) != 0) unlink(tmp);
+}
+
+/*
+ * Record original keysyms of the key before it is modified.
+ */
+static void JournalKeycode(int keycode)
+{
+  size_t len;
+
+  if (!appres.restore_keymap || DRY_RUN) return;
+
+  if (journal_table == NULL) {
+    len = (max_keycode - min_keycode + 1) * keysym_per_keycode;
+    journal_table = malloc(sizeof(KeySym) * len);
+    memcpy(journal_table, keysym_table, sizeof(KeySym) * len);
+    journal_changed = calloc(max_keycode - min_keycode + 1, 1);
+    journal_keysym_per_keycode = keysym_per_keycode;
+  }
+  if (journal_changed[keycode - min_keycode]) return;
+
+  journal_changed[keycode - min_keycode] = TRUE;
+  if (journal_first_keycode == 0 || keycode < journal_first_keycode)
+    journal_first_keycode = keycode;
+  if (journal_last_keycode < keycode)
+    journal_last_keycode = keycode;
+  WriteKeymapJournal();
+}
+
+/*
+ * Record the key to be added to the modifier mapping.
+ */
+static void JournalModifier(int modifier, int keycode)
+{
+  if (!appres.restore_keymap || DRY_RUN
+      || MAX_JOURNAL_MODIFIERS <= journal_num_modifiers) return;
+
+  journal_modifiers[journal_num_modifiers].modifier = modifier;
+  journal_modifiers[journal_num_modifiers].keycode = keycode;
+  journal_num_modifiers++;
+  WriteKeymapJournal();
+}
+
+static void SetModifierMapping(XModifierKeymap *modifiers)
+{
+  int retry;
+
+  if (DRY_RUN) {
+    /* the X server would notify the change and the keymap would be read again */
+    memcpy(dry_run_modifiers->modifiermap, modifiers->modifiermap, 8 * modifiers->max_keypermod);
+    ReadModifiers(dry_run_modifiers);
+    return;
+  }
+
+  /* the request fails while the modifier keys are pressed */
+  for (retry = 0; retry < 10; retry++) {
+    if (XSetModifierMapping(target_dpy, modifiers) != MappingBusy) break;
+    usleep(100000);
+  }
+#ifdef USE_XI2
+  send_device_stale = TRUE;
+#endif
+}
+
+/*
+ * Remove the key from the modifier in the current modifier mapping,
+ * leaving the changes made by others.
+ */
+static XModifierKeymap *RemoveModifier(XModifierKeymap *modifiers, int modifier, int keycode)
+{
+  if (modifier < 0 || 8 <= modifier || keycode < min_keycode || max_keycode < keycode)
+    return modifiers;
+  return XDeleteModifiermapEntry(modifiers, keycode, modifier);
+}
+
+/*
+ * Restore the keymap changes recorded in the journal.
+ * This is registered with atexit().
+ */
+void RestoreKeymap(void)
+{
+  XModifierKeymap *modifiers;
+  int keycode, n, i;
+
+  if (journal_first_keycode == 0 && journal_num_modifiers == 0) return;
+
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: restore keymap (keycode %d-%d%s)\n",
+	    journal_first_keycode, journal_last_keycode,
+	    (0 < journal_num_modifiers) ? ", modifiers" : "");
+
+  /* clients translate the keycodes with the keymap they have when they
+     read the events, so give them time to read the last keys first */
+  XSync(target_dpy, FALSE);
+  if (0 < appres.restore_delay) usleep(appres.restore_delay * 1000);
+
+  /* only the keys changed by us are rewritten (a request for each run
+     of them), as the others in the range may have been changed by
+     someone else meanwhile */
+  keycode = journal_first_keycode;
+  while (journal_first_keycode != 0 && keycode <= journal_last_keycode) {
+    if (!journal_changed[keycode - min_keycode]) {
+      keycode++;
+      continue;
+    }
+    for (n = 1; keycode + n <= journal_last_keycode
+	   && journal_changed[keycode + n - min_keycode]; n++) ;
+    XChangeKeyboardMapping(target_dpy, keycode, journal_keysym_per_keycode,
+			   &journal_table[(keycode - min_keycode) * journal_keysym_per_keycode], n);
+    keycode += n;
+  }
+  if (0 < journal_num_modifiers) {
+    modifiers = XGetModifierMapping(target_dpy);
+    for (i = 0; i < journal_num_modifiers; i++)
+      modifiers = RemoveModifier(modifiers, journal_modifiers[i].modifier,
+				 journal_modifiers[i].keycode);
+    SetModifierMapping(modifiers);
+    XFreeModifiermap(modifiers);
+  }
+  XSync(target_dpy, FALSE);
+
+  free(journal_table);
+  free(journal_changed);
+  journal_table = NULL;
+  journal_changed = NULL;
+  journal_first_keycode = journal_last_keycode = 0;
+  journal_num_modifiers = 0;
+  if (strlen(journal_file) != 0) unlink(journal_file);
+}
+
+/*
+ * Restore the keymap changes left by xvkbd processes which
+ * have been terminated without restoring them.
+ */
+static void RecoverKeymapJournals(void)
+{
+  static Boolean done = FALSE;
+  char path[PATH_MAX], file[PATH_MAX + 300], magic[30], host[256];
+  char *base, *at;
+  DIR *dir;
+  struct dirent *ent;
+  FILE *fp;
+  int pid, kpk, keycode, modifier, i;
+  size_t len;
+  Boolean partial;
+  KeySym row[64];
+  long val;
+  XModifierKeymap *modifiers;
+  char type[2];
+
+  if (done) return;
+  done = TRUE;
+
+  if (!CacheFileName(target_dpy, "journal", path, sizeof(path))) return;
+  GetHostName(host, sizeof(host));
+  base = strrchr(path, '/');
+  *base++ = '\0';
+  if ((dir = opendir(path)) == NULL) return;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, base, strlen(base)) != 0
+	|| ent->d_name[strlen(base)] != '.'
+	|| sscanf(ent->d_name + strlen(base) + 1, "%d", &pid) != 1
+	|| pid == getpid()) continue;
+    /* processes of other hosts sharing the home can't be checked */
+    len = strlen(ent->d_name);
+    partial = (4 < len && strcmp(ent->d_name + len - 4, ".tmp") == 0);
+    at = strchr(ent->d_name + strlen(base) + 1, '@');
+    if (at != NULL) len -= (at + 1 - ent->d_name) + (partial ? 4 : 0);
+    if ((at != NULL && (len != strlen(host) || strncmp(at + 1, host, len) != 0))
+	|| kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+    snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+    if (partial) {
+      /* left by a crash while writing the journal */
+      unlink(file);
+      continue;
+    }
+    if ((fp = fopen(file, "r")) == NULL) continue;
+    if (fscanf(fp, "%29s %d", magic, &kpk) == 2 && strcmp(magic, JOURNAL_MAGIC) == 0
+	&& 0 < kpk && kpk <= 64) {
+      if (appres.debug) fprintf(stderr, "xvkbd: restore keymap from %s\n", file);
+      modifiers = NULL;
+      while (fscanf(fp, "%1s", type) == 1) {
+	if (type[0] == 'k' && fscanf(fp, "%d", &keycode) == 1) {
+	  for (i = 0; i < kpk && fscanf(fp, "%lx", &val) == 1; i++) row[i] = val;
+	  if (i < kpk) break;
+	  if (keycode < min_keycode || max_keycode < keycode) continue;
+	  XChangeKeyboardMapping(target_dpy, keycode, kpk, row, 1);
+	} else if (type[0] == 'm' && fscanf(fp, "%d %d", &modifier, &keycode) == 2) {
+	  if (modifiers == NULL) modifiers = XGetModifierMapping(target_dpy);
+	  modifiers = RemoveModifier(modifiers, modifier, keycode);
+	} else {
+	  break;
+	}
+      }
+      if (modifiers != NULL) {
+	SetModifierMapping(modifiers);
+	XFreeModifiermap(modifiers);
+      }
+      XSync(target_dpy, FALSE);
+    }
+    fclose(fp);
+    unlink(file);
+  }
+  closedir(dir);
+}
+
+/*
+ * SIGINT, SIGTERM and SIGHUP will stop sending the string, so that
+ * the keymap and the keyboard group can be restored (and the device of
+ * xi2Device removed) before exit.  If nothing is to be restored (or the
+ * signal is received again), terminate immediately.
+ */
+void SignalHandler(int sig)
+{
+  signal(sig, SIG_DFL);
+  if (journal_first_keycode == 0 && journal_num_modifiers == 0 && send_group < 0
+      && !SENDING_TO_DEVICE) raise(sig);
+  interrupted = sig;
+}
+
+/*
+ * Insert a specified keysym to unused position in the keymap table.
+ * This will be called to add required keysyms on-the-fly.
+ * if the second parameter is TRUE, the keysym will be added to the
+ * non-shifted position - this may be required for modifier keys
+ * (e.g. Mode_switch) and some special keys (e.g. F20).
+ */
+int AddKeysym(KeySym keysym, Boolean top)
+{
+  int keycode, pos, max_pos, inx, phase;
+
+  if (appres.debug) fprintf(stderr, "xvkbd: AddKeySym(%lx)\n", (long)keysym);
+
+  if (top) {
+    max_pos = 0;
+  } else {
+    max_pos = keysym_per_keycode - 1;
+    if (4 <= max_pos) max_pos = 3;
+  }
+
+  for (phase = 0; phase < 2; phase++) {
+    for (keycode = max_keycode; min_keycode <= keycode; keycode--) {
+      for (pos = max_pos; 0 <= pos; pos--) {
+	inx = (keycode - min_keycode) * keysym_per_keycode;
+	if ((phase != 0 || keysym_table[inx] == NoSymbol)
+	    && (keysym_table[inx] < 0xFF00
+		|| (0x10000 <= keysym_table[inx] && keysym_table[inx] < 0x1008f000))) {
+	  /* In the first phase, to avoid modifing existing keys, */
+	  /* add the keysym only to the keys which has no keysym in the first position. */
+	  /* If no place found in the first phase, add the keysym for any keys except */
+	  /* for modifier keys and other special keys */
+	  if (keysym_table[inx + pos] == NoSymbol) {
+	    if (appres.debug)
+	      fprintf(stderr, "xvkbd: Adding keysym \"%s\" at keycode %d position %d/%d\n",
+		      XKeysymToString(keysym), keycode, pos, keysym_per_keycode);
+	    JournalKeycode(keycode);
+	    keysym_table[inx + pos] = keysym;
+	    if (DRY_RUN) {
+	      DryRunPrint("add: keysym %s at keycode %d position %d\n",
+			  XKeysymToString(keysym), keycode, pos);
+	      if (dry_run_count.keysyms_added < MAX_DRY_RUN_ADDED)
+		dry_run_count.added[dry_run_count.keysyms_added] = keysym;
+	      dry_run_count.keysyms_added++;
+	    } else {
+	      XChangeKeyboardMapping(target_dpy, keycode, keysym_per_keycode, &keysym_table[inx], 1);
+	      XFlush(target_dpy);
+#ifdef USE_XI2
+	      send_device_stale = TRUE;
+#endif
+	    }
+	    IndexKeysym(keycode, pos);
+	    keymap_changes++;
+	    if (!appres.restore_keymap && !DRY_RUN) RemoveKeymapCache();
+	    return keycode;
+	  }
+	}
+      }
+    }
+  }
+  fprintf(stderr, "%s: couldn't add \"%s\" to keymap\n",
+	  PROGRAM_NAME, XKeysymToString(keysym));
+  if (!DRY_RUN) XBell(target_dpy, 0);
+  return NoSymbol;
+}
+
+/*
+ * Add the specified key as a new modifier.
+ * This is used to use Mode_switch (AltGr) as a modifier.
+ */
+static void AddModifier(KeySym keysym)
+{
+  XModifierKeymap *modifiers;
+  int keycode, i, pos;
+
+  keycode = KeysymToKeycode(keysym);
+  if (keycode == NoSymbol) keycode = AddKeysym(keysym, TRUE);
+
+  if (DRY_RUN) {
+    modifiers = XNewModifiermap(dry_run_modifiers->max_keypermod);
+    memcpy(modifiers->modifiermap, dry_run_modifiers->modifiermap,
+	   8 * modifiers->max_keypermod);
+  } else {
+    modifiers = XGetModifierMapping(target_dpy);
+  }
+  for (i = 7; 3 < i; i--) {
+    if (modifiers->modifiermap[i * modifiers->max_keypermod] == NoSymbol
+	|| ((keysym_table[(modifiers->modifiermap[i * modifiers->max_keypermod]
+			   - min_keycode) * keysym_per_keycode]) == XK_ISO_Level3_Shift
+	    && keysym == XK_Mode_switch)) {
+      for (pos = 0; pos < modifiers->max_keypermod; pos++) {
+	if (modifiers->modifiermap[i * modifiers->max_keypermod + pos] == NoSymbol) {
+	  if (appres.debug)
+	    fprintf(stderr, "xvkbd: Adding modifier \"%s\" as %dth modifier\n",
+		    XKeysymToString(keysym), i);
+	  if (DRY_RUN) {
+	    DryRunPrint("add: modifier %s as mod%d\n", XKeysymToString(keysym), i - 2);
+	    dry_run_count.modifiers_added++;
+	  }
+	  JournalModifier(i, keycode);
+	  modifiers->modifiermap[i * modifiers->max_keypermod + pos] = keycode;
+	  SetModifierMapping(modifiers);
+	  XFreeModifiermap(modifiers);
+	  keymap_changes++;
+	  if (!appres.restore_keymap) RemoveKeymapCache();
+	  return;
+	}
+      }
+    }
+  }
+  XFreeModifiermap(modifiers);
+  fprintf(stderr, "%s: couldn't add \"%s\" as modifier\n",
+	  PROGRAM_NAME, XKeysymToString(keysym));
+  if (!DRY_RUN) XBell(target_dpy, 0);
+}
+
+/*
+ * Send sequence of KeyPressed/KeyReleased events to the focused
+ * window to simulate keyboard.  If modifiers (shift, control, etc)
+ * are set ON, many events will be sent.
+ */
+#define SENDKEY_KEY_PRESS    1
+#define SENDKEY_KEY_RELEASE  2
+
+/* TRUE if Caps_Lock was turned off, to be turned on at the end of the request */
+static Boolean caps_lock_cleared = FALSE;
+
+void SendKeyPressedEvent(KeySym keysym, unsigned int shift, int press_release)
+{
+  Window cur_focus;
+  XKeyEvent event;
+  int keycode;
+  Window root, *children;
+  unsigned int n_children;
+  int phase, inx, level;
+  KeySym sequence[MAX_COMPOSE_LENGTH];
+  int len;
+  unsigned int mods;
+  Boolean found;
+
+  if (need_read_keymap) {
+    need_read_keymap = FALSE;
+    ReadKeymap();
+  }
+
+  if (keysym == XK_Caps_Lock && press_release == 0 && caps_lock_cleared) {
+    /* Caps_Lock is already off, and is left off at the end of the request */
+    caps_lock_cleared = FALSE;
+    return;
+  }
+
+  /* XTest events go to the input focus by themselves, so the focus is
+     read only for XSendEvent(), the device of xi2Device, and to check
+     that our own window is not focused */
+  if (focused_subwindow != None)
+    cur_focus = focused_subwindow;
+  else if (appres.xtest && own_window == None && !SENDING_TO_DEVICE)
+    cur_focus = PointerRoot;
+  else
+    cur_focus = TrackedInputFocus();
+
+  if (appres.debug) {
+    char ch = '?';
+    if ((keysym & ~0x7f) == 0 && isprint(keysym)) ch = keysym;
+    fprintf(stderr, "xvkbd: SendKeyPressedEvent: focus=0x%lX, key=0x%lX (%c), shift=0x%lX\n",
+            (long)cur_focus, (long)keysym, ch, (long)shift);
+  }
+
+  if (own_window != None && !DRY_RUN) {
+    if (own_window_parent == None) {
+      XQueryTree(target_dpy, RootWindow(target_dpy, DefaultScreen(target_dpy)),
+                 &root, &own_window_parent, &children, &n_children);
+      XFree(children);
+    }
+    if (cur_focus == None || cur_focus == PointerRoot
+	|| cur_focus == own_window || cur_focus == own_window_parent) {
+      /* notice user when no window focused or the xvkbd window is focused */
+      XBell(target_dpy, 0);
+      return;
+    }
+  }
+
+  found = FALSE;
+  keycode = 0;
+  if (keysym != NoSymbol) {
+    for (phase = 0; phase < 2; phase++) {
+      /* Determine keycode for the keysym:  we use this instead
+	 of XKeysymToKeycode() because we must know shift_state, too */
+      /* 1: Shift, 2: AltGr, 3: Shift+AltGr, 4: Level3, 5: Shift+Level3 */
+      if (0 <= send_group && LookupGroupKeysym(keysym, send_group, &keycode, &mods)) {
+	shift &= ~(ShiftMask | altgr_mask | level3_shift_mask);
+	shift |= mods;
+	found = TRUE;
+      } else if (LookupKeysym(keysym, &keycode, &level)) {
+	inx = (keycode - min_keycode) * keysym_per_keycode;
+	switch (level) {
+	case 0:
+	  shift &= ~altgr_mask;
+	  if (keysym_table[inx + 1] != NoSymbol) shift &= ~ShiftMask;
+	  break;
+	case 1:
+	  shift &= ~altgr_mask;
+	  shift |= ShiftMask;
+	  break;
+	case 2:
+	  shift &= ~ShiftMask;
+	  shift |= altgr_mask;
+	  break;
+	case 3:
+	  shift |= ShiftMask | altgr_mask;
+	  break;
+	case 4:
+	  shift &= ~(ShiftMask | altgr_mask);
+	  shift |= level3_shift_mask;
+	  break;
+	default:
+	  shift &= ~altgr_mask;
+	  shift |= ShiftMask | level3_shift_mask;
+	  break;
+	}
+	found = TRUE;
+      }
+      if (found) break;
+
+      if (phase == 0 && press_release == 0 && (shift & ~ShiftMask) == 0
+	  && (len = ComposeSequence(keysym, sequence)) != 0) {
+	if (appres.debug)
+	  fprintf(stderr, "xvkbd: SendKeyPressedEvent: keysym=0x%lx - compose with %d keys\n",
+		  (long)keysym, len);
+	for (inx = 0; inx < len; inx++) SendKeyPressedEvent(sequence[inx], 0, 0);
+	return;
+      }
+      if (!appres.auto_add_keysym) break;
+
+      if (0xF000 <= keysym) {
+	/* for special keys such as function keys,
+	   first try to add it in the non-shifted position of the keymap */
+	if (AddKeysym(keysym, TRUE) == NoSymbol) AddKeysym(keysym, FALSE);
+      } else {
+	AddKeysym(keysym, FALSE);
+      }
+    }
+    if (appres.debug) {
+      if (found) {
+	fprintf(stderr, "xvkbd: SendKeyPressedEvent: keysym=0x%lx, keycode=%ld, shift=0x%lX\n",
+		(long)keysym, (long)keycode, (long)shift);
+	fprintf(stderr, "keysym table: keycode %d = ", keycode);
+      	for (inx = (keycode - min_keycode) * keysym_per_keycode;
+	     inx < (keycode - min_keycode + 1) * keysym_per_keycode;
+	     inx++)
+	  fprintf(stderr, " 0x%lx (%s)",
+		  (long)keysym_table[inx], keysym_table[inx] ? XKeysymToString(keysym_table[inx]) : "null");
+	fprintf(stderr, "\n");
+      } else
+	fprintf(stderr, "SendKeyPressedEvent: keysym=0x%lx - keycode not found\n",
+		(long)keysym);
+    }
+  }
+
+  event.display = target_dpy;
+  event.window = cur_focus;
+  event.root = DRY_RUN ? None : RootWindow(event.display, DefaultScreen(event.display));
+  event.subwindow = None;
+  event.time = CurrentTime;
+  event.x = 1;
+  event.y = 1;
+  event.x_root = 1;
+  event.y_root = 1;
+  event.same_screen = TRUE;
+
+#ifdef USE_XTEST
+  /* modifiers pressed on the keyboard are unknown in dry run, and
+     don't affect the device of xi2Device */
+  if (appres.xtest && press_release == 0 && !DRY_RUN && !SENDING_TO_DEVICE) {
+    Window root, child;
+    int root_x, root_y, x, y;
+    unsigned int mask;
+
+    XQueryPointer(target_dpy, event.root, &root, &child, &root_x, &root_y, &x, &y, &mask);
+
+    event.type = KeyRelease;
+    event.state = 0;
+    if (mask & ControlMask) {
+      event.keycode = KeysymToKeycode(XK_Control_L);
+      SendEvent(&event);
+    }
+    if (mask & alt_mask) {
+      event.keycode = KeysymToKeycode(XK_Alt_L);
+      SendEvent(&event);
+    }
+    if (mask & meta_mask) {
+      event.keycode = KeysymToKeycode(XK_Meta_L);
+      SendEvent(&event);
+    }
+    if (mask & super_mask) {
+      event.keycode = KeysymToKeycode(XK_Super_L);
+      SendEvent(&event);
+    }
+    if (mask & altgr_mask) {
+      if (0 < appres.altgr_keycode)
+	event.keycode = appres.altgr_keycode;
+      else
+	event.keycode = KeysymToKeycode(altgr_keysym);
+      SendEvent(&event);
+    }
+    if (mask & level3_shift_mask) {
+      event.keycode = KeysymToKeycode(XK_ISO_Level3_Shift);
+      SendEvent(&event);
+    }
+    if (mask & ShiftMask) {
+      event.keycode = KeysymToKeycode(XK_Shift_L);
+      SendEvent(&event);
+    }
+    if (mask & LockMask) {
+      /* turn Caps_Lock off until the end of the request */
+      if (appres.debug) fprintf(stderr, "xvkbd: turn Caps_Lock off\n");
+      caps_lock_cleared = TRUE;
+      event.type = KeyPress;
+      event.keycode = KeysymToKeycode(XK_Caps_Lock);
+      SendEvent(&event);
+      event.type = KeyRelease;
+      SendEvent(&event);
+    }
+  }
+#endif
+
+  event.type = KeyPress;
+  event.state = (0 < send_group && !appres.xtest) ? XkbBuildCoreState(0, send_group) : 0;
+  if (shift & ControlMask) {
+    if (appres.debug) fprintf(stderr, "[Control] ");
+    event.keycode = KeysymToKeycode(XK_Control_L);
+    SendEvent(&event);
+    event.state |= ControlMask;
+  }
+  if (shift & alt_mask) {
+    if (appres.debug) fprintf(stderr, "[Alt] ");
+    event.keycode = KeysymToKeycode(XK_Alt_L);
+    SendEvent(&event);
+    event.state |= alt_mask;
+  }
+  if (shift & meta_mask) {
+    if (appres.debug) fprintf(stderr, "[Meta] ");
+    event.keycode = KeysymToKeycode(XK_Meta_L);
+    SendEvent(&event);
+    event.state |= meta_mask;
+  }
+  if (shift & super_mask) {
+    if (appres.debug) fprintf(stderr, "[Super] ");
+    event.keycode = KeysymToKeycode(XK_Super_L);
+    SendEvent(&event);
+    event.state |= super_mask;
+  }
+  if (shift & altgr_mask) {
+    if (appres.debug) fprintf(stderr, "[AltGr] ");
+    if (0 < appres.altgr_keycode)
+      event.keycode = appres.altgr_keycode;
+    else
+      event.keycode = KeysymToKeycode(altgr_keysym);
+    SendEvent(&event);
+    event.state |= altgr_mask;
+  }
+  if (shift & level3_shift_mask) {
+    if (appres.debug) fprintf(stderr, "[Level3] ");
+    event.keycode = KeysymToKeycode(XK_ISO_Level3_Shift);
+    SendEvent(&event);
+    event.state |= level3_shift_mask;
+  }
+  if (shift & ShiftMask) {
+    if (appres.debug) fprintf(stderr, "[Shift] ");
+    event.keycode = KeysymToKeycode(XK_Shift_L);
+    SendEvent(&event);
+    event.state |= ShiftMask;
+  }
+
+  if (keysym != NoSymbol) {  /* send event for the key itself */
+    event.keycode = found ? keycode : KeysymToKeycode(keysym);
+
+
+    if (event.keycode == NoSymbol) {
+      if ((keysym & ~0x7f) == 0 && isprint(keysym))
+        fprintf(stderr, "%s: no such key: %c\n",
+                PROGRAM_NAME, (char)keysym);
+      else if (XKeysymToString(keysym) != NULL)
+        fprintf(stderr, "%s: no such key: keysym=%s (0x%lX)\n",
+                PROGRAM_NAME, XKeysymToString(keysym), (long)keysym);
+      else
+        fprintf(stderr, "%s: no such key: keysym=0x%lX\n",
+                PROGRAM_NAME, (long)keysym);
+      if (!DRY_RUN) XBell(target_dpy, 0);
+    } else if (press_release == 0) {
+      SendEvent(&event);
+      event.type = KeyRelease;
+      SendEvent(&event);
+    } else {
+      if (press_release & SENDKEY_KEY_PRESS) SendEvent(&event);
+      event.type = KeyRelease;
+      if (press_release & SENDKEY_KEY_RELEASE) SendEvent(&event);
+    }
+  }
+
+  event.type = KeyRelease;
+  if (shift & ShiftMask) {
+    event.keycode = KeysymToKeycode(XK_Shift_L);
+    SendEvent(&event);
+    event.state &= ~ShiftMask;
+  }
+  if (press_release == 0) {
+    if (shift & altgr_mask) {
+      if (0 < appres.altgr_keycode)
+	event.keycode = appres.altgr_keycode;
+      else
+	event.keycode = KeysymToKeycode(altgr_keysym);
+      SendEvent(&event);
+      event.state &= ~altgr_mask;
+    }
+    if (shift & level3_shift_mask) {
+      event.keycode = KeysymToKeycode(XK_ISO_Level3_Shift);
+      SendEvent(&event);
+      event.state &= ~level3_shift_mask;
+    }
+    if (shift & meta_mask) {
+      event.keycode = KeysymToKeycode(XK_Meta_L);
+      SendEvent(&event);
+      event.state &= ~meta_mask;
+    }
+    if (shift & super_mask) {
+      event.keycode = KeysymToKeycode(XK_Super_L);
+      SendEvent(&event);
+      event.state &= ~super_mask;
+    }
+    if (shift & alt_mask) {
+      event.keycode = KeysymToKeycode(XK_Alt_L);
+      SendEvent(&event);
+      event.state &= ~alt_mask;
+    }
+    if (shift & ControlMask) {
+      event.keycode = KeysymToKeycode(XK_Control_L);
+      SendEvent(&event);
+      event.state &= ~ControlMask;
+    }
+  }
+
+  if (appres.no_sync && !DRY_RUN) XFlush(target_dpy);
+}
+
+/*
+ * Turn Caps_Lock on again if it was turned off by SendKeyPressedEvent().
+ */
+static void RestoreCapsLock(void)
+{
+  XKeyEvent event;
+
+  if (!caps_lock_cleared) return;
+  caps_lock_cleared = FALSE;
+  if (appres.debug) fprintf(stderr, "xvkbd: turn Caps_Lock on again\n");
+
+  memset(&event, 0, sizeof(event));
+  event.display = target_dpy;
+  event.window = (focused_subwindow != None) ? focused_subwindow : input_focus;
+  event.root = RootWindow(event.display, DefaultScreen(event.display));
+  event.time = CurrentTime;
+  event.same_screen = TRUE;
+  event.keycode = KeysymToKeycode(XK_Caps_Lock);
+  event.type = KeyPress;
+  SendEvent(&event);
+  event.type = KeyRelease;
+  SendEvent(&event);
+}
+
+/*
+ * Planner for runs of plain characters (up to the next backslash):
+ * each character is given the method to send it, consecutive characters
+ * with the same method (and XKB group) make a segment, and each segment
+ * is sent with the cheapest method according to the cost estimated from
+ * the number of events, round trips and keymap changes needed.
+ * Characters in other XKB groups are sent after locking the group,
+ * and the original group is restored at the end of the run.
+ * Pasting costs as much as typing pasteThreshold plain characters
+ * ("auto"), nothing ("always"), or is not allowed ("never").
+ */
+#define PLAN_KEYS     0  /* keystrokes on the current keymap */
+#define PLAN_GROUP    1  /* keystrokes in another XKB group */
+#define PLAN_COMPOSE  2  /* Compose or dead key sequence */
+#define PLAN_REMAP    3  /* keystrokes after adding the keysym with AddKeysym() */
+#define PLAN_PASTE    4  /* paste through the selection */
+#define PLAN_NONE     5  /* can't be sent */
+
+#define COST_EVENT          1
+#define COST_ROUND_TRIP     4
+#define COST_GROUP_SWITCH   (2 * COST_ROUND_TRIP)  /* XkbLockGroup() and restore */
+#define COST_KEYMAP_CHANGE  200  /* XChangeKeyboardMapping() and MappingNotify to all clients */
+#define COST_INFINITE       0x3FFFFFFFL
+
+#define MAX_PLAN_REMAP  16
+
+static const char *plan_method_name[] = { "keys", "group", "compose", "remap", "paste", "none" };
+
+struct plan_segment {
+  int method;
+  int group;  /* XKB group for PLAN_GROUP */
+  int start;  /* position of the first character in the run */
+  int len;    /* number of characters */
+  long cost;
+};
+
+static Boolean pasting = FALSE;
+
+#define MAPPING_CHECK_INTERVAL 64  /* keys between CheckMappingNotify() in a run */
+
+static void SendPasteKey(void)
+{
+  SendString(appres.paste_key);
+}
+
+/*
+ * Wait for ms milliseconds, which are only added up in dry run.
+ */
+static void Delay(int ms)
+{
+  if (DRY_RUN) dry_run_count.delay += ms;
+  else usleep(ms * 1000);
+}
+
+/*
+ * Decode a UTF-8 character.  Returns number of the bytes used,
+ * and a byte which is not a part of valid UTF-8 character is taken
+ * as a Latin-1 character.
+ */
+static int DecodeUtf8(const unsigned char *str, int len, unsigned int *ch)
+{
+  unsigned int c;
+  int n, i;
+
+  if (str[0] < 0xC2 || 0xF4 < str[0]) {
+    *ch = str[0];
+    return 1;
+  }
+  n = (str[0] < 0xE0) ? 2 : (str[0] < 0xF0) ? 3 : 4;
+  if (len < n) {
+    *ch = str[0];
+    return 1;
+  }
+  c = str[0] & (0x7F >> n);
+  for (i = 1; i < n; i++) {
+    if ((str[i] & 0xC0) != 0x80) {
+      *ch = str[0];
+      return 1;
+    }
+    c = (c << 6) | (str[i] & 0x3F);
+  }
+  if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || 0x10FFFF < c))
+      || (0xD800 <= c && c <= 0xDFFF)) {
+    *ch = str[0];
+    return 1;
+  }
+  *ch = c;
+  return n;
+}
+
+static int EncodeUtf8(unsigned int ch, char *buf)
+{
+  if (ch < 0x80) {
+    buf[0] = ch;
+    return 1;
+  } else if (ch < 0x800) {
+    buf[0] = 0xC0 | (ch >> 6);
+    buf[1] = 0x80 | (ch & 0x3F);
+    return 2;
+  } else if (ch < 0x10000) {
+    buf[0] = 0xE0 | (ch >> 12);
+    buf[1] = 0x80 | ((ch >> 6) & 0x3F);
+    buf[2] = 0x80 | (ch & 0x3F);
+    return 3;
+  }
+  buf[0] = 0xF0 | (ch >> 18);
+  buf[1] = 0x80 | ((ch >> 12) & 0x3F);
+  buf[2] = 0x80 | ((ch >> 6) & 0x3F);
+  buf[3] = 0x80 | (ch & 0x3F);
+  return 4;
+}
+
+/*
+ * Cost of a keystroke with the number of modifiers to be pressed.
+ */
+static long KeyCost(int modifiers)
+{
+  long events = 2 + modifiers * 2;
+  long round_trips = 0;
+
+#ifdef USE_XTEST
+  if (appres.xtest && !SENDING_TO_DEVICE) round_trips++;  /* XQueryPointer() */
+#endif
+  return events * COST_EVENT + round_trips * COST_ROUND_TRIP;
+}
+
+/*
+ * Cost of a keysym in the keymap, or COST_INFINITE if it isn't.
+ */
+static long KeysymCost(KeySym keysym)
+{
+  static const int level_modifiers[] = { 0, 1, 1, 2, 1, 2 };
+  int keycode, level;
+
+  if (!LookupKeysym(keysym, &keycode, &level)) return COST_INFINITE;
+  return KeyCost(level < XtNumber(level_modifiers) ? level_modifiers[level] : 2);
+}
+
+/*
+ * Cost of a keysym in the XKB group, or COST_INFINITE if it isn't.
+ */
+static long GroupKeysymCost(KeySym keysym, int group)
+{
+  int keycode, modifiers;
+  unsigned int mods;
+
+  if (!LookupGroupKeysym(keysym, group, &keycode, &mods)) return COST_INFINITE;
+  for (modifiers = 0; mods != 0; mods &= mods - 1) modifiers++;
+  return KeyCost(modifiers);
+}
+
+/*
+ * Find the cheapest method to send the keysym.  Switching to another
+ * XKB group is counted in the comparison, so a character in the group
+ * of the preceding character will be sent in the group, to avoid
+ * switching the group for spaces and punctuations.  The methods are
+ * preferred in the order below when the costs are equal.
+ */
+static int PlanCharacter(KeySym keysym, int last_group, KeySym *remapped, int *n_remapped,
+			 long *cost, int *group)
+{
+  KeySym sequence[MAX_COMPOSE_LENGTH];
+  int method = PLAN_NONE;
+  long c, best = COST_INFINITE;
+  int len, i;
+
+  *group = -1;
+  *cost = COST_INFINITE;
+  if (0 <= last_group && (c = GroupKeysymCost(keysym, last_group)) < best) {
+    method = PLAN_GROUP;
+    *group = last_group;
+    *cost = best = c;
+  }
+  if ((c = KeysymCost(keysym)) < best) {
+    method = PLAN_KEYS;
+    *group = -1;
+    *cost = best = c;
+  }
+  for (i = 0; i < num_groups; i++) {
+    if (i == last_group) continue;
+    c = GroupKeysymCost(keysym, i);
+    if (c < COST_INFINITE && c + COST_GROUP_SWITCH < best) {
+      method = PLAN_GROUP;
+      *group = i;
+      *cost = c;
+      best = c + COST_GROUP_SWITCH;
+    }
+  }
+  if ((len = ComposeSequence(keysym, sequence)) != 0) {
+    for (c = 0, i = 0; i < len; i++) c += KeysymCost(sequence[i]);
+    if (c < best) {
+      method = PLAN_COMPOSE;
+      *group = -1;
+      *cost = best = c;
+    }
+  }
+  for (i = 0; i < *n_remapped && remapped[i] != keysym; i++) ;
+  c = KeyCost(0) + ((i < *n_remapped) ? 0 : COST_KEYMAP_CHANGE);
+  if ((i < *n_remapped || appres.auto_add_keysym) && c < best) {
+    method = PLAN_REMAP;
+    *group = -1;
+    *cost = best = c;
+    if (*n_remapped <= i && *n_remapped < MAX_PLAN_REMAP) remapped[(*n_remapped)++] = keysym;
+  }
+  return method;
+}
+
+/*
+ * Make plan to send the characters (keysyms in chars[]) in plan[]
+ * (at most len segments), and return number of the segments.
+ */
+static int PlanRun(const KeySym *chars, int len, struct plan_segment *plan)
+{
+  KeySym remapped[MAX_PLAN_REMAP];
+  int n_remapped = 0;
+  int n = 0, i, method, group;
+  long cost, total = 0, paste_cost = COST_INFINITE;
+
+  for (i = 0; i < len; i++) {
+    method = PlanCharacter(chars[i], (0 < n) ? plan[n - 1].group : -1,
+			   remapped, &n_remapped, &cost, &group);
+    if (n == 0 || plan[n - 1].method != method || plan[n - 1].group != group) {
+      plan[n].method = method;
+      plan[n].group = group;
+      plan[n].start = i;
+      plan[n].len = 0;
+      plan[n].cost = (method == PLAN_GROUP) ? COST_GROUP_SWITCH : 0;
+      total += plan[n].cost;
+      n++;
+    }
+    plan[n - 1].len++;
+    plan[n - 1].cost += cost;
+    if (COST_INFINITE < plan[n - 1].cost) plan[n - 1].cost = COST_INFINITE;
+    total += cost;
+    if (COST_INFINITE < total) total = COST_INFINITE;
+  }
+
+  if (!pasting && strcmp(appres.paste, "always") == 0)
+    paste_cost = 0;
+  else if (!pasting && strcmp(appres.paste, "auto") == 0)
+    paste_cost = appres.paste_threshold * KeyCost(0);
+
+  if (paste_cost <= total && paste_cost < COST_INFINITE) {
+    plan[0].method = PLAN_PASTE;
+    plan[0].group = -1;
+    plan[0].start = 0;
+    plan[0].len = len;
+    plan[0].cost = paste_cost;
+    n = 1;
+  } else {
+    for (i = 0; i < n; i++) {
+      if (plan[i].method != PLAN_KEYS && paste_cost < plan[i].cost) {
+	plan[i].method = PLAN_PASTE;
+	plan[i].group = -1;
+	plan[i].cost = paste_cost;
+      }
+    }
+  }
+  return n;
+}
+
+/*
+ * Send the character with the method given in the plan, rather than
+ * the one SendKeyPressedEvent() would find, so that it is sent as the
+ * plan shows.  The XKB group of PLAN_GROUP is selected by the caller.
+ */
+static void SendPlannedCharacter(KeySym keysym, int method)
+{
+  KeySym sequence[MAX_COMPOSE_LENGTH];
+  int keycode, level, len, i;
+
+  switch (method) {
+  case PLAN_COMPOSE:
+    if ((len = ComposeSequence(keysym, sequence)) == 0) break;
+    if (appres.debug)
+      fprintf(stderr, "xvkbd: SendPlannedCharacter: keysym=0x%lx - compose with %d keys\n",
+	      (long)keysym, len);
+    for (i = 0; i < len; i++) SendKeyPressedEvent(sequence[i], 0, 0);
+    return;
+  case PLAN_REMAP:
+    if (!LookupKeysym(keysym, &keycode, &level)) AddKeysym(keysym, FALSE);
+    break;
+  }
+  SendKeyPressedEvent(keysym, 0, 0);
+}
+
+/*
+ * Send the run of plain characters (decoded by ParseText()) according
+ * to the plan.  offset[] has the offset of each character in str, and
+ * end is the end of the run.
+ */
+static void SendRun(const char *str, const KeySym *chars, const int *offset, int n_chars,
+		    int end)
+{
+  struct plan_segment *plan;
+  char *text;
+  int n, i, j, k, result;
+  FILE *out;
+
+  plan = malloc(n_chars * sizeof(*plan));
+  n = PlanRun(chars, n_chars, plan);
+  if (appres.debug || (DRY_RUN && !dry_run_quiet)) {
+    out = DRY_RUN ? stdout : stderr;
+    for (i = 0; i < n; i++) {
+      j = offset[plan[i].start];
+      k = ((plan[i].start + plan[i].len < n_chars)
+	   ? offset[plan[i].start + plan[i].len] : end) - j;
+      fprintf(out, "%splan: %-7s", DRY_RUN ? "" : "xvkbd: ", plan_method_name[plan[i].method]);
+      if (plan[i].method == PLAN_GROUP) fprintf(out, " group=%d", plan[i].group);
+      fprintf(out, " %d+%d cost=%ld \"%.*s%s\"\n",
+	      plan[i].start, plan[i].len, plan[i].cost,
+	      k < 40 ? k : 40, str + j, k < 40 ? "" : "...");
+    }
+  }
+
+  for (i = 0; i < n && !interrupted; i++) {
+    CheckMappingNotify();
+    SelectGroup((plan[i].method == PLAN_GROUP) ? plan[i].group : -1);
+    if (plan[i].method == PLAN_PASTE && DRY_RUN) {
+      DryRunPrint("paste: %d characters\n", plan[i].len);
+      dry_run_count.pasted += plan[i].len;
+      continue;
+    }
+    if (plan[i].method == PLAN_PASTE) {
+      text = malloc(plan[i].len * 4 + 1);
+      for (k = 0, j = plan[i].start; j < plan[i].start + plan[i].len; j++)
+	k += EncodeUtf8(chars[j] & 0x00FFFFFF, text + k);
+      pasting = TRUE;
+      result = PasteText(target_dpy, text, k, SendPasteKey);
+      pasting = FALSE;
+      free(text);
+      if (result == 0) send_errors++;
+      if (0 <= result) continue;
+      /* nothing was sent - type it instead */
+    }
+    for (j = plan[i].start; j < plan[i].start + plan[i].len && !interrupted; j++) {
+      if (0 < j && 0 < appres.text_delay) Delay(appres.text_delay);
+      if ((j - plan[i].start) % MAPPING_CHECK_INTERVAL == MAPPING_CHECK_INTERVAL - 1)
+	CheckMappingNotify();
+      send_offset = offset[j];
+      SendPlannedCharacter(chars[j], (plan[i].method == PLAN_PASTE) ? PLAN_KEYS : plan[i].method);
+    }
+  }
+  SelectGroup(-1);
+
+  free(plan);
+}
+
+/*
+ * Press the key named as in "\[name]".  Names of modifier keys toggle
+ * the modifier in shift_state for the following keys, and other names
+ * are keysyms (or keysym values in hexadecimal) which can be preceded
+ * by "s:", "c:", "a:", "m:" and "w:" for Shift, Control, Alt, Meta and
+ * Super.  The modifiers in shift_state are released after the key,
+ * unless they are locked with shiftLock, modifiersLock and altgrLock.
+ */
+void PressKey(const char *key, unsigned int shift)
+{
+  const char *key1;
+  KeySym keysym;
+  long val;
+
+  if (need_read_keymap) {
+    need_read_keymap = FALSE;
+    ReadKeymap();
+  }
+
+  if (strncmp(key, "Shift", strlen("Shift")) == 0) {
+    if (shift_state & ShiftMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= ShiftMask;
+  } else if (strncmp(key, "Control", strlen("Control")) == 0) {
+    if (shift_state & ControlMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= ControlMask;
+  } else if (alt_mask != 0 && strncmp(key, "Alt", strlen("Alt")) == 0) {
+    if (shift_state & alt_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= alt_mask;
+  } else if (meta_mask != 0 && strncmp(key, "Meta", strlen("Meta")) == 0) {
+    if (shift_state & meta_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= meta_mask;
+  } else if (super_mask != 0 && strncmp(key, "Super", strlen("Super")) == 0) {
+    if (shift_state & super_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= super_mask;
+  } else if (strcmp(key, "Mode_switch") == 0) {
+    if (shift_state & altgr_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= altgr_mask;
+  } else if (strcmp(key, "Caps_Lock") == 0) {
+    if (shift_state & LockMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
+    shift_state ^= LockMask;
+  } else {
+    key1 = key;
+    if (strlen(key1) == 1) {
+      SendKeyPressedEvent((KeySym)*key1 & 0xff, shift, 0);
+    } else {
+      while (islower(key1[0]) && key1[1] == ':') {
+	switch (key1[0]) {
+	case 's': shift |= ShiftMask; break;
+	case 'c': shift |= ControlMask; break;
+	case 'a': shift |= alt_mask; break;
+	case 'm': shift |= meta_mask; break;
+	case 'w': shift |= super_mask; break;
+	default: fprintf(stderr, "%s: unknown modidier: %s\n",
+			 PROGRAM_NAME, key1); break;
+	}
+	key1 = key1 + 2;
+      }
+      if (key1[0] == '0' && key1[1] == 'x') {
+	sscanf(key1, "%lx", &val);
+	keysym = val;
+      } else {
+	keysym = XStringToKeysym(key1);
+      }
+      if (keysym == NoSymbol) fprintf(stderr, "%s: no such keysym: %s\n",
+				      PROGRAM_NAME, key);
+      if ((!appres.keypad_keysym && strncmp(key1, "KP_", 3) == 0)
+	  || KeysymToKeycode(keysym) == NoSymbol) {
+	switch ((unsigned)keysym) {
+	case XK_KP_Equal: keysym = XK_equal; break;
+	case XK_KP_Divide: keysym = XK_slash; break;
+	case XK_KP_Multiply: keysym = XK_asterisk; break;
+	case XK_KP_Add: keysym = XK_plus; break;
+	case XK_KP_Subtract: keysym = XK_minus; break;
+	case XK_KP_Enter: keysym = XK_Return; break;
+	case XK_KP_0: keysym = XK_0; break;
+	case XK_KP_1: keysym = XK_1; break;
+	case XK_KP_2: keysym = XK_2; break;
+	case XK_KP_3: keysym = XK_3; break;
+	case XK_KP_4: keysym = XK_4; break;
+	case XK_KP_5: keysym = XK_5; break;
+	case XK_KP_6: keysym = XK_6; break;
+	case XK_KP_7: keysym = XK_7; break;
+	case XK_KP_8: keysym = XK_8; break;
+	case XK_KP_9: keysym = XK_9; break;
+	case XK_Shift_L: keysym = XK_Shift_R; break;
+	case XK_Shift_R: keysym = XK_Shift_L; break;
+	case XK_Control_L: keysym = XK_Control_R; break;
+	case XK_Control_R: keysym = XK_Control_L; break;
+	case XK_Alt_L: keysym = XK_Alt_R; break;
+	case XK_Alt_R: keysym = XK_Alt_L; break;
+	case XK_Meta_L: keysym = XK_Meta_R; break;
+	case XK_Meta_R: keysym = XK_Meta_L; break;
+	case XK_Super_L: keysym = XK_Super_R; break;
+	case XK_Super_R: keysym = XK_Super_L; break;
+	default:
+	  if (keysym == NoSymbol || !appres.auto_add_keysym)
+	    fprintf(stderr, "%s: no such key: %s\n",
+		    PROGRAM_NAME, key1); break;
+	}
+      }
+      SendKeyPressedEvent(keysym, shift, 0);
+    }
+    if (!appres.shift_lock)
+      shift_state &= ~ShiftMask;
+    if (!appres.modifiers_lock)
+      shift_state &= ~(ControlMask | alt_mask | meta_mask | super_mask);
+    if (!appres.altgr_lock)
+      shift_state &= ~altgr_mask;
+  }
+}
+
+/*
+ * The text is parsed into tokens before it is sent: runs of plain
+ * characters decoded from UTF-8 into keysyms, and escape sequences.
+ * Parsing depends neither on the keymap nor on any other state, so
+ * that it can be done in advance in another thread (see
+ * XvkbdParseString()); meaning of the escape sequences and the plan
+ * of the runs are left to the sender.
+ */
+#define TOKEN_RUN     0  /* plain characters */
+#define TOKEN_ESCAPE  1  /* escape sequence beginning with "\" */
+#define TOKEN_END     2  /* "\" at the end of the text */
+
+struct text_token {
+  int type;
+  int offset;   /* in the text */
+  int len;      /* in bytes */
+  int first;    /* TOKEN_RUN: index of the first character in chars[] */
+  int n_chars;  /* TOKEN_RUN: number of the characters */
+};
+
+struct _XvkbdText {
+  const char *str;
+  char *own_str;             /* copy of str made by XvkbdParseString() */
+  struct text_token *tokens;
+  int n_tokens;
+  KeySym *chars;             /* characters of the runs */
+  int *offset;               /* offset of each character in str */
+};
+
+/*
+ * Length of the escape sequence after "\" at cp, as SendEscape()
+ * reads it.
+ */
+static int EscapeLength(const char *cp)
+{
+  const char *cp2;
+
+  switch (*cp) {
+  case '[':
+  case '{':
+  case '<':
+    cp2 = strchr(cp, (*cp == '[') ? ']' : (*cp == '{') ? '}' : '>');
+    return (cp2 != NULL) ? cp2 - cp + 1 : 1;
+  case 'D':
+  case 'm':
+    return (cp[1] != '\0') ? 2 : 1;
+  case 'x':
+  case 'y':
+    return (cp[1] != '\0') ? 2 + strspn(cp + 2, "0123456789+-") : 1;
+  }
+  return 1;
+}
+
+static struct _XvkbdText *ParseText(const char *str)
+{
+  struct _XvkbdText *text;
+  struct text_token *tp;
+  const char *cp;
+  unsigned int ch;
+  int len, size, i, j;
+
+  len = strlen(str);
+  text = malloc(sizeof(*text));
+  text->str = str;
+  text->own_str = NULL;
+  text->n_tokens = 0;
+  size = 16;
+  text->tokens = malloc(size * sizeof(*text->tokens));
+  text->chars = malloc((len + 1) * sizeof(*text->chars));
+  text->offset = malloc((len + 1) * sizeof(*text->offset));
+
+  i = 0;
+  for (cp = str; *cp != '\0'; cp += tp->len) {
+    if (text->n_tokens == size)
+      text->tokens = realloc(text->tokens, (size *= 2) * sizeof(*text->tokens));
+    tp = &text->tokens[text->n_tokens++];
+    tp->offset = cp - str;
+    if (*cp == '\\') {
+      if (cp[1] == '\0') {
+	tp->type = TOKEN_END;
+	tp->len = 1;
+	break;
+      }
+      tp->type = TOKEN_ESCAPE;
+      tp->len = 1 + EscapeLength(cp + 1);
+    } else {
+      tp->type = TOKEN_RUN;
+      tp->len = strcspn(cp, "\\");
+      tp->first = i;
+      for (j = 0; j < tp->len; i++) {
+	text->offset[i] = tp->offset + j;
+	j += DecodeUtf8((const unsigned char *)cp + j, tp->len - j, &ch);
+	text->chars[i] = (ch < 0x100) ? ch : (0x01000000 | ch);
+      }
+      tp->n_chars = i - tp->first;
+    }
+  }
+  return text;
+}
+
+static void FreeText(struct _XvkbdText *text)
+{
+  free(text->own_str);
+  free(text->tokens);
+  free(text->chars);
+  free(text->offset);
+  free(text);
+}
+
+/*
+ * Send given string to the focused window as if the string
+ * is typed from a keyboard.
+ */
+static void SendParsedText(const struct _XvkbdText *text);
+
+static void SendText(const struct _XvkbdText *text)
+{
+  const char *last_text = send_text;
+  int last_offset = send_offset;
+
+  send_text = text->str;
+  SendParsedText(text);
+  send_text = last_text;
+  send_offset = last_offset;
+}
+
+void SendString(const char *str)
+{
+  struct _XvkbdText *text;
+
+  text = ParseText(str);
+  SendText(text);
+  FreeText(text);
+}
+
+/*
+ * Pointer commands "\<command args>" in the text.  The position of the
+ * pointer is read once for a text and then followed as it is moved, and
+ * the events of timed commands are sent on a schedule of deadlines from
+ * the start of the command, so that late steps don't delay the rest;
+ * the events are flushed only before waiting for the next deadline.
+ */
+#define MAX_POINTER_ARGS 4
+
+static Boolean pointer_known = FALSE;
+static int pointer_x, pointer_y;
+
+static void PointerPosition(void)
+{
+  Window root, child;
+  int x, y;
+  unsigned int mask;
+
+  if (pointer_known) return;
+  pointer_known = TRUE;
+  pointer_x = pointer_y = 0;  /* unknown in dry run */
+  if (!DRY_RUN)
+    XQueryPointer(target_dpy, RootWindow(target_dpy, DefaultScreen(target_dpy)),
+		  &root, &child, &pointer_x, &pointer_y, &x, &y, &mask);
+}
+
+/*
+ * Wait until ms milliseconds after the start, flushing the events
+ * queued so far.  Nothing is waited if the deadline is already passed.
+ */
+static void WaitDeadline(const struct timespec *start, long ms)
+{
+  struct timespec deadline, now;
+
+  if (DRY_RUN) return;
+  deadline.tv_sec = start->tv_sec + ms / 1000;
+  deadline.tv_nsec = start->tv_nsec + (ms % 1000) * 1000000;
+  if (1000000000 <= deadline.tv_nsec) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec < deadline.tv_sec
+      || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec)) {
+    XFlush(target_dpy);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+  }
+}
+
+static void FakeMotion(int x, int y)
+{
+  if (x == pointer_x && y == pointer_y) return;
+  pointer_x = x;
+  pointer_y = y;
+  if (DRY_RUN) {
+    dry_run_count.motions++;
+    return;
+  }
+#ifdef USE_XTEST
+  XTestFakeMotionEvent(target_dpy, DefaultScreen(target_dpy), x, y, CurrentTime);
+#endif
+}
+
+static void FakeButton(int button, Boolean press)
+{
+  if (DRY_RUN) {
+    if (press) dry_run_count.buttons++;
+    return;
+  }
+#ifdef USE_XTEST
+  XTestFakeButtonEvent(target_dpy, button, press, CurrentTime);
+#endif
+}
+
+/*
+ * Move the pointer to (x, y) in ms milliseconds, with motionRate
+ * events per second.  With curve, the path bends to the side and
+ * the speed eases in and out, as moved by hand.
+ */
+static void MovePointer(int x, int y, int ms, Boolean curve)
+{
+  struct timespec start;
+  int x0, y0, steps, i;
+  double t, cx, cy;
+
+  x0 = pointer_x;
+  y0 = pointer_y;
+  cx = (x0 + x) / 2.0 - (y - y0) * 0.2;
+  cy = (y0 + y) / 2.0 + (x - x0) * 0.2;
+  steps = (0 < appres.motion_rate) ? (long)ms * appres.motion_rate / 1000 : 0;
+  if (steps < 1) steps = 1;
+  if (DRY_RUN) dry_run_count.delay += ms;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 1; i <= steps && !interrupted; i++) {
+    WaitDeadline(&start, (long)ms * i / steps);
+    t = (double)i / steps;
+    if (curve) {
+      t = t * t * (3 - 2 * t);
+      FakeMotion((int)((1 - t) * (1 - t) * x0 + 2 * (1 - t) * t * cx + t * t * x + 0.5),
+		 (int)((1 - t) * (1 - t) * y0 + 2 * (1 - t) * t * cy + t * t * y + 0.5));
+    } else {
+      FakeMotion(x0 + (int)((x - x0) * t + ((x < x0) ? -0.5 : 0.5)),
+		 y0 + (int)((y - y0) * t + ((y < y0) ? -0.5 : 0.5)));
+    }
+  }
+  FakeMotion(x, y);
+  if (!DRY_RUN) XFlush(target_dpy);
+}
+
+/*
+ * Click the button count times in ms milliseconds.
+ */
+static void ClickButton(int button, int count, int ms)
+{
+  struct timespec start;
+  int i;
+
+  if (DRY_RUN) dry_run_count.delay += ms;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count && !interrupted; i++) {
+    if (0 < i) WaitDeadline(&start, (long)ms * i / (count - 1));
+    FakeButton(button, TRUE);
+    FakeButton(button, FALSE);
+  }
+  if (!DRY_RUN) XFlush(target_dpy);
+}
+
+/*
+ * Coordinate of a pointer command: absolute, or relative to the
+ * current position with "+" or "-".
+ */
+static int PointerCoordinate(const char *arg, int current)
+{
+  if (*arg == '+' || *arg == '-') return current + atoi(arg);
+  return atoi(arg);
+}
+
+/*
+ * Run a pointer command (the text between "\<" and ">"):
+ *   down BUTTON, up BUTTON, click BUTTON [COUNT [MS]],
+ *   wheel STEPS [MS], hwheel STEPS [MS],
+ *   move X Y [MS], curve X Y [MS], drag X Y [MS [BUTTON]]
+ * X and Y with "+" or "-" are relative.  Returns FALSE if the command
+ * is not valid.
+ */
+static Boolean SendPointerCommand(char *command)
+{
+  char *name, *args[MAX_POINTER_ARGS], *p;
+  int n, button, count, ms, x, y;
+
+  name = strtok_r(command, " \t", &p);
+  if (name == NULL) return FALSE;
+  for (n = 0; n < MAX_POINTER_ARGS && (args[n] = strtok_r(NULL, " \t", &p)) != NULL; n++) {
+    if (strspn(args[n], "+-0123456789") != strlen(args[n])) return FALSE;
+  }
+  if (strtok_r(NULL, " \t", &p) != NULL) return FALSE;
+
+#ifndef USE_XTEST
+  if (!DRY_RUN) {
+    fprintf(stderr, "%s: this binary is compiled without XTEST support\n", PROGRAM_NAME);
+    return TRUE;
+  }
+#endif
+  if (appres.debug) fprintf(stderr, "xvkbd: SendPointerCommand: %s\n", name);
+
+  if ((strcmp(name, "down") == 0 || strcmp(name, "up") == 0) && n == 1) {
+    button = atoi(args[0]);
+    if (button < 1) return FALSE;
+    DryRunPrint("button: %d %s\n", button, name);
+    FakeButton(button, name[0] == 'd');
+    if (!DRY_RUN) XFlush(target_dpy);
+  } else if (strcmp(name, "click") == 0 && 1 <= n && n <= 3) {
+    button = atoi(args[0]);
+    count = (2 <= n) ? atoi(args[1]) : 1;
+    ms = (3 <= n) ? atoi(args[2]) : 0;
+    if (button < 1 || count < 1 || ms < 0) return FALSE;
+    DryRunPrint("button: %d x%d in %d ms\n", button, count, ms);
+    ClickButton(button, count, ms);
+  } else if ((strcmp(name, "wheel") == 0 || strcmp(name, "hwheel") == 0) && 1 <= n && n <= 2) {
+    count = atoi(args[0]);
+    ms = (2 <= n) ? atoi(args[1]) : 0;
+    if (count == 0 || ms < 0) return FALSE;
+    /* buttons 4 and 5 scroll up and down, and 6 and 7 left and right */
+    button = (name[0] == 'w') ? ((count < 0) ? 4 : 5) : ((count < 0) ? 6 : 7);
+    if (count < 0) count = -count;
+    DryRunPrint("button: %d x%d in %d ms\n", button, count, ms);
+    ClickButton(button, count, ms);
+  } else if (((strcmp(name, "move") == 0 || strcmp(name, "curve") == 0) && 2 <= n && n <= 3)
+	     || (strcmp(name, "drag") == 0 && 2 <= n && n <= 4)) {
+    ms = (3 <= n) ? atoi(args[2]) : 0;
+    button = (4 <= n) ? atoi(args[3]) : 1;
+    if (ms < 0 || button < 1) return FALSE;
+    PointerPosition();
+    x = PointerCoordinate(args[0], pointer_x);
+    y = PointerCoordinate(args[1], pointer_y);
+    DryRunPrint("pointer: %s to %d,%d in %d ms\n", name, x, y, ms);
+    if (name[0] == 'd') FakeButton(button, TRUE);
+    MovePointer(x, y, ms, name[0] == 'c');
+    if (name[0] == 'd') {
+      FakeButton(button, FALSE);
+      if (!DRY_RUN) XFlush(target_dpy);
+    }
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * Send the escape sequence, cp points the character after "\".
+ */
+static void SendEscape(const char *cp)
+{
+  const char *cp2;
+  char key[50], command[100];
+  int len;
+  int val;
+
+  switch (*cp) {
+  case '[':  /* we can write any keysym as "\[keysym]" here */
+    cp2 = strchr(cp, ']');
+
+    if (cp2 == NULL) {
+      fprintf(stderr, "%s: no closing \"]\" after \"\\[\"\n",
+	      PROGRAM_NAME);
+    } else {
+      len = cp2 - cp - 1;
+      if (sizeof(key) <= len) len = sizeof(key) - 1;
+      strncpy(key, cp + 1, len);
+      key[len] = '\0';
+      if (press_key_hook != NULL) press_key_hook(key);
+      else PressKey(key, shift_state);
+    }
+
+    //cp=cp2;
+    break;
+  case '{':		/*  "\{keysym}" will send the keysym more directly, and
+					    "\{+keysym}" and "\{-keysym}" will press the release the key */
+    cp2 = strchr(cp, '}');
+    if (cp2 == NULL) {
+      fprintf(stderr, "%s: no closing \"}\" after \"\\{\"\n",
+	      PROGRAM_NAME);
+    } else {
+      int press_release = SENDKEY_KEY_PRESS | SENDKEY_KEY_RELEASE;
+      KeySym keysym;
+      if (*(cp + 1) == '+') {
+	press_release = SENDKEY_KEY_PRESS;
+	cp++;
+      } else if (*(cp + 1) == '-') {
+	press_release = SENDKEY_KEY_RELEASE;
+	cp++;
+      }
+      len = cp2 - cp - 1;
+      if (sizeof(key) <= len) len = sizeof(key) - 1;
+      strncpy(key, cp + 1, len);
+      key[len] = '\0';
+      keysym = XStringToKeysym(key);
+      if (keysym == NoSymbol) fprintf(stderr, "%s: no such keysym: %s\n",
+				      PROGRAM_NAME, key);
+      SendKeyPressedEvent(keysym, 0, press_release);
+    }
+    break;
+  case 'S': shift_state |= ShiftMask; break;
+  case 'C': shift_state |= ControlMask; break;
+  case 'A': shift_state |= alt_mask; break;
+  case 'M': shift_state |= meta_mask; break;
+  case 'W': shift_state |= super_mask; break;
+  case 'b': SendKeyPressedEvent(XK_BackSpace, shift_state, 0); shift_state = 0; break;
+  case 't': SendKeyPressedEvent(XK_Tab, shift_state, 0); shift_state = 0; break;
+  case 'n': SendKeyPressedEvent(XK_Linefeed, shift_state, 0); shift_state = 0; break;
+  case 'r': SendKeyPressedEvent(XK_Return, shift_state, 0); shift_state = 0; break;
+  case 'e': SendKeyPressedEvent(XK_Escape, shift_state, 0); shift_state = 0; break;
+  case 'd': SendKeyPressedEvent(XK_Delete, shift_state, 0); shift_state = 0; break;
+  case 'D':  /* delay */
+    cp++;
+    if ('1' <= *cp && *cp <= '9') {
+      Delay((*cp - '0') * 100);
+    } else {
+      fprintf(stderr, "%s: no digit after \"\\m\"\n",
+	      PROGRAM_NAME);
+    }
+    break;
+  case 'm':  /* simulate click mouse button */
+    cp++;
+    if ('1' <= *cp && *cp <= '9' && DRY_RUN) {
+      DryRunPrint("button: %d\n", *cp - '0');
+      dry_run_count.buttons++;
+    } else if ('1' <= *cp && *cp <= '9') {
+      if (appres.debug) fprintf(stderr, "xvkbd: XTestFakeButtonEvent(%d)\n", *cp - '0');
+      XTestFakeButtonEvent(target_dpy, *cp - '0', True, CurrentTime);
+      XTestFakeButtonEvent(target_dpy, *cp - '0', False, CurrentTime);
+      XFlush(target_dpy);
+    } else {
+      fprintf(stderr, "%s: no digit after \"\\m\"\n",
+	      PROGRAM_NAME);
+    }
+    break;
+  case '<':  /* pointer commands, such as "\<move 100 200 300>" */
+    cp2 = strchr(cp, '>');
+    if (cp2 == NULL) {
+      fprintf(stderr, "%s: no closing \">\" after \"\\<\"\n",
+	      PROGRAM_NAME);
+    } else {
+      len = cp2 - cp - 1;
+      if (sizeof(command) <= len) len = sizeof(command) - 1;
+      strncpy(command, cp + 1, len);
+      command[len] = '\0';
+      if (!SendPointerCommand(command))
+	fprintf(stderr, "%s: invalid pointer command: %.*s\n",
+		PROGRAM_NAME, (int)(cp2 - cp - 1), cp + 1);
+    }
+    break;
+  case 'x':
+  case 'y':  /* move mouse pointer */
+    sscanf(cp + 1, "%d", &val);
+    if (DRY_RUN) {
+      DryRunPrint(isdigit(*(cp + 1)) ? "pointer: %c=%d\n" : "pointer: %c%+d\n", *cp, val);
+      dry_run_count.motions++;
+      break;
+    }
+    PointerPosition();
+    if (*cp == 'x') {
+      if (isdigit(*(cp + 1))) pointer_x = val;
+      else pointer_x += val;
+    } else {
+      if (isdigit(*(cp + 1))) pointer_y = val;
+      else pointer_y += val;
+    }
+    XWarpPointer(target_dpy, None, RootWindow(target_dpy, DefaultScreen(target_dpy)),
+		 0, 0, 0, 0, pointer_x, pointer_y);
+    XFlush(target_dpy);
+    break;
+  default:
+    SendKeyPressedEvent(*cp, shift_state, 0);
+    shift_state = 0;
+    break;
+  }
+}
+
+/*
+ * Send the text parsed by ParseText().
+ */
+static void SendParsedText(const struct _XvkbdText *text)
+{
+  const struct text_token *tp;
+  int i;
+
+  if (appres.debug) fprintf(stderr, "xvkbd: SendString(%s)\n", text->str);
+
+  CheckMappingNotify();
+  if (need_read_keymap) {
+    need_read_keymap = FALSE;
+    ReadKeymap();
+  }
+
+  shift_state = 0;
+  pointer_known = FALSE;
+  for (i = 0; i < text->n_tokens && !interrupted; i++) {
+    tp = &text->tokens[i];
+    send_offset = tp->offset;
+    if (tp->type == TOKEN_END) {
+      fprintf(stderr, "%s: missing character after \"\\\"\n",
+	      PROGRAM_NAME);
+      return;
+    }
+    if (0 < appres.text_delay) Delay(appres.text_delay);
+    if (tp->type == TOKEN_ESCAPE) {
+      SendEscape(text->str + tp->offset + 1);
+    } else if (shift_state == 0) {
+      SendRun(text->str, text->chars + tp->first, text->offset + tp->first,
+	      tp->n_chars, tp->offset + tp->len);
+    } else {
+      SendKeyPressedEvent(text->chars[tp->first], shift_state, 0);
+      shift_state = 0;
+      if (1 < tp->n_chars && !interrupted) {
+	if (0 < appres.text_delay) Delay(appres.text_delay);
+	SendRun(text->str, text->chars + tp->first + 1, text->offset + tp->first + 1,
+		tp->n_chars - 1, tp->offset + tp->len);
+      }
+    }
+  }
+}
+
+/*
+ * Print the numbers of the events and the keymap changes of dry run.
+ */
+void PrintDryRunSummary(void)
+{
+  int i;
+
+  fprintf(stdout, "summary: %d key events (%d press, %d release), "
+	  "%d button clicks, %d pointer motions\n",
+	  dry_run_count.presses + dry_run_count.releases,
+	  dry_run_count.presses, dry_run_count.releases,
+	  dry_run_count.buttons, dry_run_count.motions);
+  fprintf(stdout, "summary: %d keysyms added to the keymap",
+	  dry_run_count.keysyms_added);
+  for (i = 0; i < dry_run_count.keysyms_added && i < MAX_DRY_RUN_ADDED; i++)
+    fprintf(stdout, "%s%s", (i == 0) ? " (" : " ", XKeysymToString(dry_run_count.added[i]));
+  if (MAX_DRY_RUN_ADDED < dry_run_count.keysyms_added) fprintf(stdout, " ...");
+  fprintf(stdout, "%s, %d modifiers added\n",
+	  (0 < dry_run_count.keysyms_added) ? ")" : "", dry_run_count.modifiers_added);
+  fprintf(stdout, "summary: %d characters pasted, %ld ms of delay\n",
+	  dry_run_count.pasted, dry_run_count.delay);
+}
+
+/*
+ * Library interface (libxvkbd.h).
+ *
+ * The keymap and the other states above are global, so only one
+ * session can be open at a time.  Requests queued with XvkbdQueue...()
+ * are sent one by one in a thread, and the results are put in the done
+ * list with one byte written to the pipe for each of them, so that the
+ * read end of the pipe is readable while there are results.
+ */
+#define Offset(entry) XtOffset(struct appres_struct *, entry)
+
+#define OPTION_BOOLEAN  0
+#define OPTION_INT      1
+#define OPTION_STRING   2
+
+static struct {
+  const char *name;
+  int type;
+  Cardinal offset;
+} session_options[] = {
+  { "debug", OPTION_BOOLEAN, Offset(debug) },
+  { "xtest", OPTION_BOOLEAN, Offset(xtest) },
+  { "xi2Device", OPTION_BOOLEAN, Offset(xi2_device) },
+  { "noSync", OPTION_BOOLEAN, Offset(no_sync) },
+  { "jumpPointer", OPTION_BOOLEAN, Offset(jump_pointer) },
+  { "jumpPointerAlways", OPTION_BOOLEAN, Offset(jump_pointer_always) },
+  { "jumpPointerBack", OPTION_BOOLEAN, Offset(jump_pointer_back) },
+  { "jumpPointerPolicy", OPTION_STRING, Offset(jump_pointer_policy) },
+  { "altgrLock", OPTION_BOOLEAN, Offset(altgr_lock) },
+  { "shiftLock", OPTION_BOOLEAN, Offset(shift_lock) },
+  { "modifiersLock", OPTION_BOOLEAN, Offset(modifiers_lock) },
+  { "keypadKeysym", OPTION_BOOLEAN, Offset(keypad_keysym) },
+  { "autoAddKeysym", OPTION_BOOLEAN, Offset(auto_add_keysym) },
+  { "keymapCache", OPTION_BOOLEAN, Offset(keymap_cache) },
+  { "compose", OPTION_BOOLEAN, Offset(compose) },
+  { "restoreKeymap", OPTION_BOOLEAN, Offset(restore_keymap) },
+  { "restoreDelay", OPTION_INT, Offset(restore_delay) },
+  { "paste", OPTION_STRING, Offset(paste) },
+  { "pasteThreshold", OPTION_INT, Offset(paste_threshold) },
+  { "pasteSelection", OPTION_STRING, Offset(paste_selection) },
+  { "pasteKey", OPTION_STRING, Offset(paste_key) },
+  { "pasteRestore", OPTION_BOOLEAN, Offset(paste_restore) },
+  { "pasteTimeout", OPTION_INT, Offset(paste_timeout) },
+  { "altgrKeycode", OPTION_INT, Offset(altgr_keycode) },
+  { "textDelay", OPTION_INT, Offset(text_delay) },
+  { "motionRate", OPTION_INT, Offset(motion_rate) },
+  { "dryRun", OPTION_STRING, Offset(dry_run) },
+};
+
+struct request {
+  int number;
+  char *str;  /* string to be sent, or NULL for keysym */
+  XvkbdText parsed;  /* or the parsed string */
+  KeySym keysym;
+  unsigned int modifiers;
+  int press_release;
+  int result;
+  struct request *next;
+};
+
+struct _XvkbdSession {
+  Display *display;
+  Boolean own_display;
+  pthread_mutex_t send_lock;  /* held while the events are sent */
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_cond;
+  pthread_t thread;
+  Boolean thread_started;
+  Boolean closing;
+  struct request *queue, *queue_tail;
+  struct request *done, *done_tail;
+  int last_number;
+  int pipe_fd[2];
+  struct appres_struct saved_appres;  /* restored at XvkbdClose() */
+  char *option_values[XtNumber(session_options)];  /* set by XvkbdSetOption() */
+  Boolean handler_installed;
+};
+
+static XvkbdSession current_session = NULL;
+
+XvkbdSession XvkbdOpenDisplay(Display *display)
+{
+  XvkbdSession session;
+  int (*last_handler)(Display *, XErrorEvent *);
+
+  if (current_session != NULL) {
+    fprintf(stderr, "%s: a session is already open\n", PROGRAM_NAME);
+    return NULL;
+  }
+  session = calloc(1, sizeof(*session));
+  session->display = display;
+  session->pipe_fd[0] = session->pipe_fd[1] = -1;
+  pthread_mutex_init(&session->send_lock, NULL);
+  pthread_mutex_init(&session->queue_lock, NULL);
+  pthread_cond_init(&session->queue_cond, NULL);
+
+  session->saved_appres = appres;
+
+  if (display != NULL) {
+    last_handler = XSetErrorHandler(MyErrorHandler);
+    /* the xvkbd program installs MyErrorHandler() for all its errors */
+    if (last_handler != MyErrorHandler) {
+      host_error_handler = last_handler;
+      session->handler_installed = TRUE;
+    }
+  }
+
+  target_dpy = display;
+  shared_display = TRUE;
+  focused_window = None;
+  focused_subwindow = None;
+  need_read_keymap = TRUE;
+  current_session = session;
+  return session;
+}
+
+XvkbdSession XvkbdOpen(const char *display_name)
+{
+  Display *display;
+  XvkbdSession session;
+
+  display = XOpenDisplay(display_name);
+  if (display == NULL) {
+    fprintf(stderr, "%s: cannot open display \"%s\"\n",
+	    PROGRAM_NAME, XDisplayName(display_name));
+    return NULL;
+  }
+  session = XvkbdOpenDisplay(display);
+  if (session == NULL) {
+    XCloseDisplay(display);
+    return NULL;
+  }
+  session->own_display = TRUE;
+  shared_display = FALSE;
+  return session;
+}
+
+static void FreeRequests(struct request *req)
+{
+  struct request *next;
+
+  for (; req != NULL; req = next) {
+    next = req->next;
+    free(req->str);
+    free(req);
+  }
+}
+
+/*
+ * Close the session:  requests which are not sent yet are discarded,
+ * and the changes made to the keymap are restored.
+ */
+void XvkbdClose(XvkbdSession session)
+{
+  int i;
+
+  if (session == NULL) return;
+
+  if (session->thread_started) {
+    pthread_mutex_lock(&session->queue_lock);
+    session->closing = TRUE;
+    pthread_cond_signal(&session->queue_cond);
+    pthread_mutex_unlock(&session->queue_lock);
+    pthread_join(session->thread, NULL);
+  }
+  FreeRequests(session->queue);
+  FreeRequests(session->done);
+  if (session->pipe_fd[0] != -1) {
+    close(session->pipe_fd[0]);
+    close(session->pipe_fd[1]);
+  }
+
+  RestoreKeymap();
+#ifdef USE_XI2
+  RemoveSendDevice();
+  send_device_tried = FALSE;
+#endif
+  if (session->own_display) XCloseDisplay(session->display);
+  if (session->handler_installed) XSetErrorHandler(host_error_handler);
+  host_error_handler = NULL;
+  target_dpy = NULL;
+  current_session = NULL;
+
+  /* options set for the session don't remain in the next one */
+  appres = session->saved_appres;
+  for (i = 0; i < XtNumber(session_options); i++) free(session->option_values[i]);
+
+  pthread_cond_destroy(&session->queue_cond);
+  pthread_mutex_destroy(&session->queue_lock);
+  pthread_mutex_destroy(&session->send_lock);
+  free(session);
+}
+
+/*
+ * Set value of the resource (such as "textDelay") for the session.
+ * Returns -1 if the name is not one of the resources used for sending.
+ */
+int XvkbdSetOption(XvkbdSession session, const char *name, const char *value)
+{
+  char *addr;
+  int i;
+
+  for (i = 0; i < XtNumber(session_options); i++) {
+    if (strcmp(session_options[i].name, name) == 0) break;
+  }
+  if (XtNumber(session_options) <= i) return -1;
+
+  pthread_mutex_lock(&session->send_lock);
+  addr = (char *)&appres + session_options[i].offset;
+  switch (session_options[i].type) {
+  case OPTION_BOOLEAN:
+    *(Boolean *)addr = (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0
+			|| strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0);
+    break;
+  case OPTION_INT:
+    *(int *)addr = atoi(value);
+    break;
+  default:
+    free(session->option_values[i]);
+    session->option_values[i] = strdup(value);
+    *(String *)addr = session->option_values[i];
+    break;
+  }
+  pthread_mutex_unlock(&session->send_lock);
+  return 0;
+}
+
+Window XvkbdFindWindow(XvkbdSession session, const char *spec)
+{
+  Window w;
+
+  pthread_mutex_lock(&session->send_lock);
+  w = ResolveWindow(spec);
+  pthread_mutex_unlock(&session->send_lock);
+  return w;
+}
+
+/*
+ * Set the window to be focused before sending, and the window to receive
+ * the events (e.g. a widget in it, or None for the window itself).
+ * None for the window means the input focus.
+ */
+void XvkbdSetWindow(XvkbdSession session, Window window, Window subwindow)
+{
+  pthread_mutex_lock(&session->send_lock);
+  focused_window = window;
+  focused_subwindow = (subwindow != None) ? subwindow : window;
+  pthread_mutex_unlock(&session->send_lock);
+}
+
+static int SendRequest(XvkbdSession session, struct request *req)
+{
+  int press_release;
+
+  pthread_mutex_lock(&session->send_lock);
+  send_errors = 0;
+  sending = TRUE;
+  if (req->parsed != NULL) {
+    SendText(req->parsed);
+  } else if (req->str != NULL) {
+    SendString(req->str);
+  } else {
+    press_release = req->press_release;
+    if (press_release == (SENDKEY_KEY_PRESS | SENDKEY_KEY_RELEASE)) press_release = 0;
+    SendKeyPressedEvent(req->keysym, req->modifiers, press_release);
+  }
+  RestoreCapsLock();
+  JumpPointerBack();
+  if (!appres.no_sync && !DRY_RUN) {
+    /* errors of the events are reported by now */
+    XSync(target_dpy, FALSE);
+    while (error_detected) {
+      HandleSendErrors();
+      XSync(target_dpy, FALSE);
+    }
+  }
+  EndFocusTracking();
+  sending = FALSE;
+  pthread_mutex_unlock(&session->send_lock);
+  return (send_errors == 0) ? XVKBD_OK : XVKBD_ERROR;
+}
+
+int XvkbdSendString(XvkbdSession session, const char *str)
+{
+  struct request req;
+
+  memset(&req, 0, sizeof(req));
+  req.str = (char *)str;
+  return SendRequest(session, &req);
+}
+
+/*
+ * Parse the string for XvkbdSendParsed() in advance; the string is
+ * copied.
+ */
+XvkbdText XvkbdParseString(const char *str)
+{
+  char *own_str;
+  XvkbdText text;
+
+  own_str = strdup(str);
+  text = ParseText(own_str);
+  text->own_str = own_str;
+  return text;
+}
+
+int XvkbdSendParsed(XvkbdSession session, XvkbdText text)
+{
+  struct request req;
+
+  memset(&req, 0, sizeof(req));
+  req.parsed = text;
+  return SendRequest(session, &req);
+}
+
+void XvkbdFreeText(XvkbdText text)
+{
+  if (text != NULL) FreeText(text);
+}
+
+int XvkbdSendKeysym(XvkbdSession session, KeySym keysym, unsigned int modifiers)
+{
+  struct request req;
+
+  memset(&req, 0, sizeof(req));
+  req.keysym = keysym;
+  req.modifiers = modifiers;
+  req.press_release = SENDKEY_KEY_PRESS | SENDKEY_KEY_RELEASE;
+  return SendRequest(session, &req);
+}
+
+int XvkbdPressKeysym(XvkbdSession session, KeySym keysym)
+{
+  struct request req;
+
+  memset(&req, 0, sizeof(req));
+  req.keysym = keysym;
+  req.press_release = SENDKEY_KEY_PRESS;
+  return SendRequest(session, &req);
+}
+
+int XvkbdReleaseKeysym(XvkbdSession session, KeySym keysym)
+{
+  struct request req;
+
+  memset(&req, 0, sizeof(req));
+  req.keysym = keysym;
+  req.press_release = SENDKEY_KEY_RELEASE;
+  return SendRequest(session, &req);
+}
+
+static void *SendThread(void *arg)
+{
+  XvkbdSession session = arg;
+  struct request *req;
+
+  pthread_mutex_lock(&session->queue_lock);
+  for (;;) {
+    while (session->queue == NULL && !session->closing)
+      pthread_cond_wait(&session->queue_cond, &session->queue_lock);
+    if (session->closing) break;
+
+    req = session->queue;
+    session->queue = req->next;
+    if (session->queue == NULL) session->queue_tail = NULL;
+    pthread_mutex_unlock(&session->queue_lock);
+
+    req->result = SendRequest(session, req);
+    req->next = NULL;
+
+    pthread_mutex_lock(&session->queue_lock);
+    if (session->done_tail != NULL) session->done_tail->next = req;
+    else session->done = req;
+    session->done_tail = req;
+    if (write(session->pipe_fd[1], "", 1) != 1)
+      fprintf(stderr, "%s: can't notify the result: %s\n", PROGRAM_NAME, strerror(errno));
+  }
+  pthread_mutex_unlock(&session->queue_lock);
+  return NULL;
+}
+
+/*
+ * File descriptor which becomes readable when results of the requests
+ * queued with XvkbdQueue...() are available.
+ */
+int XvkbdConnectionNumber(XvkbdSession session)
+{
+  if (session->pipe_fd[0] == -1) {
+    if (pipe(session->pipe_fd) != 0) {
+      session->pipe_fd[0] = session->pipe_fd[1] = -1;
+      return -1;
+    }
+    fcntl(session->pipe_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(session->pipe_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(session->pipe_fd[1], F_SETFD, FD_CLOEXEC);
+  }
+  return session->pipe_fd[0];
+}
+
+static int QueueRequest(XvkbdSession session, struct request *req)
+{
+  if (XvkbdConnectionNumber(session) == -1) {
+    FreeRequests(req);
+    return -1;
+  }
+  pthread_mutex_lock(&session->queue_lock);
+  if (!session->thread_started) {
+    if (pthread_create(&session->thread, NULL, SendThread, session) != 0) {
+      pthread_mutex_unlock(&session->queue_lock);
+      FreeRequests(req);
+      return -1;
+    }
+    session->thread_started = TRUE;
+  }
+  if (++session->last_number <= 0) session->last_number = 1;
+  req->number = session->last_number;
+  if (session->queue_tail != NULL) session->queue_tail->next = req;
+  else session->queue = req;
+  session->queue_tail = req;
+  pthread_cond_signal(&session->queue_cond);
+  pthread_mutex_unlock(&session->queue_lock);
+  return req->number;
+}
+
+/*
+ * Queue the string or the keysym to be sent, and return number
+ * of the request (or -1 if failed) at once.
+ */
+int XvkbdQueueString(XvkbdSession session, const char *str)
+{
+  struct request *req;
+
+  req = calloc(1, sizeof(*req));
+  req->str = strdup(str);
+  return QueueRequest(session, req);
+}
+
+int XvkbdQueueKeysym(XvkbdSession session, KeySym keysym,
+		     unsigned int modifiers, int press_release)
+{
+  struct request *req;
+
+  req = calloc(1, sizeof(*req));
+  req->keysym = keysym;
+  req->modifiers = modifiers;
+  req->press_release = press_release & (SENDKEY_KEY_PRESS | SENDKEY_KEY_RELEASE);
+  return QueueRequest(session, req);
+}
+
+/*
+ * Get result of a queued request, in the order they were queued.
+ * Returns XVKBD_PENDING if no result is available.
+ */
+int XvkbdNextResult(XvkbdSession session, int *request)
+{
+  struct request *req;
+  char ch;
+  int result;
+
+  pthread_mutex_lock(&session->queue_lock);
+  req = session->done;
+  if (req != NULL) {
+    session->done = req->next;
+    if (session->done == NULL) session->done_tail = NULL;
+    if (read(session->pipe_fd[0], &ch, 1) != 1) ch = 0;
+  }
+  pthread_mutex_unlock(&session->queue_lock);
+  if (req == NULL) return XVKBD_PENDING;
+
+  if (request != NULL) *request = req->number;
+  result = req->result;
+  req->next = NULL;
+  FreeRequests(req);
+  return result;
+}
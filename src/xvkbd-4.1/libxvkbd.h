@@ -0,0 +1,86 @@
+/*
+ * libxvkbd - send keystrokes to X clients as xvkbd does
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * A session sends strings (in the syntax of "xvkbd -text") and keysyms
+ * to the focused window, or to the window set with XvkbdSetWindow(),
+ * reading the keymap once and keeping it up to date.  Only one session
+ * can be open in a process at a time.
+ *
+ * The XvkbdSend...() functions block until the events are sent, and
+ * return XVKBD_OK or XVKBD_ERROR.  The XvkbdQueue...() functions return
+ * a request number at once, and the request is sent in another thread;
+ * the file descriptor returned by XvkbdConnectionNumber() becomes
+ * readable when results are available, and XvkbdNextResult() gets them.
+ * Sessions used with XvkbdQueue...() should have their own connection
+ * (XvkbdOpen()), unless the caller's Xlib is initialized with
+ * XInitThreads().
+ *
+ * An X error handler is installed while the session is open; errors
+ * which are not caused by the session are passed to the handler the
+ * caller had installed.  Options set with XvkbdSetOption() are reset
+ * by XvkbdClose().  "pasteRestore" has no effect in the library, as
+ * it would need a background process.
+ */
+#ifndef LIBXVKBD_H
+#define LIBXVKBD_H
+
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XVKBD_OK       0
+#define XVKBD_ERROR    (-1)  /* couldn't send (e.g. the window was destroyed) */
+#define XVKBD_PENDING  1     /* XvkbdNextResult(): no result is available yet */
+
+/* for XvkbdQueueKeysym() */
+#define XVKBD_PRESS    1
+#define XVKBD_RELEASE  2
+#define XVKBD_CLICK    (XVKBD_PRESS | XVKBD_RELEASE)
+
+typedef struct _XvkbdSession *XvkbdSession;
+typedef struct _XvkbdText *XvkbdText;  /* string parsed by XvkbdParseString() */
+
+extern XvkbdSession XvkbdOpen(const char *display_name);
+extern XvkbdSession XvkbdOpenDisplay(Display *display);
+extern void XvkbdClose(XvkbdSession session);
+
+/* name is a resource name, such as "textDelay" or "xtest" */
+extern int XvkbdSetOption(XvkbdSession session, const char *name, const char *value);
+
+/* window is as for "xvkbd -window"; None for the input focus */
+extern Window XvkbdFindWindow(XvkbdSession session, const char *spec);
+extern void XvkbdSetWindow(XvkbdSession session, Window window, Window subwindow);
+
+extern int XvkbdSendString(XvkbdSession session, const char *str);
+/* XvkbdParseString() doesn't use Xlib nor the session, and can be
+   called in any thread while another sends */
+extern XvkbdText XvkbdParseString(const char *str);
+extern int XvkbdSendParsed(XvkbdSession session, XvkbdText text);
+extern void XvkbdFreeText(XvkbdText text);
+extern int XvkbdSendKeysym(XvkbdSession session, KeySym keysym, unsigned int modifiers);
+extern int XvkbdPressKeysym(XvkbdSession session, KeySym keysym);
+extern int XvkbdReleaseKeysym(XvkbdSession session, KeySym keysym);
+
+extern int XvkbdConnectionNumber(XvkbdSession session);
+extern int XvkbdQueueString(XvkbdSession session, const char *str);
+extern int XvkbdQueueKeysym(XvkbdSession session, KeySym keysym,
+			    unsigned int modifiers, int press_release);
+extern int XvkbdNextResult(XvkbdSession session, int *request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBXVKBD_H */
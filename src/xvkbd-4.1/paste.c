@@ -0,0 +1,556 @@
+/*
+ * xvkbd - Virtual Keyboard for X Window System
+ *
+ * Copyright (C) 2000 by Tom Sato <VEF00200@nifty.ne.jp>
+ * http://homepage3.nifty.com/tsato/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Paste text through the selection (CLIPBOARD or PRIMARY) instead
+ * of typing it key by key: xvkbd becomes owner of the selection,
+ * sends the paste key (such as Ctrl+V) to the focused window, and
+ * serves the text when the window requests it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <X11/Intrinsic.h>
+#include <X11/Xatom.h>
+
+#include "resources.h"
+
+#define QUIET_TIME 100  /* wait for more requests for 0.1sec after a transfer */
+
+/*
+ * Windows of the client to paste to are told from those of others
+ * (e.g. a clipboard manager) by the bits of the resource IDs above
+ * these.  This is only a heuristic: the protocol doesn't define how
+ * the IDs are assigned, and this is the layout of the X.Org server
+ * with the default number of clients (a server started with other
+ * -maxclients shifts it).  If it is wrong, transfers are miscounted
+ * and the paste may end early or be reported as not requested.
+ */
+#define CLIENT_ID_MASK 0x1FFFFF
+
+static Display *paste_dpy = NULL;
+static Window paste_window = None;
+static Atom paste_selection = None;
+static Time paste_time = CurrentTime;
+
+static Atom atom_targets = None;
+static Atom atom_timestamp = None;
+static Atom atom_text = None;
+static Atom atom_utf8_string = None;
+static Atom atom_incr = None;
+static Atom atom_property = None;
+
+/*
+ * Contents of the selection, in Latin-1 for STRING and in UTF-8
+ * for UTF8_STRING.
+ */
+static struct {
+  char *latin1;
+  int latin1_len;
+  char *utf8;
+  int utf8_len;
+} paste_data = { NULL, 0, NULL, 0 };
+
+static int paste_transfers = 0;  /* count of transfers completed to paste_client */
+static int other_transfers = 0;  /* count of those to the other clients */
+static Window paste_client = None;  /* window of the client to paste to, or None for any */
+static Boolean paste_lost = FALSE;
+static long incr_chunk = 0;
+
+/*
+ * A transfer with the INCR protocol in progress - only one at a time.
+ */
+static struct {
+  Window requestor;
+  long requestor_mask;  /* our event mask of the requestor before the transfer */
+  Atom property;
+  Atom type;
+  const char *data;
+  long len;
+  long offset;
+} incr = { None, 0, None, None, NULL, 0, 0 };
+
+static void CountTransfer(Window requestor)
+{
+  if (paste_client == None
+      || (requestor & ~CLIENT_ID_MASK) == (paste_client & ~CLIENT_ID_MASK))
+    paste_transfers++;
+  else
+    other_transfers++;
+}
+
+/*
+ * Restore our event mask of the requestor, which may be the window
+ * watched for the input focus.
+ */
+static void EndIncr(void)
+{
+  XSelectInput(paste_dpy, incr.requestor, incr.requestor_mask);
+  incr.requestor = None;
+}
+
+static long MilliSeconds(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+/*
+ * Wait until something arrives from the server, up to timeout msec.
+ */
+static void WaitServer(Display *my_dpy, long timeout)
+{
+  struct pollfd pfd;
+
+  XFlush(my_dpy);
+  if (XPending(my_dpy)) timeout = 10;  /* events of others are queued */
+  pfd.fd = ConnectionNumber(my_dpy);
+  pfd.events = POLLIN;
+  poll(&pfd, 1, (int)(timeout < 0 ? 0 : timeout));
+}
+
+static char *Utf8ToLatin1(const char *str, int len, int *len_return)
+{
+  char *buf = malloc(len + 1);
+  int i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    if (c < 0x80) {
+      buf[n++] = c;
+    } else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+      unsigned int ch = ((c & 0x1F) << 6) | (str[++i] & 0x3F);
+      buf[n++] = (ch < 0x100) ? ch : '?';
+    } else if ((c & 0xC0) != 0x80) {
+      while (i + 1 < len && (str[i + 1] & 0xC0) == 0x80) i++;
+      buf[n++] = '?';
+    }
+  }
+  buf[n] = '\0';
+  *len_return = n;
+  return buf;
+}
+
+static void FreePasteData(void)
+{
+  free(paste_data.latin1);
+  free(paste_data.utf8);
+  paste_data.latin1 = paste_data.utf8 = NULL;
+  paste_data.latin1_len = paste_data.utf8_len = 0;
+}
+
+/*
+ * Get the server time to be used as the timestamp of the selection,
+ * by appending zero-length data to a property of our window.
+ */
+static Time ServerTime(void)
+{
+  XEvent event;
+
+  while (XCheckWindowEvent(paste_dpy, paste_window, PropertyChangeMask, &event))
+    ;  /* discard old ones */
+  XChangeProperty(paste_dpy, paste_window, atom_property, XA_STRING, 8,
+		  PropModeAppend, (unsigned char *)"", 0);
+  XWindowEvent(paste_dpy, paste_window, PropertyChangeMask, &event);
+  return event.xproperty.time;
+}
+
+static Boolean OpenPasteWindow(Display *my_dpy)
+{
+  if (paste_dpy == my_dpy && paste_window != None) return TRUE;
+
+  paste_dpy = my_dpy;
+  paste_window = XCreateSimpleWindow(my_dpy, DefaultRootWindow(my_dpy),
+				     0, 0, 1, 1, 0, 0, 0);
+  if (paste_window == None) return FALSE;
+  XSelectInput(my_dpy, paste_window, PropertyChangeMask);
+
+  atom_targets = XInternAtom(my_dpy, "TARGETS", False);
+  atom_timestamp = XInternAtom(my_dpy, "TIMESTAMP", False);
+  atom_text = XInternAtom(my_dpy, "TEXT", False);
+  atom_utf8_string = XInternAtom(my_dpy, "UTF8_STRING", False);
+  atom_incr = XInternAtom(my_dpy, "INCR", False);
+  atom_property = XInternAtom(my_dpy, "XVKBD_SELECTION", False);
+
+  incr_chunk = XExtendedMaxRequestSize(my_dpy);
+  if (incr_chunk == 0 || XMaxRequestSize(my_dpy) < incr_chunk)
+    incr_chunk = XMaxRequestSize(my_dpy);
+  incr_chunk = incr_chunk * 4 - 100;
+  if (262144 < incr_chunk) incr_chunk = 262144;
+  return TRUE;
+}
+
+/*
+ * Reply to a SelectionRequest - large data will be transferred
+ * with the INCR protocol.
+ */
+static void HandleSelectionRequest(XSelectionRequestEvent *req)
+{
+  XSelectionEvent reply;
+  Atom property = (req->property == None) ? req->target : req->property;
+  const char *data = NULL;
+  long len = 0;
+  Atom type = None;
+
+  reply.type = SelectionNotify;
+  reply.display = req->display;
+  reply.requestor = req->requestor;
+  reply.selection = req->selection;
+  reply.target = req->target;
+  reply.property = None;
+  reply.time = req->time;
+
+  if (req->owner != paste_window || req->selection != paste_selection
+      || (req->time != CurrentTime && req->time < paste_time)) {
+    /* refuse */
+  } else if (req->target == atom_targets) {
+    Atom targets[5];
+    targets[0] = atom_targets;
+    targets[1] = atom_timestamp;
+    targets[2] = atom_utf8_string;
+    targets[3] = XA_STRING;
+    targets[4] = atom_text;
+    XChangeProperty(paste_dpy, req->requestor, property, XA_ATOM, 32,
+		    PropModeReplace, (unsigned char *)targets, 5);
+    reply.property = property;
+  } else if (req->target == atom_timestamp) {
+    long t = paste_time;
+    XChangeProperty(paste_dpy, req->requestor, property, XA_INTEGER, 32,
+		    PropModeReplace, (unsigned char *)&t, 1);
+    reply.property = property;
+  } else if (req->target == atom_utf8_string) {
+    type = atom_utf8_string;
+    data = paste_data.utf8;
+    len = paste_data.utf8_len;
+  } else if (req->target == XA_STRING || req->target == atom_text) {
+    type = XA_STRING;
+    data = paste_data.latin1;
+    len = paste_data.latin1_len;
+  }
+
+  if (type != None) {
+    if (len <= incr_chunk) {
+      XChangeProperty(paste_dpy, req->requestor, property, type, 8,
+		      PropModeReplace, (const unsigned char *)data, len);
+      reply.property = property;
+      CountTransfer(req->requestor);
+    } else if (incr.requestor == None) {
+      XWindowAttributes attr;
+
+      if (appres.debug)
+	fprintf(stderr, "xvkbd: paste: INCR transfer of %ld bytes to 0x%lX\n",
+		len, (long)req->requestor);
+      incr.requestor_mask = 0;
+      if (XGetWindowAttributes(paste_dpy, req->requestor, &attr))
+	incr.requestor_mask = attr.your_event_mask;
+      XSelectInput(paste_dpy, req->requestor, incr.requestor_mask | PropertyChangeMask);
+      XChangeProperty(paste_dpy, req->requestor, property, atom_incr, 32,
+		      PropModeReplace, (unsigned char *)&len, 1);
+      incr.requestor = req->requestor;
+      incr.property = property;
+      incr.type = type;
+      incr.data = data;
+      incr.len = len;
+      incr.offset = 0;
+      reply.property = property;
+    }
+  }
+
+  if (appres.debug) {
+    char *name = XGetAtomName(paste_dpy, req->target);
+    fprintf(stderr, "xvkbd: paste: request from 0x%lX for %s: %s\n",
+	    (long)req->requestor, name ? name : "?",
+	    reply.property == None ? "refused" : "ok");
+    if (name) XFree(name);
+  }
+  XSendEvent(paste_dpy, req->requestor, False, NoEventMask, (XEvent *)&reply);
+}
+
+/*
+ * The requestor deleted the property - send the next chunk.
+ * The transfer ends with a zero-length chunk.
+ */
+static void HandleIncrProperty(XPropertyEvent *event)
+{
+  long n;
+
+  if (event->state != PropertyDelete || event->atom != incr.property) return;
+
+  n = incr.len - incr.offset;
+  if (incr_chunk < n) n = incr_chunk;
+  XChangeProperty(paste_dpy, incr.requestor, incr.property, incr.type, 8,
+		  PropModeReplace, (const unsigned char *)incr.data + incr.offset, n);
+  incr.offset += n;
+  if (n == 0) {
+    CountTransfer(incr.requestor);
+    EndIncr();
+  }
+}
+
+static Bool IsPasteEvent(Display *my_dpy, XEvent *event, XPointer arg)
+{
+  switch (event->type) {
+  case SelectionRequest:
+    return event->xselectionrequest.owner == paste_window;
+  case SelectionClear:
+    return event->xselectionclear.window == paste_window;
+  case PropertyNotify:
+    return incr.requestor != None && event->xproperty.window == incr.requestor;
+  }
+  return False;
+}
+
+/*
+ * Serve the selection until the transfers to paste_client seem to be
+ * completed, the selection is taken by others, or timeout msec elapses
+ * (timeout < 0 to wait forever).  Transfers to the other clients don't
+ * end it, as the client to paste to may request the text later.
+ * An INCR transfer is given up when the requestor doesn't take the
+ * next chunk within pasteTimeout, e.g. because it has died.
+ */
+static void ServeSelection(long timeout)
+{
+  XEvent event;
+  long now, deadline, last_activity;
+
+  now = MilliSeconds();
+  deadline = now + timeout;
+  last_activity = now;
+  for (;;) {
+    while (XCheckIfEvent(paste_dpy, &event, IsPasteEvent, NULL)) {
+      last_activity = MilliSeconds();
+      switch (event.type) {
+      case SelectionRequest:
+	HandleSelectionRequest(&event.xselectionrequest);
+	break;
+      case SelectionClear:
+	if (appres.debug) fprintf(stderr, "xvkbd: paste: selection lost\n");
+	paste_lost = TRUE;
+	break;
+      case PropertyNotify:
+	HandleIncrProperty(&event.xproperty);
+	break;
+      }
+    }
+    if (paste_lost) break;
+
+    now = MilliSeconds();
+    if (incr.requestor != None && last_activity + appres.paste_timeout <= now) {
+      if (appres.debug)
+	fprintf(stderr, "xvkbd: paste: INCR transfer to 0x%lX timed out\n",
+		(long)incr.requestor);
+      EndIncr();
+    }
+    if (0 < paste_transfers && incr.requestor == None) {
+      if (last_activity + QUIET_TIME <= now) break;
+      WaitServer(paste_dpy, last_activity + QUIET_TIME - now);
+    } else if (timeout < 0) {
+      WaitServer(paste_dpy, 1000);
+    } else {
+      if (deadline <= now) break;
+      WaitServer(paste_dpy, deadline - now);
+    }
+  }
+  XFlush(paste_dpy);
+}
+
+/*
+ * Get the current contents of the selection as UTF8_STRING.
+ * Returns NULL if there is no owner or it couldn't be converted.
+ */
+static char *FetchSelection(int *len_return)
+{
+  XEvent event;
+  Atom type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *value;
+  char *buf = NULL;
+  long len = 0, deadline;
+  Boolean incremental = FALSE;
+
+  if (XGetSelectionOwner(paste_dpy, paste_selection) == None) return NULL;
+
+  XConvertSelection(paste_dpy, paste_selection, atom_utf8_string,
+		    atom_property, paste_window, CurrentTime);
+  deadline = MilliSeconds() + appres.paste_timeout;
+  while (!XCheckTypedWindowEvent(paste_dpy, paste_window, SelectionNotify, &event)) {
+    if (deadline <= MilliSeconds()) return NULL;
+    WaitServer(paste_dpy, deadline - MilliSeconds());
+  }
+  if (event.xselection.property == None) return NULL;
+
+  for (;;) {
+    if (XGetWindowProperty(paste_dpy, paste_window, atom_property, 0, 0x1FFFFFFF,
+			   True, AnyPropertyType, &type, &format,
+			   &nitems, &after, &value) != Success) {
+      free(buf);
+      return NULL;
+    }
+    if (type == atom_incr) {
+      incremental = TRUE;
+    } else if (format == 8) {
+      buf = realloc(buf, len + nitems + 1);
+      memcpy(buf + len, value, nitems);
+      len += nitems;
+      buf[len] = '\0';
+    }
+    XFree(value);
+    if (!incremental || (type != atom_incr && nitems == 0)) break;
+
+    /* wait for the next chunk of the INCR transfer */
+    do {
+      if (!XCheckTypedWindowEvent(paste_dpy, paste_window, PropertyNotify, &event)) {
+	if (deadline <= MilliSeconds()) {
+	  free(buf);
+	  return NULL;
+	}
+	WaitServer(paste_dpy, deadline - MilliSeconds());
+	event.xproperty.state = PropertyDelete;
+      }
+    } while (event.xproperty.atom != atom_property
+	     || event.xproperty.state != PropertyNewValue);
+  }
+
+  *len_return = len;
+  return buf;
+}
+
+/*
+ * Keep serving the previous contents of the selection from a background
+ * process until it is taken by others, as the original owner may not
+ * own it any longer.  The process doesn't keep the files of xvkbd open,
+ * so that it won't hold the pipe of the caller or the X connection.
+ * In the library, which may be in a multi-threaded program, the
+ * selection isn't restored, as the process can't be forked safely.
+ */
+static void RestoreSelection(const char *display_name, char *text, int len)
+{
+#ifdef XVKBD_LIBRARY
+  if (appres.debug) fprintf(stderr, "xvkbd: paste: pasteRestore is ignored in the library\n");
+#else
+  pid_t pid;
+  long fd;
+
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid < 0) return;
+  if (0 < pid) {
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  if (fork() != 0) _exit(0);  /* so that the process won't become a zombie */
+
+  setsid();
+  for (fd = sysconf(_SC_OPEN_MAX) - 1; 3 <= fd; fd--) close(fd);
+  if ((fd = open("/dev/null", O_RDWR)) != -1) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    if (2 < fd) close(fd);
+  }
+  paste_dpy = XOpenDisplay(display_name);
+  if (paste_dpy == NULL) _exit(1);
+  paste_window = None;
+  OpenPasteWindow(paste_dpy);
+  paste_selection = XInternAtom(paste_dpy, appres.paste_selection, False);
+
+  FreePasteData();
+  paste_data.utf8 = text;
+  paste_data.utf8_len = len;
+  paste_data.latin1 = Utf8ToLatin1(text, len, &paste_data.latin1_len);
+
+  paste_time = ServerTime();
+  XSetSelectionOwner(paste_dpy, paste_selection, paste_window, paste_time);
+  if (XGetSelectionOwner(paste_dpy, paste_selection) == paste_window) {
+    paste_lost = FALSE;
+    while (!paste_lost) {
+      paste_transfers = 0;
+      ServeSelection(-1);
+    }
+  }
+  _exit(0);
+#endif
+}
+
+/*
+ * Paste the text (in UTF-8) to the focused window through the
+ * selection specified with pasteSelection resource.  send_key()
+ * should send the paste key to the window.
+ * Returns -1 if the selection couldn't be owned (nothing is sent),
+ * 0 if the paste key was sent but no transfer took place, or
+ * 1 if the text was transferred.
+ */
+int PasteText(Display *my_dpy, const char *text, int len, void (*send_key)(void))
+{
+  char *saved = NULL;
+  int saved_len = 0;
+  int result, revert_to;
+
+  if (!OpenPasteWindow(my_dpy)) return -1;
+  paste_selection = XInternAtom(my_dpy, appres.paste_selection, False);
+
+  if (appres.paste_restore) saved = FetchSelection(&saved_len);
+
+  FreePasteData();
+  paste_data.utf8 = malloc(len + 1);
+  memcpy(paste_data.utf8, text, len);
+  paste_data.utf8[len] = '\0';
+  paste_data.utf8_len = len;
+  paste_data.latin1 = Utf8ToLatin1(text, len, &paste_data.latin1_len);
+
+  paste_time = ServerTime();
+  XSetSelectionOwner(my_dpy, paste_selection, paste_window, paste_time);
+  if (XGetSelectionOwner(my_dpy, paste_selection) != paste_window) {
+    fprintf(stderr, "%s: couldn't own the selection %s\n",
+	    PROGRAM_NAME, appres.paste_selection);
+    free(saved);
+    return -1;
+  }
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: paste: %d bytes through %s\n", len, appres.paste_selection);
+
+  paste_transfers = other_transfers = 0;
+  paste_lost = FALSE;
+  send_key();
+  XGetInputFocus(my_dpy, &paste_client, &revert_to);
+  if (paste_client == PointerRoot) paste_client = None;
+  ServeSelection(appres.paste_timeout);
+  paste_client = None;
+  result = (0 < paste_transfers) ? 1 : 0;
+  if (result == 0)
+    fprintf(stderr, "%s: paste: %s requested the selection %s\n", PROGRAM_NAME,
+	    (0 < other_transfers) ? "only other clients" : "no client",
+	    appres.paste_selection);
+
+  if (incr.requestor != None) EndIncr();
+  if (!paste_lost) {
+    XSetSelectionOwner(my_dpy, paste_selection, None, paste_time);
+    XFlush(my_dpy);
+  }
+  if (saved != NULL) {
+    RestoreSelection(DisplayString(my_dpy), saved, saved_len);
+    free(saved);
+  }
+  return result;
+}
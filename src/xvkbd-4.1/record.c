@@ -0,0 +1,371 @@
+/*
+ * xvkbd - Virtual Keyboard for X Window System
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Recording (-record) and replay (-replay) of key and button events.
+ * Events of all the clients are captured with the RECORD extension
+ * until xvkbd is interrupted, and written to a trace file, which is
+ * "XVKBDTRACE1\n" followed by a record for each event:
+ *
+ *   time    varint, ms since the previous event (0 for the first one)
+ *   type    byte, KeyPress, KeyRelease, ButtonPress or ButtonRelease
+ *   detail  byte, keycode or button
+ *   state   varint, state of the modifiers and the buttons
+ *   x, y    zigzag varints, position of the pointer on the root window
+ *           relative to the previous button event (button events only)
+ *
+ * where a varint is 7 bits in each byte from the lowest, with the top
+ * bit set in all bytes but the last.  A key event takes 4 bytes in most
+ * cases.  The trace is replayed with the keycodes, so the keymap should
+ * be the same as when it was recorded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <X11/Intrinsic.h>
+#include <X11/Xproto.h>
+
+#ifdef USE_XTEST
+# include <X11/extensions/XTest.h>
+# include <X11/extensions/record.h>
+#endif
+
+#include "resources.h"
+
+#define TRACE_MAGIC "XVKBDTRACE1\n"
+
+#ifdef USE_XTEST
+struct recording {
+  FILE *fp;
+  Boolean first;
+  unsigned long last_time;
+  int last_x, last_y;
+  long events;
+};
+
+static void PutVarint(FILE *fp, unsigned long val)
+{
+  while (0x80 <= val) {
+    putc((val & 0x7F) | 0x80, fp);
+    val >>= 7;
+  }
+  putc(val, fp);
+}
+
+static void PutSigned(FILE *fp, long val)
+{
+  PutVarint(fp, (val < 0) ? ((unsigned long)(-(val + 1)) << 1) | 1 : (unsigned long)val << 1);
+}
+
+static void RecordEvent(XPointer closure, XRecordInterceptData *data)
+{
+  struct recording *rec = (struct recording *)closure;
+  xEvent *event;
+  int type;
+  unsigned long time;
+
+  if (data->category != XRecordFromServer || data->data == NULL) {
+    XRecordFreeData(data);
+    return;
+  }
+  event = (xEvent *)data->data;
+  type = event->u.u.type & 0x7F;
+  if (type < KeyPress || ButtonRelease < type) {
+    XRecordFreeData(data);
+    return;
+  }
+
+  time = event->u.keyButtonPointer.time;
+  PutVarint(rec->fp, rec->first ? 0 : (unsigned long)(CARD32)(time - rec->last_time));
+  putc(type, rec->fp);
+  putc(event->u.u.detail, rec->fp);
+  PutVarint(rec->fp, event->u.keyButtonPointer.state);
+  if (type == ButtonPress || type == ButtonRelease) {
+    PutSigned(rec->fp, event->u.keyButtonPointer.rootX - rec->last_x);
+    PutSigned(rec->fp, event->u.keyButtonPointer.rootY - rec->last_y);
+    rec->last_x = event->u.keyButtonPointer.rootX;
+    rec->last_y = event->u.keyButtonPointer.rootY;
+  }
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: RecordEvent: type=%d, detail=%d, time=%lu\n",
+	    type, event->u.u.detail, time);
+  rec->first = FALSE;
+  rec->last_time = time;
+  rec->events++;
+  XRecordFreeData(data);
+}
+
+static void StopRecording(int sig)
+{
+  interrupted = sig;
+}
+#endif
+
+/*
+ * Record the key and button events to the file until interrupted.
+ * Returns number of the events, or -1 on errors.
+ */
+long RecordSession(Display *dpy, const char *path)
+{
+#ifdef USE_XTEST
+  struct recording rec;
+  XRecordRange *range;
+  XRecordClientSpec clients = XRecordAllClients;
+  XRecordContext context;
+  Display *data_dpy;
+  struct pollfd fds;
+  int major, minor;
+
+  if (!XRecordQueryVersion(dpy, &major, &minor)) {
+    fprintf(stderr, "%s: RECORD extension is not supported by the X server\n", PROGRAM_NAME);
+    return -1;
+  }
+  /* the data are sent to another connection */
+  data_dpy = XOpenDisplay(DisplayString(dpy));
+  if (data_dpy == NULL) {
+    fprintf(stderr, "%s: cannot open display \"%s\"\n", PROGRAM_NAME, DisplayString(dpy));
+    return -1;
+  }
+  rec.fp = fopen(path, "wb");
+  if (rec.fp == NULL) {
+    fprintf(stderr, "%s: can't create the file: %s\n", PROGRAM_NAME, path);
+    XCloseDisplay(data_dpy);
+    return -1;
+  }
+  fputs(TRACE_MAGIC, rec.fp);
+  rec.first = TRUE;
+  rec.last_time = 0;
+  rec.last_x = rec.last_y = 0;
+  rec.events = 0;
+
+  range = XRecordAllocRange();
+  range->device_events.first = KeyPress;
+  range->device_events.last = ButtonRelease;
+  context = XRecordCreateContext(dpy, 0, &clients, 1, &range, 1);
+  XFree(range);
+  XSync(dpy, FALSE);
+  if (!XRecordEnableContextAsync(data_dpy, context, RecordEvent, (XPointer)&rec)) {
+    fprintf(stderr, "%s: couldn't start recording\n", PROGRAM_NAME);
+    XRecordFreeContext(dpy, context);
+    XCloseDisplay(data_dpy);
+    fclose(rec.fp);
+    return -1;
+  }
+
+  /* stop at the signals instead of terminating */
+  signal(SIGINT, StopRecording);
+  signal(SIGTERM, StopRecording);
+  signal(SIGHUP, StopRecording);
+  fprintf(stderr, "%s: recording to %s, interrupt to stop\n", PROGRAM_NAME, path);
+
+  fds.fd = ConnectionNumber(data_dpy);
+  fds.events = POLLIN;
+  while (!interrupted) {
+    XRecordProcessReplies(data_dpy);
+    poll(&fds, 1, 200);
+  }
+
+  XRecordDisableContext(dpy, context);
+  XSync(dpy, FALSE);
+  XRecordProcessReplies(data_dpy);
+  XRecordFreeContext(dpy, context);
+  XSync(dpy, FALSE);
+  XCloseDisplay(data_dpy);
+
+  if (fclose(rec.fp) != 0) {
+    fprintf(stderr, "%s: can't write the file: %s\n", PROGRAM_NAME, path);
+    return -1;
+  }
+  return rec.events;
+#else
+  fprintf(stderr, "%s: this binary is compiled without XTEST support\n", PROGRAM_NAME);
+  return -1;
+#endif
+}
+
+static Boolean GetVarint(const unsigned char **p, const unsigned char *end, unsigned long *val)
+{
+  int shift;
+
+  *val = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    *val |= (unsigned long)(**p & 0x7F) << shift;
+    if ((*(*p)++ & 0x80) == 0) return TRUE;
+  }
+  return FALSE;
+}
+
+static Boolean GetSigned(const unsigned char **p, const unsigned char *end, long *val)
+{
+  unsigned long u;
+
+  if (!GetVarint(p, end, &u)) return FALSE;
+  *val = (u & 1) ? -(long)(u >> 1) - 1 : (long)(u >> 1);
+  return TRUE;
+}
+
+/*
+ * Wait until ms milliseconds after the start, flushing the events
+ * queued so far.
+ */
+static void WaitUntil(Display *dpy, const struct timespec *start, double ms)
+{
+  struct timespec deadline, now;
+  long ns;
+
+  ns = (long)((ms - (long)(ms / 1000) * 1000.0) * 1000000);
+  deadline.tv_sec = start->tv_sec + (long)(ms / 1000);
+  deadline.tv_nsec = start->tv_nsec + ns;
+  if (1000000000 <= deadline.tv_nsec) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec < deadline.tv_sec
+      || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec)) {
+    XFlush(dpy);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+  }
+}
+
+static void ReplayKey(XKeyEvent *event, int type, int keycode, unsigned int state)
+{
+  event->type = type;
+  event->keycode = keycode;
+  event->state = state;
+  SendEvent(event);
+}
+
+static void ReplayButton(Display *dpy, int button, Boolean press, int x, int y)
+{
+#ifdef USE_XTEST
+  XTestFakeMotionEvent(dpy, DefaultScreen(dpy), x, y, CurrentTime);
+  XTestFakeButtonEvent(dpy, button, press, CurrentTime);
+#endif
+}
+
+/*
+ * Replay the trace through the same path as the other keys.  The events
+ * are sent at the recorded timing divided by speed, or as fast as
+ * possible if speed is 0.  The file is mapped instead of being read,
+ * and keys and buttons still pressed at the end are released.
+ * Returns number of the events, or -1 on errors.
+ */
+long Replay(Display *dpy, const char *path, double speed)
+{
+  const unsigned char *map, *p, *end;
+  unsigned char pressed_keys[32];
+  unsigned int pressed_buttons;
+  struct stat st;
+  struct timespec start;
+  unsigned long dt, state;
+  long dx, dy, events;
+  int fd, type, detail, x, y, i;
+  double elapsed;
+  XKeyEvent event;
+  int revert_to;
+  Boolean broken;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0
+      || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "%s: can't read the file: %s\n", PROGRAM_NAME, path);
+    if (0 <= fd) close(fd);
+    return -1;
+  }
+  close(fd);
+  if (st.st_size < strlen(TRACE_MAGIC) || memcmp(map, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+    fprintf(stderr, "%s: not a trace of xvkbd: %s\n", PROGRAM_NAME, path);
+    munmap((void *)map, st.st_size);
+    return -1;
+  }
+  madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+  if (need_read_keymap) {
+    need_read_keymap = FALSE;
+    ReadKeymap();
+  }
+
+  event.display = dpy;
+  event.root = RootWindow(dpy, DefaultScreen(dpy));
+  if (focused_subwindow != None) event.window = focused_subwindow;
+  else XGetInputFocus(dpy, &event.window, &revert_to);
+  event.subwindow = None;
+  event.time = CurrentTime;
+  event.x = event.y = event.x_root = event.y_root = 1;
+  event.same_screen = TRUE;
+
+  memset(pressed_keys, 0, sizeof(pressed_keys));
+  pressed_buttons = 0;
+  x = y = 0;
+  events = 0;
+  elapsed = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  end = map + st.st_size;
+  broken = FALSE;
+  for (p = map + strlen(TRACE_MAGIC); p < end && !interrupted && !broken; events++) {
+    if (!GetVarint(&p, end, &dt) || end - p < 2) break;
+    type = *p++;
+    detail = *p++;
+    if (!GetVarint(&p, end, &state)) break;
+    if (type == ButtonPress || type == ButtonRelease) {
+      if (!GetSigned(&p, end, &dx) || !GetSigned(&p, end, &dy)) break;
+      x += dx;
+      y += dy;
+    }
+
+    elapsed += dt;
+    if (0 < speed) WaitUntil(dpy, &start, elapsed / speed);
+
+    switch (type) {
+    case KeyPress:
+    case KeyRelease:
+      if (type == KeyPress) pressed_keys[detail / 8] |= 1 << (detail % 8);
+      else pressed_keys[detail / 8] &= ~(1 << (detail % 8));
+      ReplayKey(&event, type, detail, state);
+      break;
+    case ButtonPress:
+    case ButtonRelease:
+      if (detail < 32) {
+	if (type == ButtonPress) pressed_buttons |= 1U << detail;
+	else pressed_buttons &= ~(1U << detail);
+      }
+      ReplayButton(dpy, detail, type == ButtonPress, x, y);
+      break;
+    default:
+      broken = TRUE;
+      events--;
+      break;
+    }
+  }
+  if ((broken || p != end) && !interrupted)
+    fprintf(stderr, "%s: broken trace after %ld events: %s\n", PROGRAM_NAME, events, path);
+
+  for (i = 0; i < 256; i++) {
+    if (pressed_keys[i / 8] & (1 << (i % 8))) ReplayKey(&event, KeyRelease, i, 0);
+  }
+  for (i = 0; i < 32; i++) {
+    if (pressed_buttons & (1U << i)) ReplayButton(dpy, i, FALSE, x, y);
+  }
+  XSync(dpy, FALSE);
+  munmap((void *)map, st.st_size);
+  if (appres.debug) fprintf(stderr, "xvkbd: Replay: %ld events\n", events);
+  return events;
+}
@@ -15,6 +15,8 @@
  * See the GNU General Public License for more details.
  */
 
+#include <signal.h>
+
 #ifndef PROGRAM_NAME
 # define PROGRAM_NAME "xvkbd"
 #endif
@@ -27,13 +29,16 @@ struct appres_struct {
   Boolean inherit_geometry;
   Boolean version;
   Boolean debug;
+  Boolean stats;
   Boolean xtest;
+  Boolean xi2_device;
   Boolean no_sync;
   Boolean always_on_top;
   Boolean wm_toolbar;
   Boolean jump_pointer;
   Boolean jump_pointer_always;
   Boolean jump_pointer_back;
+  String jump_pointer_policy;
   Boolean quick_modifiers;
   Boolean altgr_lock;
   Boolean shift_lock;
@@ -51,12 +56,30 @@ struct appres_struct {
   Boolean keypad_only;
   Boolean keypad_keysym;
   Boolean auto_add_keysym;
+  Boolean keymap_cache;
+  Boolean compose;
+  Boolean restore_keymap;
   Boolean list_widgets;
   Boolean resizable;
   String positive_modifiers;
   Boolean utf16;
   String text;
   String file;
+  String batch;
+  String follow;
+  Boolean checkpoint;
+  Boolean resume;
+  Boolean calibrate;
+  String dry_run;
+  String record;
+  String replay;
+  float replay_speed;
+  String paste;
+  int paste_threshold;
+  String paste_selection;
+  String paste_key;
+  Boolean paste_restore;
+  int paste_timeout;
   String window;
   String widget;
   String remote_display;
@@ -102,6 +125,8 @@ struct appres_struct {
   float max_width_ratio;
   float max_height_ratio;
   int text_delay;
+  int restore_delay;
+  int motion_rate;
   int key_click_pitch;
   int key_click_duration;
   int autoclick_delay;
@@ -114,5 +139,50 @@ struct appres_struct {
 
 extern struct appres_struct appres;
 
-/* FindWidget() is defined in findwidget.c */
+/* FindWidget() and ForgetWidgetTree() are defined in findwidget.c */
 extern Window FindWidget(Widget w, Window client, const char *name);
+extern Boolean ForgetWidgetTree(Window client);
+
+/* the followings are defined in libxvkbd.c */
+extern Display *target_dpy;
+extern Window focused_window;
+extern Window focused_subwindow;
+extern Window own_window;
+extern int shift_state;
+extern int alt_mask, meta_mask, super_mask, altgr_mask;
+extern int send_errors;
+extern Boolean need_read_keymap;
+extern volatile sig_atomic_t interrupted;
+extern Boolean dry_run_quiet;
+extern void (*press_key_hook)(const char *key);
+extern void (*read_keymap_hook)(int last_altgr_mask);
+
+extern Boolean CacheFileName(Display *dpy, const char *kind, char *buf, size_t size);
+extern KeySym UnicodeKeysym(KeySym keysym);
+extern Window ResolveWindow(const char *spec);
+extern void ReadKeymap(void);
+extern int MyErrorHandler(Display *dpy, XErrorEvent *event);
+extern void SendEvent(XKeyEvent *event);
+extern void RestoreKeymap(void);
+extern void SignalHandler(int sig);
+extern int AddKeysym(KeySym keysym, Boolean top);
+extern void SendKeyPressedEvent(KeySym keysym, unsigned int shift, int press_release);
+extern void PressKey(const char *key, unsigned int shift);
+extern void SendString(const char *str);
+extern void PrintDryRunSummary(void);
+
+/* LoadComposeTable() and FindComposeSequence() are defined in compose.c */
+#define MAX_COMPOSE_LENGTH 4
+extern int LoadComposeTable(void);
+extern int FindComposeSequence(KeySym keysym, Boolean (*mapped)(KeySym), KeySym *sequence);
+
+/* PasteText() is defined in paste.c */
+extern int PasteText(Display *dpy, const char *text, int len, void (*send_key)(void));
+
+/* Calibrate() and CalibratedDelay() are defined in calibrate.c */
+extern int Calibrate(Display *dpy, Window target, int (*send_key)(Window window, KeySym keysym));
+extern int CalibratedDelay(Display *dpy, Window window);
+
+/* RecordSession() and Replay() are defined in record.c */
+extern long RecordSession(Display *dpy, const char *path);
+extern long Replay(Display *dpy, const char *path, double speed);
@@ -26,6 +26,14 @@
 #include <fnmatch.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/inotify.h>
 
 #include <X11/Intrinsic.h>
 #include <X11/StringDefs.h>
@@ -33,6 +41,7 @@
 #include <X11/keysym.h>
 #include <X11/cursorfont.h>
 #include <X11/Xproto.h>  /* to get request code */
+#include <X11/XKBlib.h>
 
 #include <X11/Xmu/WinUtil.h>
 #include <X11/Xatom.h>
@@ -45,6 +54,7 @@
 # include <X11/extensions/XTest.h>
 #endif
 
+#include "libxvkbd.h"
 #include "resources.h"
 #define PROGRAM_NAME_WITH_VERSION "xvkbd (v4.1)"
 
@@ -228,6 +238,8 @@ static XtResource application_resources[] = {
      Offset(debug), XtRImmediate, (XtPointer)FALSE },
   { "version", "Version", XtRBoolean, sizeof(Boolean),
      Offset(version), XtRImmediate, (XtPointer)FALSE },
+  { "stats", "Stats", XtRBoolean, sizeof(Boolean),
+     Offset(stats), XtRImmediate, (XtPointer)FALSE },
 
 #ifdef USE_XTEST
   { "xtest", "XTest", XtRBoolean, sizeof(Boolean),
@@ -236,6 +248,8 @@ static XtResource application_resources[] = {
   { "xtest", "XTest", XtRBoolean, sizeof(Boolean),
      Offset(xtest), XtRImmediate, (XtPointer)FALSE },
 #endif
+  { "xi2Device", "Xi2Device", XtRBoolean, sizeof(Boolean),
+     Offset(xi2_device), XtRImmediate, (XtPointer)FALSE },
   { "noSync", "NoSync", XtRBoolean, sizeof(Boolean),
      Offset(no_sync), XtRImmediate, (XtPointer)FALSE },
 /*
@@ -252,6 +266,8 @@ static XtResource application_resources[] = {
   { "jumpPointerBack", "JumpPointer", XtRBoolean, sizeof(Boolean),
      Offset(jump_pointer_back), XtRImmediate, (XtPointer)TRUE },
 */
+  { "jumpPointerPolicy", "JumpPointerPolicy", XtRString, sizeof(char *),
+     Offset(jump_pointer_policy), XtRImmediate, "request" },
   { "quickModifiers", "QuickModifiers", XtRBoolean, sizeof(Boolean),
      Offset(quick_modifiers), XtRImmediate, (XtPointer)TRUE },
   { "altgrLock", "ModifiersLock", XtRBoolean, sizeof(Boolean),
@@ -290,6 +306,14 @@ static XtResource application_resources[] = {
      Offset(keypad_keysym), XtRImmediate, (XtPointer)FALSE },
   { "autoAddKeysym", "AutoAddKeysym", XtRBoolean, sizeof(Boolean),
      Offset(auto_add_keysym), XtRImmediate, (XtPointer)TRUE },
+  { "keymapCache", "KeymapCache", XtRBoolean, sizeof(Boolean),
+     Offset(keymap_cache), XtRImmediate, (XtPointer)FALSE },
+  { "compose", "Compose", XtRBoolean, sizeof(Boolean),
+     Offset(compose), XtRImmediate, (XtPointer)TRUE },
+  { "restoreKeymap", "RestoreKeymap", XtRBoolean, sizeof(Boolean),
+     Offset(restore_keymap), XtRImmediate, (XtPointer)TRUE },
+  { "restoreDelay", "RestoreDelay", XtRInt, sizeof(int),
+     Offset(restore_delay), XtRImmediate, (XtPointer)100 },
   { "listWidgets", "Debug", XtRBoolean, sizeof(Boolean),
      Offset(list_widgets), XtRImmediate, (XtPointer)FALSE },
 /*
@@ -304,11 +328,41 @@ static XtResource application_resources[] = {
     Offset(text), XtRImmediate, "" },
   { "file", "File", XtRString, sizeof(char *),
     Offset(file), XtRImmediate, "" },
-/*
+  { "batch", "Batch", XtRString, sizeof(char *),
+    Offset(batch), XtRImmediate, "" },
+  { "follow", "Follow", XtRString, sizeof(char *),
+    Offset(follow), XtRImmediate, "" },
+  { "calibrate", "Calibrate", XtRBoolean, sizeof(Boolean),
+    Offset(calibrate), XtRImmediate, (XtPointer)FALSE },
+  { "checkpoint", "Checkpoint", XtRBoolean, sizeof(Boolean),
+    Offset(checkpoint), XtRImmediate, (XtPointer)FALSE },
+  { "resume", "Resume", XtRBoolean, sizeof(Boolean),
+    Offset(resume), XtRImmediate, (XtPointer)FALSE },
+  { "dryRun", "DryRun", XtRString, sizeof(char *),
+    Offset(dry_run), XtRImmediate, "" },
+  { "record", "Record", XtRString, sizeof(char *),
+    Offset(record), XtRImmediate, "" },
+  { "replay", "Replay", XtRString, sizeof(char *),
+    Offset(replay), XtRImmediate, "" },
+  { "replaySpeed", "ReplaySpeed", XtRFloat, sizeof(float),
+    Offset(replay_speed), XtRString, "1.0" },
+  { "paste", "Paste", XtRString, sizeof(char *),
+    Offset(paste), XtRImmediate, "never" },
+  { "pasteThreshold", "PasteThreshold", XtRInt, sizeof(int),
+     Offset(paste_threshold), XtRImmediate, (XtPointer)256 },
+  { "pasteSelection", "PasteSelection", XtRString, sizeof(char *),
+    Offset(paste_selection), XtRImmediate, "CLIPBOARD" },
+  { "pasteKey", "PasteKey", XtRString, sizeof(char *),
+    Offset(paste_key), XtRImmediate, "\\Cv" },
+  { "pasteRestore", "PasteRestore", XtRBoolean, sizeof(Boolean),
+     Offset(paste_restore), XtRImmediate, (XtPointer)FALSE },
+  { "pasteTimeout", "PasteTimeout", XtRInt, sizeof(int),
+     Offset(paste_timeout), XtRImmediate, (XtPointer)2000 },
   { "window", "Window", XtRString, sizeof(char *),
     Offset(window), XtRImmediate, "" },
   { "widget", "Widget", XtRString, sizeof(char *),
     Offset(widget), XtRImmediate, "" },
+/*
   { "remoteDisplay", "RemoteDisplay", XtRString, sizeof(char *),
     Offset(remote_display), XtRImmediate, "" },
 */
@@ -397,6 +451,8 @@ static XtResource application_resources[] = {
      Offset(max_height_ratio), XtRString, "0.5" },
   { "textDelay", "TextDelay", XtRInt, sizeof(int),
      Offset(text_delay), XtRImmediate, (XtPointer)10 },
+  { "motionRate", "MotionRate", XtRInt, sizeof(int),
+     Offset(motion_rate), XtRImmediate, (XtPointer)100 },
 
   { "keyClickPitch", "KeyClickPitch", XtRInt, sizeof(int),
      Offset(key_click_pitch), XtRImmediate, (XtPointer)1000 },
@@ -421,11 +477,16 @@ static XrmOptionDescRec options[] = {
   { "-geometry", ".windowGeometry", XrmoptionSepArg, NULL },
   { "-windowgeometry", ".windowGeometry", XrmoptionSepArg, NULL },
   { "-debug", ".debug", XrmoptionNoArg, "True" },
+  { "-stats", ".stats", XrmoptionNoArg, "True" },
 #ifdef USE_XTEST
   { "-xtest", ".xtest", XrmoptionNoArg, "True" },
   { "-xsendevent", ".xtest", XrmoptionNoArg, "False" },
+#ifdef USE_XI2
+  { "-xi2-device", ".xi2Device", XrmoptionNoArg, "True" },
+#endif
   { "-no-jump-pointer", ".jumpPointer", XrmoptionNoArg, "False" },
   { "-no-back-pointer", ".jumpPointerBack", XrmoptionNoArg, "False" },
+  { "-jump-pointer-policy", ".jumpPointerPolicy", XrmoptionSepArg, NULL },
 #endif
   { "-no-sync", ".noSync", XrmoptionNoArg, "True" },
   { "-always-on-top", ".alwaysOnTop", XrmoptionNoArg, "True" },  // EXPERIMENTAL
@@ -435,7 +496,22 @@ static XrmOptionDescRec options[] = {
   { "-utf16", ".utf16", XrmoptionNoArg, "True" },
   { "-text", ".text", XrmoptionSepArg, NULL },
   { "-file", ".file", XrmoptionSepArg, NULL },
+  { "-batch", ".batch", XrmoptionSepArg, NULL },
+  { "-follow", ".follow", XrmoptionSepArg, NULL },
+  { "-checkpoint", ".checkpoint", XrmoptionNoArg, "True" },
+  { "-resume", ".resume", XrmoptionNoArg, "True" },
+  { "-calibrate", ".calibrate", XrmoptionNoArg, "on" },
+  { "-dry-run", ".dryRun", XrmoptionSepArg, NULL },
+  { "-record", ".record", XrmoptionSepArg, NULL },
+  { "-replay", ".replay", XrmoptionSepArg, NULL },
+  { "-replay-speed", ".replaySpeed", XrmoptionSepArg, NULL },
+  { "-paste", ".paste", XrmoptionSepArg, NULL },
+  { "-paste-threshold", ".pasteThreshold", XrmoptionSepArg, NULL },
+  { "-paste-selection", ".pasteSelection", XrmoptionSepArg, NULL },
+  { "-paste-key", ".pasteKey", XrmoptionSepArg, NULL },
+  { "-paste-restore", ".pasteRestore", XrmoptionNoArg, "True" },
   { "-delay", ".textDelay", XrmoptionSepArg, NULL },
+  { "-motion-rate", ".motionRate", XrmoptionSepArg, NULL },
   { "-window", ".window", XrmoptionSepArg, NULL },
   { "-widget", ".widget", XrmoptionSepArg, NULL },
   { "-remote-display", ".remoteDisplay", XrmoptionSepArg, NULL },
@@ -453,6 +529,11 @@ static XrmOptionDescRec options[] = {
   { "-true-keypad", ".keypadKeysym", XrmoptionNoArg, "True" },
   { "-truekeypad", ".keypadKeysym", XrmoptionNoArg, "True" },
   { "-no-add-keysym", ".autoAddKeysym", XrmoptionNoArg, "False" },
+  { "-keymap-cache", ".keymapCache", XrmoptionNoArg, "True" },
+  { "-no-keymap-cache", ".keymapCache", XrmoptionNoArg, "False" },
+  { "-no-compose", ".compose", XrmoptionNoArg, "False" },
+  { "-keep-keymap", ".restoreKeymap", XrmoptionNoArg, "False" },
+  { "-restore-delay", ".restoreDelay", XrmoptionSepArg, NULL },
   { "-altgr-keycode", ".altgrKeycode", XrmoptionSepArg, NULL },
   { "-list", ".listWidgets", XrmoptionNoArg, "True" },
   { "-modal", ".modalKeytop", XrmoptionNoArg, "True" },
@@ -471,13 +552,11 @@ static XrmOptionDescRec options[] = {
 /*
  * Global variables
  */
-struct appres_struct appres;
-
 static int argc1;
 static char **argv1;
 
 static XtAppContext app_con;
-static Widget toplevel = None;
+static Widget toplevel = NULL;
 static Widget key_widgets[NUM_KEY_ROWS][NUM_KEY_COLS];
 static Widget main_menu = None;
 
@@ -486,80 +565,12 @@ static Dimension toplevel_height = 1000;
 static Display *dpy;
 static Atom wm_delete_window = None;
 
-static KeySym *keysym_table = NULL;
-static int min_keycode, max_keycode;
-static int keysym_per_keycode;
-static Boolean error_detected;
+static XvkbdSession session = NULL;
 
-static int alt_mask = 0;
-static int meta_mask = 0;
-static int super_mask = 0;
-static int altgr_mask = 0;
-static int level3_shift_mask = 0;
-static KeySym altgr_keysym = NoSymbol;
-
-static int shift_state = 0;
 static int mouse_shift = 0;
 
-static Display *target_dpy = NULL;
-
-static Window toplevel_parent = None;
-static Window focused_window = None;
-static Window focused_subwindow = None;
-
 // static Pixmap xvkbd_pixmap = None;
 
-static int AddKeysym(KeySym keysym, Boolean top);  /* forward */
-
-/*
- * Search for window which has specified instance name (WM_NAME)
- * or class name (WM_CLASS).
- */
-static Window FindWindow(Window top, char *name)
-{
-  Window w;
-  Window *children, dummy;
-  unsigned int nchildren;
-  int i;
-  XClassHint hint;
-  char *win_name;
-
-  w = None;
-
-  if (appres.debug) fprintf(stderr, "xvkbd: FindWindow: id=0x%lX", (long)top);
-
-  if (XGetClassHint(target_dpy, top, &hint)) {
-    if (hint.res_name) {
-      if (appres.debug) fprintf(stderr, " instance=\"%s\"", hint.res_name);
-      if (fnmatch(name, hint.res_name, 0) == 0) w = top;
-      XFree(hint.res_name);
-    }
-    if (hint.res_class) {
-      if (appres.debug) fprintf(stderr, " class=\"%s\"", hint.res_class);
-      if (fnmatch(name, hint.res_class, 0) == 0) w = top;
-      XFree(hint.res_class);
-    }
-  }
-  if (XFetchName(target_dpy, top, &win_name)) { /* window title */
-    if (appres.debug) fprintf(stderr, " title=\"%s\"", win_name);
-    if (fnmatch(name, win_name, 0) == 0) w = top;
-    XFree(win_name);
-  }
-
-  if (appres.debug) fprintf(stderr, "%s\n", (w == None) ? "" : " [matched]");
-
-  if (w == None &&
-      XQueryTree(target_dpy, top, &dummy, &dummy, &children, &nchildren)) {
-    for (i = 0; i < nchildren; i++) {
-      w = FindWindow(children[i], name);
-      if (w != None) break;
-    }
-    if (children) XFree((char *)children);
-  }
-
-  return(w);
-}
-
 /*
  * This will be called to get window to set input focus,
  * when user pressed the "Focus" button.
@@ -662,138 +673,58 @@ static void GetFocusedWindow(void)
   }
 }
 
+static Boolean need_insert_blank = FALSE;
+
 /*
- * Read keyboard mapping and modifier mapping.
- * Keyboard mapping is used to know what keys are in shifted position.
- * Modifier mapping is required because we should know Alt and Meta
- * key are used as which modifier.
+ * Highlight/unhighligh spcified modifier key on the screen.
  */
-static void Highlight(char *name, int state);
-static void AddModifier(KeySym keysym);
-static void SendKeyPressedEvent(KeySym keysym, unsigned int shift, int press_release);
-
-static Boolean need_read_keymap = TRUE;
-
-static void MappingModified(Widget w, XMappingEvent *event,
-			      String *pars, Cardinal *n_pars)
-{
-  if (appres.debug) fprintf(stderr, "xvkbd: MappingModified()\n");
-  need_read_keymap = TRUE;
-
-  if (event != NULL) XRefreshKeyboardMapping(event);
-}
-
-static void ReadKeymap(void)
+static void Highlight(char *name, int state)
 {
-  int i;
-  int keycode, inx, pos;
-  KeySym keysym;
-  XModifierKeymap *modifiers;
+  char name1[50];
   Widget w;
-  int last_altgr_mask;
-  int mode_switch_mask;
-
-  if (appres.debug) fprintf(stderr, "xvkbd: ReadKeymap()\n");
-
-  /* workaround for wrong keys caused after Shift key is pressed in German locale - xvkbd-3.8 */
-  SendKeyPressedEvent(NoSymbol, !shift_state, 0);
-  SendKeyPressedEvent(NoSymbol, shift_state, 0);
-
-  XDisplayKeycodes(target_dpy, &min_keycode, &max_keycode);
-  if (keysym_table != NULL) XFree(keysym_table);
-  keysym_table = XGetKeyboardMapping(target_dpy,
-                             min_keycode, max_keycode - min_keycode + 1,
-                             &keysym_per_keycode);
-  for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
-    /* if the first keysym is alphabet and the second keysym is NoSymbol,
-       it is equivalent to pair of lowercase and uppercase alphabet */
-    inx = (keycode - min_keycode) * keysym_per_keycode;
-    if (keysym_table[inx + 1] == NoSymbol
-	&& ((XK_A <= keysym_table[inx] && keysym_table[inx] <= XK_Z)
-	    || (XK_a <= keysym_table[inx] && keysym_table[inx] <= XK_z))) {
-      if (XK_A <= keysym_table[inx] && keysym_table[inx] <= XK_Z)
-	keysym_table[inx] = keysym_table[inx] - XK_A + XK_a;
-      keysym_table[inx + 1] = keysym_table[inx] - XK_a + XK_A;
-    }
-  }
-
-  last_altgr_mask = altgr_mask;
-  alt_mask = 0;
-  meta_mask = 0;
-  altgr_mask = 0;
-  super_mask = 0;
-  mode_switch_mask = 0;
-  level3_shift_mask = 0;
-  altgr_keysym = NoSymbol;
-  modifiers = XGetModifierMapping(target_dpy);
-
-  if (appres.debug) fprintf(stderr, "xvkbd: ReadKeymap: max_keypermod=%d\n", modifiers->max_keypermod);
-
-  for (i = 0; i < 8; i++) {
-    for (pos = 0; pos < modifiers->max_keypermod; pos++) {
-      keycode = modifiers->modifiermap[i * modifiers->max_keypermod + pos];
-      if (keycode < min_keycode || max_keycode < keycode) continue;
-
-      keysym = keysym_table[(keycode - min_keycode) * keysym_per_keycode];
-      if (alt_mask == 0 && (keysym == XK_Alt_L || keysym == XK_Alt_R)) {
-	alt_mask = 1 << i;
-	if (i != 3) fprintf(stderr, "%s: warning: Alt is assigned to modifier %d instead of %d\n",
-			    PROGRAM_NAME, i - 2, 1);
-      } else if (meta_mask == 0 && (keysym == XK_Meta_L || keysym == XK_Meta_R)) {
-	meta_mask = 1 << i;
-	if (i != 5) fprintf(stderr, "%s: warning: Meta is assigned to modifier %d instead of %d\n",
-			    PROGRAM_NAME, i - 4, 3);
-      } else if (super_mask == 0 && (keysym == XK_Super_L || keysym == XK_Super_R)) {
-	super_mask = 1 << i;
-	if (i != 6) fprintf(stderr, "%s: warning: Super is assigned to modifier %d instead of %d\n",
-			    PROGRAM_NAME, i - 5, 4);
-      } else if (mode_switch_mask == 0 && keysym == XK_Mode_switch) {
-	mode_switch_mask = 1 << i;
-      } else if (level3_shift_mask == 0 && keysym == XK_ISO_Level3_Shift) {
-	level3_shift_mask = 1 << i;
-      }
-    }
-  }
-
-  if (appres.debug)
-    fprintf(stderr, "xvkbd: alt_mask = 0x%x, meta_mask = 0x%x, super_mask = 0x%x, "
-	    "altgr_mask = 0x%x, mode_switch_mask = 0x%x, level3_shift_mask = 0x%x\n",
-	    alt_mask, meta_mask, super_mask, altgr_mask, mode_switch_mask, level3_shift_mask);
-
-  if (level3_shift_mask == mode_switch_mask) {
-    mode_switch_mask = 0x2000;
-    if (appres.debug) {
-      fprintf(stderr, "xvkbd: both ISO_Level3_Shift and Mode_switch found\n");
-      fprintf(stderr, "xvkbd: assuming ISO_Level3_Shift=0x%x, Mode_switch=0x%x\n",
-	      level3_shift_mask, mode_switch_mask);
-    }
-  }
 
-  XFreeModifiermap(modifiers);
+  if (toplevel == NULL) return;
 
-  if (mode_switch_mask != 0) {
-    altgr_keysym = XK_Mode_switch;
-    altgr_mask = mode_switch_mask;
-  } else {
-    fprintf(stderr, "%s: Mode_switch not available as a modifier\n", PROGRAM_NAME);
-    if (level3_shift_mask == 0) {
-      fprintf(stderr, "%s: AltGr can't be used\n", PROGRAM_NAME);
+  snprintf(name1, sizeof(name1), "*%s", name);
+  w = XtNameToWidget(toplevel, name1);
+  if (w != None) {
+    if (strstr(name, "Focus") != NULL) {
+      if (target_dpy == dpy)
+        XtVaSetValues(w, XtNbackground, appres.focus_background, NULL);
+      else
+        XtVaSetValues(w, XtNbackground, appres.remote_focus_background, NULL);
+      if (state)
+        XtVaSetValues(w, XtNforeground, appres.highlight_foreground, NULL);
+      else
+        XtVaSetValues(w, XtNforeground, appres.special_foreground, NULL);
     } else {
-      fprintf(stderr, "%s: although ISO_Level3_Shift is used instead, AltGr may not work correctly\n", PROGRAM_NAME);
-      altgr_keysym = XK_ISO_Level3_Shift;
-      altgr_mask = level3_shift_mask;
+      if (state)
+        XtVaSetValues(w, XtNbackground, appres.highlight_background,
+                      XtNforeground, appres.highlight_foreground, NULL);
+      else
+        XtVaSetValues(w, XtNbackground, appres.special_background,
+                      XtNforeground, appres.special_foreground, NULL);
     }
   }
+}
 
-  w = XtNameToWidget(toplevel, "*Multi_key");
-  if (w != None) {
+/*
+ * Called from ReadKeymap() to make the Multi_key and Mode_switch keys
+ * on the screen insensitive if they can't be used with the keymap.
+ */
+static void RefreshKeymapKeys(int last_altgr_mask)
+{
+  Widget w;
+
+  w = (toplevel != NULL) ? XtNameToWidget(toplevel, "*Multi_key") : NULL;
+  if (w != NULL) {
     if (XKeysymToKeycode(target_dpy, XK_Multi_key) == NoSymbol) {
       if (!appres.auto_add_keysym || AddKeysym(XK_Multi_key, FALSE) == NoSymbol)
 	XtSetSensitive(w, FALSE);
     }
   }
-  w = XtNameToWidget(toplevel, "*Mode_switch");
-  if (w != None) {
+  w = (toplevel != NULL) ? XtNameToWidget(toplevel, "*Mode_switch") : NULL;
+  if (w != NULL) {
     if (appres.xtest && 0 < appres.altgr_keycode) {
       XtSetSensitive(w, TRUE);
       if (appres.debug)
@@ -809,842 +740,143 @@ static void ReadKeymap(void)
       }
     }
   }
-
-  if (appres.auto_add_keysym) {
-    if (!altgr_mask) AddModifier(XK_Mode_switch);
-  }
 }
 
 /*
- * This will called when X error is detected when attempting to
- * send a event to a client window;  this will normally caused
- * when the client window is destroyed.
+ * Highlight/unhighligh keys on the screen to reflect the state.
  */
-static int MyErrorHandler(Display *my_dpy, XErrorEvent *event)
+static Boolean CheckShiftState(int row, int col, int shift)
 {
-  char msg[200];
-
-  error_detected = TRUE;
-  if (event->error_code == BadWindow) {
-    if (appres.debug)
-      fprintf(stderr, "xvkbd: BadWindow - couldn't find target window 0x%lX (destroyed?)\n",
-	      (long)focused_window);
-    return 0;
+  Boolean shifted;
+
+  shifted = (shift & ShiftMask);
+  if (shift & LockMask) {
+    if (shift & altgr_mask) {
+      if (keys_shift_altgr[row][col] == NULL) return FALSE;
+      if (strcasecmp(keys_altgr[row][col], keys_shift_altgr[row][col]) == 0) return !shifted;
+    } else {
+      if (keys_shift[row][col] == NULL) return FALSE;
+      if (strcasecmp(keys_normal[row][col], keys_shift[row][col]) == 0) return !shifted;
+    }
   }
-  XGetErrorText(my_dpy, event->error_code, msg, sizeof(msg) - 1);
-  fprintf(stderr, "xvkbd: X error trapped: %s, request-code=%d\n", msg, event->request_code);
-  if (appres.debug) abort();
-  return 0;
+  return shifted;
 }
 
-/*
- * Send event to the focused window.
- * If input focus is specified explicitly, select the window
- * before send event to the window.
- */
-static void SendEvent(XKeyEvent *event)
+static void RefreshShiftState(Boolean force)
 {
   static Boolean first = TRUE;
+  static int last_shift_state = 0;
+  static int last_mouse_shift = 0;
+  static int last_num_lock_state = FALSE;
+  static Display *last_target_dpy = NULL;
+  static long last_focus = 0;
+  int cur_shift;
+  int changed;
+  int first_row, row, col;
+  Boolean shifted;
+  char *label;
+  int mask;
 
-  if (!appres.no_sync) {
-    XSync(event->display, FALSE);
-    XSetErrorHandler(MyErrorHandler);
-  }
+  cur_shift = shift_state | mouse_shift;
+  changed = cur_shift ^ (last_shift_state | last_mouse_shift);
+  if (first || force) changed = 0xffff;
 
-  error_detected = FALSE;
-  if (focused_window != None) {
-    /* set input focus if input focus is set explicitly */
-    if (appres.debug)
-      fprintf(stderr, "xvkbd: set input focus to window 0x%lX (0x%lX)\n",
-              (long)focused_window, (long)event->window);
-    XSetInputFocus(event->display, focused_window, RevertToParent, CurrentTime);
-    if (!appres.no_sync) XSync(event->display, FALSE);
+  if (changed & ShiftMask) {
+    Highlight("Shift_L", cur_shift & ShiftMask);
+    Highlight("Shift_R", cur_shift & ShiftMask);
   }
-  if (!error_detected) {
-    if (appres.xtest) {
-#ifdef USE_XTEST
-      if (appres.debug)
-	fprintf(stderr, "xvkbd: XTestFakeKeyEvent(0x%lx, %ld, %d)\n",
-		(long)event->display, (long)event->keycode, event->type == KeyPress);
-      if (appres.jump_pointer) {
-	Window root, child, w;
-	int root_x, root_y, x, y;
-	unsigned int mask;
-	int revert_to;
-
-	w = None;
-	if (first || strlen(appres.text) == 0 || appres.jump_pointer_back) {
-	  first = FALSE;
-
-	  w = focused_subwindow;
-	  if (w == None && appres.jump_pointer_always)
-	    XGetInputFocus(event->display, &w, &revert_to);
-
-	  if (w != None) {
-	    if (appres.debug)
-	      fprintf(stderr, "xvkbd: SendEvent: jump pointer to window 0x%lx\n", (long)w);
-
-	    XQueryPointer(event->display, w,
-			  &root, &child, &root_x, &root_y, &x, &y, &mask);
-	    XWarpPointer(event->display, None, w, 0, 0, 0, 0, 1, 1);
-	    XFlush(event->display);
-	  }
-	}
-
-	XTestFakeKeyEvent(event->display, event->keycode, event->type == KeyPress, 0);
-	XFlush(event->display);
-
-	if (w != None && appres.jump_pointer_back) {
-	  XWarpPointer(event->display, None, root, 0, 0, 0, 0, root_x, root_y);
-	  XFlush(event->display);
-	}
-      } else {
-	XTestFakeKeyEvent(event->display, event->keycode, event->type == KeyPress, 0);
- 	XFlush(event->display);
-      }
-#else
-      fprintf(stderr, "%s: this binary is compiled without XTEST support\n",
-	      PROGRAM_NAME);
-#endif
-    } else {
-      XSendEvent(event->display, event->window, TRUE, KeyPressMask, (XEvent *)event);
-      if (!appres.no_sync) XSync(event->display, FALSE);
-
-      if (error_detected
-	  && (focused_subwindow != None) && (focused_subwindow != event->window)) {
-	error_detected = FALSE;
-	event->window = focused_subwindow;
-	if (appres.debug)
-	  fprintf(stderr, "   retry: send event to window 0x%lX (0x%lX)\n",
-		  (long)focused_window, (long)event->window);
-	XSendEvent(event->display, event->window, TRUE, KeyPressMask, (XEvent *)event);
-	if (!appres.no_sync) XSync(event->display, FALSE);
-      }
-    }
+  if (changed & ControlMask) {
+    Highlight("Control_L", cur_shift & ControlMask);
+    Highlight("Control_R", cur_shift & ControlMask);
   }
-
-  if (error_detected) {
-    /* reset focus because focused window is (probably) no longer exist */
-    XBell(dpy, 0);
-    focused_window = None;
-    focused_subwindow = None;
+  if (changed & alt_mask) {
+    Highlight("Alt_L", cur_shift & alt_mask);
+    Highlight("Alt_R", cur_shift & alt_mask);
   }
-
-  XSetErrorHandler(NULL);
-}
-
-/*
- * Insert a specified keysym to unused position in the keymap table.
- * This will be called to add required keysyms on-the-fly.
- * if the second parameter is TRUE, the keysym will be added to the
- * non-shifted position - this may be required for modifier keys
- * (e.g. Mode_switch) and some special keys (e.g. F20).
- */
-static int AddKeysym(KeySym keysym, Boolean top)
-{
-  int keycode, pos, max_pos, inx, phase;
-
-  if (appres.debug) fprintf(stderr, "xvkbd: AddKeySym(%lx)\n", (long)keysym);
-
-  if (top) {
-    max_pos = 0;
-  } else {
-    max_pos = keysym_per_keycode - 1;
-    if (4 <= max_pos) max_pos = 3;
+  if (changed & meta_mask) {
+    Highlight("Meta_L", cur_shift & meta_mask);
+    Highlight("Meta_R", cur_shift & meta_mask);
   }
-
-  for (phase = 0; phase < 2; phase++) {
-    for (keycode = max_keycode; min_keycode <= keycode; keycode--) {
-      for (pos = max_pos; 0 <= pos; pos--) {
-	inx = (keycode - min_keycode) * keysym_per_keycode;
-	if ((phase != 0 || keysym_table[inx] == NoSymbol)
-	    && (keysym_table[inx] < 0xFF00
-		|| (0x10000 <= keysym_table[inx] && keysym_table[inx] < 0x1008f000))) {
-	  /* In the first phase, to avoid modifing existing keys, */
-	  /* add the keysym only to the keys which has no keysym in the first position. */
-	  /* If no place found in the first phase, add the keysym for any keys except */
-	  /* for modifier keys and other special keys */
-	  if (keysym_table[inx + pos] == NoSymbol) {
-	    if (appres.debug)
-	      fprintf(stderr, "xvkbd: Adding keysym \"%s\" at keycode %d position %d/%d\n",
-		      XKeysymToString(keysym), keycode, pos, keysym_per_keycode);
-	    keysym_table[inx + pos] = keysym;
-	    XChangeKeyboardMapping(target_dpy, keycode, keysym_per_keycode, &keysym_table[inx], 1);
-	    XFlush(target_dpy);
-	    return keycode;
-	  }
-	}
-      }
-    }
+  if (changed & super_mask) {
+    Highlight("Super_L", cur_shift & super_mask);
+    Highlight("Super_R", cur_shift & super_mask);
   }
-  fprintf(stderr, "%s: couldn't add \"%s\" to keymap\n",
-	  PROGRAM_NAME, XKeysymToString(keysym));
-  XBell(dpy, 0);
-  return NoSymbol;
-}
-
-/*
- * Add the specified key as a new modifier.
- * This is used to use Mode_switch (AltGr) as a modifier.
- */
-static void AddModifier(KeySym keysym)
-{
-  XModifierKeymap *modifiers;
-  int keycode, i, pos;
-
-  keycode = XKeysymToKeycode(target_dpy, keysym);
-  if (keycode == NoSymbol) keycode = AddKeysym(keysym, TRUE);
-
-  modifiers = XGetModifierMapping(target_dpy);
-  for (i = 7; 3 < i; i--) {
-    if (modifiers->modifiermap[i * modifiers->max_keypermod] == NoSymbol
-	|| ((keysym_table[(modifiers->modifiermap[i * modifiers->max_keypermod]
-			   - min_keycode) * keysym_per_keycode]) == XK_ISO_Level3_Shift
-	    && keysym == XK_Mode_switch)) {
-      for (pos = 0; pos < modifiers->max_keypermod; pos++) {
-	if (modifiers->modifiermap[i * modifiers->max_keypermod + pos] == NoSymbol) {
-	  if (appres.debug)
-	    fprintf(stderr, "xvkbd: Adding modifier \"%s\" as %dth modifier\n",
-		    XKeysymToString(keysym), i);
-	  modifiers->modifiermap[i * modifiers->max_keypermod + pos] = keycode;
-	  XSetModifierMapping(target_dpy, modifiers);
-	  return;
-	}
-      }
-    }
+  if (changed & LockMask) {
+    Highlight("Caps_Lock", cur_shift & LockMask);
   }
-  fprintf(stderr, "%s: couldn't add \"%s\" as modifier\n",
-	  PROGRAM_NAME, XKeysymToString(keysym));
-  XBell(dpy, 0);
-}
-
-/*
- * Send sequence of KeyPressed/KeyReleased events to the focused
- * window to simulate keyboard.  If modifiers (shift, control, etc)
- * are set ON, many events will be sent.
- */
-#define SENDKEY_KEY_PRESS    1
-#define SENDKEY_KEY_RELEASE  2
-
-static void SendKeyPressedEvent(KeySym keysym, unsigned int shift, int press_release)
-{
-  Window cur_focus;
-  int revert_to;
-  XKeyEvent event;
-  int keycode;
-  Window root, *children;
-  unsigned int n_children;
-  int phase, inx;
-  Boolean found;
-  Boolean last_caps_lock = FALSE;
-
-  if (need_read_keymap) {
-    need_read_keymap = FALSE;
-    ReadKeymap();
+  if (changed & altgr_mask) {
+    Highlight("Mode_switch", cur_shift & altgr_mask);
   }
-
-  if (focused_subwindow != None)
-    cur_focus = focused_subwindow;
-  else
-    XGetInputFocus(target_dpy, &cur_focus, &revert_to);
-
-  if (appres.debug) {
-    char ch = '?';
-    if ((keysym & ~0x7f) == 0 && isprint(keysym)) ch = keysym;
-    fprintf(stderr, "xvkbd: SendKeyPressedEvent: focus=0x%lX, key=0x%lX (%c), shift=0x%lX\n",
-            (long)cur_focus, (long)keysym, ch, (long)shift);
+  if (last_num_lock_state != appres.num_lock_state) {
+    Highlight("Num_Lock", appres.num_lock_state);
+    Highlight("keypad_panel*Num_Lock", appres.num_lock_state);
   }
-
-  if (XtWindow(toplevel) != None) {
-    if (toplevel_parent == None) {
-      XQueryTree(target_dpy, RootWindow(target_dpy, DefaultScreen(target_dpy)),
-                 &root, &toplevel_parent, &children, &n_children);
-      XFree(children);
-    }
-    if (cur_focus == None || cur_focus == PointerRoot
-	|| cur_focus == XtWindow(toplevel) || cur_focus == toplevel_parent) {
-      /* notice user when no window focused or the xvkbd window is focused */
-      XBell(dpy, 0);
-      return;
-    }
+  if (last_target_dpy != target_dpy || last_focus != focused_window) {
+    Highlight("Focus", focused_window != 0);
+    Highlight("keypad*Focus", focused_window != 0);
+    Highlight("keypad_panel*Focus", focused_window != 0);
+    last_target_dpy = target_dpy;
+    last_focus = focused_window;
   }
 
-  found = FALSE;
-  keycode = 0;
-  if (keysym != NoSymbol) {
-    for (phase = 0; phase < 2; phase++) {
-      for (keycode = min_keycode; !found && (keycode <= max_keycode); keycode++) {
-	/* Determine keycode for the keysym:  we use this instead
-	   of XKeysymToKeycode() because we must know shift_state, too */
-	/* 1: Shift, 2: AltGr, 3: Shift+AltGr, 4: Level3, 5: Shift+Level3 */
-	inx = (keycode - min_keycode) * keysym_per_keycode;
-	if (keysym_table[inx] == keysym) {
-	  shift &= ~altgr_mask;
-	  if (keysym_table[inx + 1] != NoSymbol) shift &= ~ShiftMask;
-	  found = TRUE;
-	  break;
-	} else if (keysym_table[inx + 1] == keysym) {
-	  shift &= ~altgr_mask;
-	  shift |= ShiftMask;
-	  found = TRUE;
-	  break;
-	}
-      }
-      if (!found && altgr_mask && 3 <= keysym_per_keycode) {
-	for (keycode = min_keycode; !found && (keycode <= max_keycode); keycode++) {
-	  inx = (keycode - min_keycode) * keysym_per_keycode;
-	  if (keysym_table[inx + 2] == keysym) {
-	    shift &= ~ShiftMask;
-	    shift |= altgr_mask;
-	    found = TRUE;
-	    break;
-	  } else if (4 <= keysym_per_keycode && keysym_table[inx + 3] == keysym) {
-	    shift |= ShiftMask | altgr_mask;
-	    found = TRUE;
-	    break;
-	  } else if (5 <= keysym_per_keycode && keysym_table[inx + 4] == keysym) {
-	    shift &= ~(ShiftMask | altgr_mask);
-	    shift |= level3_shift_mask;
-	    found = TRUE;
-	    break;
-	  } else if (6 <= keysym_per_keycode && keysym_table[inx + 5] == keysym) {
-	    shift &= ~altgr_mask;
-	    shift |= ShiftMask | level3_shift_mask;
-	    found = TRUE;
-	    break;
+  mask = ShiftMask | LockMask | altgr_mask;
+  changed = (shift_state & mask) ^ (last_shift_state & mask);
+  if (first || force) changed = TRUE;
+  if (changed && !appres.keypad_only
+      && (appres.modal_keytop || toplevel_height < appres.modal_threshold)) {
+    first_row = appres.function_key ? 0 : 1;
+    for (row = first_row; row < NUM_KEY_ROWS; row++) {
+      for (col = 0; col < NUM_KEY_COLS; col++) {
+	shifted = CheckShiftState(row, col, cur_shift);
+	if (key_widgets[row][col] != None) {
+	  if ((shift_state & altgr_mask) && altgr_key_labels[row][col] != NULL) {
+	    if (shifted && shift_altgr_key_labels[row][col] != NULL)
+	      label = shift_altgr_key_labels[row][col];
+	    else
+	      label = altgr_key_labels[row][col];
+	  } else {
+	    if (shifted && shift_key_labels[row][col] != NULL)
+	      label = shift_key_labels[row][col];
+	    else
+	      label = normal_key_labels[row][col];
+	  }
+	  if (label == NULL) {
+	    fprintf(stderr, "%s: no label for key %d,%d\n", PROGRAM_NAME, row, col);
+	    label = "";
 	  }
+	  if (strcmp(label, "space") == 0) label = "";
+	  XtVaSetValues(key_widgets[row][col], XtNlabel, label, NULL);
 	}
       }
-      if (found || !appres.auto_add_keysym) break;
-
-      if (0xF000 <= keysym) {
-	/* for special keys such as function keys,
-	   first try to add it in the non-shifted position of the keymap */
-	if (AddKeysym(keysym, TRUE) == NoSymbol) AddKeysym(keysym, FALSE);
-      } else {
-	AddKeysym(keysym, FALSE);
-      }
-    }
-    if (appres.debug) {
-      if (found) {
-	fprintf(stderr, "xvkbd: SendKeyPressedEvent: keysym=0x%lx, keycode=%ld, shift=0x%lX\n",
-		(long)keysym, (long)keycode, (long)shift);
-	fprintf(stderr, "keysym table: keycode %d = ", keycode);
-      	for (inx = (keycode - min_keycode) * keysym_per_keycode;
-	     inx < (keycode - min_keycode + 1) * keysym_per_keycode;
-	     inx++)
-	  fprintf(stderr, " 0x%lx (%s)",
-		  (long)keysym_table[inx], keysym_table[inx] ? XKeysymToString(keysym_table[inx]) : "null");
-	fprintf(stderr, "\n");
-      } else
-	fprintf(stderr, "SendKeyPressedEvent: keysym=0x%lx - keycode not found\n",
-		(long)keysym);
     }
   }
 
-  event.display = target_dpy;
-  event.window = cur_focus;
-  event.root = RootWindow(event.display, DefaultScreen(event.display));
-  event.subwindow = None;
-  event.time = CurrentTime;
-  event.x = 1;
-  event.y = 1;
-  event.x_root = 1;
-  event.y_root = 1;
-  event.same_screen = TRUE;
+  last_shift_state = shift_state;
+  last_mouse_shift = mouse_shift;
+  last_num_lock_state = appres.num_lock_state;
+  first = FALSE;
 
 #ifdef USE_XTEST
-  if (appres.xtest && press_release == 0) {
+  if (appres.xtest && strlen(appres.positive_modifiers) != 0) {
+    /* modifiers specified in positiveModifiers resouce will be hold down
+       so that it can be used with, for example, mouse operations */
+
     Window root, child;
     int root_x, root_y, x, y;
     unsigned int mask;
 
-    XQueryPointer(target_dpy, event.root, &root, &child, &root_x, &root_y, &x, &y, &mask);
+    XKeyEvent event;
 
-    event.type = KeyRelease;
-    event.state = 0;
-    if (mask & ControlMask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Control_L);
-      SendEvent(&event);
-    }
-    if (mask & alt_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Alt_L);
-      SendEvent(&event);
-    }
-    if (mask & meta_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Meta_L);
-      SendEvent(&event);
-    }
-    if (mask & super_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Super_L);
-      SendEvent(&event);
-    }
-    if (mask & altgr_mask) {
-      if (0 < appres.altgr_keycode)
-	event.keycode = appres.altgr_keycode;
-      else
-	event.keycode = XKeysymToKeycode(target_dpy, altgr_keysym);
-      SendEvent(&event);
-    }
-    if (mask & level3_shift_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_ISO_Level3_Shift);
-      SendEvent(&event);
-    }
-    if (mask & ShiftMask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Shift_L);
-      SendEvent(&event);
-    }
-    if (mask & LockMask) {
-      last_caps_lock = TRUE;
-      event.type = KeyPress;
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Caps_Lock);
-      SendEvent(&event);
-      event.type = KeyRelease;
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Caps_Lock);
-      SendEvent(&event);
-    }
-  }
-#endif
-
-  event.type = KeyPress;
-  event.state = 0;
-  if (shift & ControlMask) {
-    if (appres.debug) fprintf(stderr, "[Control] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Control_L);
-    SendEvent(&event);
-    event.state |= ControlMask;
-  }
-  if (shift & alt_mask) {
-    if (appres.debug) fprintf(stderr, "[Alt] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Alt_L);
-    SendEvent(&event);
-    event.state |= alt_mask;
-  }
-  if (shift & meta_mask) {
-    if (appres.debug) fprintf(stderr, "[Meta] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Meta_L);
-    SendEvent(&event);
-    event.state |= meta_mask;
-  }
-  if (shift & super_mask) {
-    if (appres.debug) fprintf(stderr, "[Super] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Super_L);
-    SendEvent(&event);
-    event.state |= super_mask;
-  }
-  if (shift & altgr_mask) {
-    if (appres.debug) fprintf(stderr, "[AltGr] ");
-    if (0 < appres.altgr_keycode)
-      event.keycode = appres.altgr_keycode;
-    else
-      event.keycode = XKeysymToKeycode(target_dpy, altgr_keysym);
-    SendEvent(&event);
-    event.state |= altgr_mask;
-  }
-  if (shift & level3_shift_mask) {
-    if (appres.debug) fprintf(stderr, "[Level3] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_ISO_Level3_Shift);
-    SendEvent(&event);
-    event.state |= level3_shift_mask;
-  }
-  if (shift & ShiftMask) {
-    if (appres.debug) fprintf(stderr, "[Shift] ");
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Shift_L);
-    SendEvent(&event);
-    event.state |= ShiftMask;
-  }
-
-  if (keysym != NoSymbol) {  /* send event for the key itself */
-    event.keycode = found ? keycode : XKeysymToKeycode(target_dpy, keysym);
-
-
-    if (event.keycode == NoSymbol) {
-      if ((keysym & ~0x7f) == 0 && isprint(keysym))
-        fprintf(stderr, "%s: no such key: %c\n",
-                PROGRAM_NAME, (char)keysym);
-      else if (XKeysymToString(keysym) != NULL)
-        fprintf(stderr, "%s: no such key: keysym=%s (0x%lX)\n",
-                PROGRAM_NAME, XKeysymToString(keysym), (long)keysym);
-      else
-        fprintf(stderr, "%s: no such key: keysym=0x%lX\n",
-                PROGRAM_NAME, (long)keysym);
-      XBell(dpy, 0);
-    } else if (press_release == 0) {
-      SendEvent(&event);
-      event.type = KeyRelease;
-      SendEvent(&event);
-    } else {
-      if (press_release & SENDKEY_KEY_PRESS) SendEvent(&event);
-      event.type = KeyRelease;
-      if (press_release & SENDKEY_KEY_RELEASE) SendEvent(&event);
-    }
-  }
-
-  if (last_caps_lock) {
-    /* restore last Caps_Lock state */
-    event.type = KeyPress;
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Caps_Lock);
-    SendEvent(&event);
-    event.type = KeyRelease;
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Caps_Lock);
-    SendEvent(&event);
-  }
-  event.type = KeyRelease;
-  if (shift & ShiftMask) {
-    event.keycode = XKeysymToKeycode(target_dpy, XK_Shift_L);
-    SendEvent(&event);
-    event.state &= ~ShiftMask;
-  }
-  if (press_release == 0) {
-    if (shift & altgr_mask) {
-      if (0 < appres.altgr_keycode)
-	event.keycode = appres.altgr_keycode;
-      else
-	event.keycode = XKeysymToKeycode(target_dpy, altgr_keysym);
-      SendEvent(&event);
-      event.state &= ~altgr_mask;
-    }
-    if (shift & level3_shift_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_ISO_Level3_Shift);
-      SendEvent(&event);
-      event.state &= ~level3_shift_mask;
-    }
-    if (shift & meta_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Meta_L);
-      SendEvent(&event);
-      event.state &= ~meta_mask;
-    }
-    if (shift & super_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Super_L);
-      SendEvent(&event);
-      event.state &= ~super_mask;
-    }
-    if (shift & alt_mask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Alt_L);
-      SendEvent(&event);
-      event.state &= ~alt_mask;
-    }
-    if (shift & ControlMask) {
-      event.keycode = XKeysymToKeycode(target_dpy, XK_Control_L);
-      SendEvent(&event);
-      event.state &= ~ControlMask;
-    }
-  }
-
-  if (appres.no_sync) XFlush(dpy);
-}
-
-static Boolean need_insert_blank = FALSE;
-
-
-
-
-/*
- * Send given string to the focused window as if the string
- * is typed from a keyboard.
- */
-static void KeyPressed(Widget w, char *key, char *data);
-
-static void SendString(const char *str)
-{
-  const char *cp, *cp2;
-  char key[50];
-  int len;
-  int val;
-  Window target_root, child, junk_w;
-  int junk_i;
-  unsigned junk_u;
-  int cur_x, cur_y;
-
-  if (appres.debug) fprintf(stderr, "xvkbd: SendString(%s)\n", str);
-
-  if (need_read_keymap) {
-    need_read_keymap = FALSE;
-    ReadKeymap();
-  }
-
-  shift_state = 0;
-  for (cp = str; *cp != '\0'; cp++) {
-    if (0 < appres.text_delay) usleep(appres.text_delay * 1000);
-    if (*cp == '\\') {
-      cp++;
-      switch (*cp) {
-      case '\0':
-        fprintf(stderr, "%s: missing character after \"\\\"\n",
-                PROGRAM_NAME);
-        return;
-      case '[':  /* we can write any keysym as "\[keysym]" here */
-        cp2 = strchr(cp, ']');
-        
-        if (cp2 == NULL) {
-          fprintf(stderr, "%s: no closing \"]\" after \"\\[\"\n",
-                  PROGRAM_NAME);
-        } else {
-          len = cp2 - cp - 1;
-          if (sizeof(key) <= len) len = sizeof(key) - 1;
-          strncpy(key, cp + 1, len);
-          key[len] = '\0';
-          KeyPressed(None, key, NULL);
-          cp = cp2;
-        }
-        
-        //cp=cp2;
-        break;
-      case '{':		/*  "\{keysym}" will send the keysym more directly, and
-						"\{+keysym}" and "\{-keysym}" will press the release the key */
-        cp2 = strchr(cp, '}');
-        if (cp2 == NULL) {
-          fprintf(stderr, "%s: no closing \"}\" after \"\\{\"\n",
-                  PROGRAM_NAME);
-        } else {
-	  int press_release = SENDKEY_KEY_PRESS | SENDKEY_KEY_RELEASE;
-	  KeySym keysym;
-	  if (*(cp + 1) == '+') {
-	    press_release = SENDKEY_KEY_PRESS;
-	    cp++;
-	  } else if (*(cp + 1) == '-') {
-	    press_release = SENDKEY_KEY_RELEASE;
-	    cp++;
-	  }
-          len = cp2 - cp - 1;
-          if (sizeof(key) <= len) len = sizeof(key) - 1;
-          strncpy(key, cp + 1, len);
-          key[len] = '\0';
-	  keysym = XStringToKeysym(key);
-	  if (keysym == NoSymbol) fprintf(stderr, "%s: no such keysym: %s\n",
-					  PROGRAM_NAME, key);
-	  SendKeyPressedEvent(keysym, 0, press_release);
-          cp = cp2;
-        }
-	break;
-      case 'S': shift_state |= ShiftMask; break;
-      case 'C': shift_state |= ControlMask; break;
-      case 'A': shift_state |= alt_mask; break;
-      case 'M': shift_state |= meta_mask; break;
-      case 'W': shift_state |= super_mask; break;
-      case 'b': SendKeyPressedEvent(XK_BackSpace, shift_state, 0); shift_state = 0; break;
-      case 't': SendKeyPressedEvent(XK_Tab, shift_state, 0); shift_state = 0; break;
-      case 'n': SendKeyPressedEvent(XK_Linefeed, shift_state, 0); shift_state = 0; break;
-      case 'r': SendKeyPressedEvent(XK_Return, shift_state, 0); shift_state = 0; break;
-      case 'e': SendKeyPressedEvent(XK_Escape, shift_state, 0); shift_state = 0; break;
-      case 'd': SendKeyPressedEvent(XK_Delete, shift_state, 0); shift_state = 0; break;
-      case 'D':  /* delay */
-	cp++;
-	if ('1' <= *cp && *cp <= '9') {
-	  usleep((*cp - '0') * 100000);
-	} else {
-          fprintf(stderr, "%s: no digit after \"\\m\"\n",
-                  PROGRAM_NAME);
-	}
-	break;
-      case 'm':  /* simulate click mouse button */
-	cp++;
-	if ('1' <= *cp && *cp <= '9') {
-	  if (appres.debug) fprintf(stderr, "xvkbd: XTestFakeButtonEvent(%d)\n", *cp - '0');
-	  XTestFakeButtonEvent(target_dpy, *cp - '0', True, CurrentTime);
-	  XTestFakeButtonEvent(target_dpy, *cp - '0', False, CurrentTime);
-	  XFlush(dpy);
-	} else {
-          fprintf(stderr, "%s: no digit after \"\\m\"\n",
-                  PROGRAM_NAME);
-	}
-	break;
-      case 'x':
-      case 'y':  /* move mouse pointer */
-	sscanf(cp + 1, "%d", &val);
-	target_root = RootWindow(target_dpy, DefaultScreen(target_dpy));
-	XQueryPointer(target_dpy, target_root, &junk_w, &child,
-		      &cur_x, &cur_y, &junk_i, &junk_i, &junk_u);
-	if (*cp == 'x') {
-	  if (isdigit(*(cp + 1))) cur_x = val;
-	  else cur_x += val;
-	} else {
-	  if (isdigit(*(cp + 1))) cur_y = val;
-	  else cur_y += val;
-	}
-	XWarpPointer(target_dpy, None, target_root, 0, 0, 0, 0, cur_x, cur_y);
-	XFlush(dpy);
-	cp++;
-	while (isdigit(*(cp + 1)) || *(cp + 1) == '+' || *(cp + 1) == '-') cp++;
-        break;
-      default:
-	SendKeyPressedEvent(*cp, shift_state, 0);
-	shift_state = 0;
-	break;
-      }
-    } else {
-      SendKeyPressedEvent(*cp, shift_state, 0);
-      shift_state = 0;
-    }
-  }
-}
-
-/*
- * Highlight/unhighligh spcified modifier key on the screen.
- */
-static void Highlight(char *name, int state)
-{
-  char name1[50];
-  Widget w;
-
-  snprintf(name1, sizeof(name1), "*%s", name);
-  w = XtNameToWidget(toplevel, name1);
-  if (w != None) {
-    if (strstr(name, "Focus") != NULL) {
-      if (target_dpy == dpy)
-        XtVaSetValues(w, XtNbackground, appres.focus_background, NULL);
-      else
-        XtVaSetValues(w, XtNbackground, appres.remote_focus_background, NULL);
-      if (state)
-        XtVaSetValues(w, XtNforeground, appres.highlight_foreground, NULL);
-      else
-        XtVaSetValues(w, XtNforeground, appres.special_foreground, NULL);
-    } else {
-      if (state)
-        XtVaSetValues(w, XtNbackground, appres.highlight_background,
-                      XtNforeground, appres.highlight_foreground, NULL);
-      else
-        XtVaSetValues(w, XtNbackground, appres.special_background,
-                      XtNforeground, appres.special_foreground, NULL);
-    }
-  }
-}
-
-/*
- * Highlight/unhighligh keys on the screen to reflect the state.
- */
-static Boolean CheckShiftState(int row, int col, int shift)
-{
-  Boolean shifted;
-
-  shifted = (shift & ShiftMask);
-  if (shift & LockMask) {
-    if (shift & altgr_mask) {
-      if (keys_shift_altgr[row][col] == NULL) return FALSE;
-      if (strcasecmp(keys_altgr[row][col], keys_shift_altgr[row][col]) == 0) return !shifted;
-    } else {
-      if (keys_shift[row][col] == NULL) return FALSE;
-      if (strcasecmp(keys_normal[row][col], keys_shift[row][col]) == 0) return !shifted;
-    }
-  }
-  return shifted;
-}
-
-static void RefreshShiftState(Boolean force)
-{
-  static Boolean first = TRUE;
-  static int last_shift_state = 0;
-  static int last_mouse_shift = 0;
-  static int last_num_lock_state = FALSE;
-  static Display *last_target_dpy = NULL;
-  static long last_focus = 0;
-  int cur_shift;
-  int changed;
-  int first_row, row, col;
-  Boolean shifted;
-  char *label;
-  int mask;
-
-  cur_shift = shift_state | mouse_shift;
-  changed = cur_shift ^ (last_shift_state | last_mouse_shift);
-  if (first || force) changed = 0xffff;
-
-  if (changed & ShiftMask) {
-    Highlight("Shift_L", cur_shift & ShiftMask);
-    Highlight("Shift_R", cur_shift & ShiftMask);
-  }
-  if (changed & ControlMask) {
-    Highlight("Control_L", cur_shift & ControlMask);
-    Highlight("Control_R", cur_shift & ControlMask);
-  }
-  if (changed & alt_mask) {
-    Highlight("Alt_L", cur_shift & alt_mask);
-    Highlight("Alt_R", cur_shift & alt_mask);
-  }
-  if (changed & meta_mask) {
-    Highlight("Meta_L", cur_shift & meta_mask);
-    Highlight("Meta_R", cur_shift & meta_mask);
-  }
-  if (changed & super_mask) {
-    Highlight("Super_L", cur_shift & super_mask);
-    Highlight("Super_R", cur_shift & super_mask);
-  }
-  if (changed & LockMask) {
-    Highlight("Caps_Lock", cur_shift & LockMask);
-  }
-  if (changed & altgr_mask) {
-    Highlight("Mode_switch", cur_shift & altgr_mask);
-  }
-  if (last_num_lock_state != appres.num_lock_state) {
-    Highlight("Num_Lock", appres.num_lock_state);
-    Highlight("keypad_panel*Num_Lock", appres.num_lock_state);
-  }
-  if (last_target_dpy != target_dpy || last_focus != focused_window) {
-    Highlight("Focus", focused_window != 0);
-    Highlight("keypad*Focus", focused_window != 0);
-    Highlight("keypad_panel*Focus", focused_window != 0);
-    last_target_dpy = target_dpy;
-    last_focus = focused_window;
-  }
-
-  mask = ShiftMask | LockMask | altgr_mask;
-  changed = (shift_state & mask) ^ (last_shift_state & mask);
-  if (first || force) changed = TRUE;
-  if (changed && !appres.keypad_only
-      && (appres.modal_keytop || toplevel_height < appres.modal_threshold)) {
-    first_row = appres.function_key ? 0 : 1;
-    for (row = first_row; row < NUM_KEY_ROWS; row++) {
-      for (col = 0; col < NUM_KEY_COLS; col++) {
-	shifted = CheckShiftState(row, col, cur_shift);
-	if (key_widgets[row][col] != None) {
-	  if ((shift_state & altgr_mask) && altgr_key_labels[row][col] != NULL) {
-	    if (shifted && shift_altgr_key_labels[row][col] != NULL)
-	      label = shift_altgr_key_labels[row][col];
-	    else
-	      label = altgr_key_labels[row][col];
-	  } else {
-	    if (shifted && shift_key_labels[row][col] != NULL)
-	      label = shift_key_labels[row][col];
-	    else
-	      label = normal_key_labels[row][col];
-	  }
-	  if (label == NULL) {
-	    fprintf(stderr, "%s: no label for key %d,%d\n", PROGRAM_NAME, row, col);
-	    label = "";
-	  }
-	  if (strcmp(label, "space") == 0) label = "";
-	  XtVaSetValues(key_widgets[row][col], XtNlabel, label, NULL);
-	}
-      }
-    }
-  }
-
-  last_shift_state = shift_state;
-  last_mouse_shift = mouse_shift;
-  last_num_lock_state = appres.num_lock_state;
-  first = FALSE;
-
-#ifdef USE_XTEST
-  if (appres.xtest && strlen(appres.positive_modifiers) != 0) {
-    /* modifiers specified in positiveModifiers resouce will be hold down
-       so that it can be used with, for example, mouse operations */
-
-    Window root, child;
-    int root_x, root_y, x, y;
-    unsigned int mask;
-
-    XKeyEvent event;
-
-    event.display = target_dpy;
-    event.window = RootWindow(event.display, DefaultScreen(event.display));
-    event.root = event.window;
-    event.subwindow = None;
-    event.time = CurrentTime;
-    event.x = 1;
-    event.y = 1;
-    event.x_root = 1;
-    event.y_root = 1;
-    event.same_screen = TRUE;
+    event.display = target_dpy;
+    event.window = RootWindow(event.display, DefaultScreen(event.display));
+    event.root = event.window;
+    event.subwindow = None;
+    event.time = CurrentTime;
+    event.x = 1;
+    event.y = 1;
+    event.x_root = 1;
+    event.y_root = 1;
+    event.same_screen = TRUE;
     event.state = 0;
 
     XQueryPointer(target_dpy, event.root, &root, &child, &root_x, &root_y, &x, &y, &mask);
@@ -1711,7 +943,6 @@ static void KeyPressed(Widget w, char *key, char *data)
   int row, col;
   int cur_shift;
   char *key1 = NULL;
-  KeySym keysym;
   Boolean shifted;
   const char *value;
   Boolean found;
@@ -1738,28 +969,7 @@ static void KeyPressed(Widget w, char *key, char *data)
     return;
   }
 
-  if (strncmp(key, "Shift", strlen("Shift")) == 0) {
-    if (shift_state & ShiftMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= ShiftMask;
-  } else if (strncmp(key, "Control", strlen("Control")) == 0) {
-    if (shift_state & ControlMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= ControlMask;
-  } else if (alt_mask != 0 && strncmp(key, "Alt", strlen("Alt")) == 0) {
-    if (shift_state & alt_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= alt_mask;
-  } else if (meta_mask != 0 && strncmp(key, "Meta", strlen("Meta")) == 0) {
-    if (shift_state & meta_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= meta_mask;
-  } else if (super_mask != 0 && strncmp(key, "Super", strlen("Super")) == 0) {
-    if (shift_state & super_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= super_mask;
-  } else if (strcmp(key, "Mode_switch") == 0) {
-    if (shift_state & altgr_mask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= altgr_mask;
-  } else if (strcmp(key, "Caps_Lock") == 0) {
-    if (shift_state & LockMask) SendKeyPressedEvent(NoSymbol, shift_state, 0);
-    shift_state ^= LockMask;
-  } else if (strcmp(key, "Num_Lock") == 0) {
+  if (strcmp(key, "Num_Lock") == 0) {
     appres.num_lock_state = !appres.num_lock_state;
   } else if (strcmp(key, "Focus") == 0) {
     cur_shift = shift_state | mouse_shift;
@@ -1841,86 +1051,19 @@ static void KeyPressed(Widget w, char *key, char *data)
 
     if (appres.debug) fprintf(stderr, "xvkbd: KeyPressed: key=%s, key1=%s\n", key, key1);
 
-    if (strlen(key1) == 1) {
-      if (need_insert_blank && !ispunct(*key1) && !isspace(*key1)) SendKeyPressedEvent(' ', 0, 0);
-      SendKeyPressedEvent((KeySym)*key1 & 0xff, cur_shift, 0);
-      // AddToCompletionText((KeySym)*key1); HEEJ
-    } else {
-      while (islower(key1[0]) && key1[1] == ':') {
-	switch (key1[0]) {
-	case 's': cur_shift |= ShiftMask; break;
-	case 'c': cur_shift |= ControlMask; break;
-	case 'a': cur_shift |= alt_mask; break;
-	case 'm': cur_shift |= meta_mask; break;
-	case 'w': cur_shift |= super_mask; break;
-	default: fprintf(stderr, "%s: unknown modidier: %s\n",
-			 PROGRAM_NAME, key1); break;
-	}
-	key1 = key1 + 2;
-      }
-      if (key1[0] == '0' && key1[1] == 'x') {
-	long val;
-	sscanf(key1, "%lx", &val);
-	keysym = val;
-      } else {
-	keysym = XStringToKeysym(key1);
-      }
-      if (keysym == NoSymbol) fprintf(stderr, "%s: no such keysym: %s\n",
-				      PROGRAM_NAME, key);
-      if ((!appres.keypad_keysym && strncmp(key1, "KP_", 3) == 0)
-	  || XKeysymToKeycode(target_dpy, keysym) == NoSymbol) {
-	switch ((unsigned)keysym) {
-	case XK_KP_Equal: keysym = XK_equal; break;
-	case XK_KP_Divide: keysym = XK_slash; break;
-	case XK_KP_Multiply: keysym = XK_asterisk; break;
-	case XK_KP_Add: keysym = XK_plus; break;
-	case XK_KP_Subtract: keysym = XK_minus; break;
-	case XK_KP_Enter: keysym = XK_Return; break;
-	case XK_KP_0: keysym = XK_0; break;
-	case XK_KP_1: keysym = XK_1; break;
-	case XK_KP_2: keysym = XK_2; break;
-	case XK_KP_3: keysym = XK_3; break;
-	case XK_KP_4: keysym = XK_4; break;
-	case XK_KP_5: keysym = XK_5; break;
-	case XK_KP_6: keysym = XK_6; break;
-	case XK_KP_7: keysym = XK_7; break;
-	case XK_KP_8: keysym = XK_8; break;
-	case XK_KP_9: keysym = XK_9; break;
-	case XK_Shift_L: keysym = XK_Shift_R; break;
-	case XK_Shift_R: keysym = XK_Shift_L; break;
-	case XK_Control_L: keysym = XK_Control_R; break;
-	case XK_Control_R: keysym = XK_Control_L; break;
-	case XK_Alt_L: keysym = XK_Alt_R; break;
-	case XK_Alt_R: keysym = XK_Alt_L; break;
-	case XK_Meta_L: keysym = XK_Meta_R; break;
-	case XK_Meta_R: keysym = XK_Meta_L; break;
-	case XK_Super_L: keysym = XK_Super_R; break;
-	case XK_Super_R: keysym = XK_Super_L; break;
-	default:
-	  if (keysym == NoSymbol || !appres.auto_add_keysym)
-	    fprintf(stderr, "%s: no such key: %s\n",
-		    PROGRAM_NAME, key1); break;
-	}
-      }
-      SendKeyPressedEvent(keysym, cur_shift, 0);
-      //AddToCompletionText(keysym);
-
-      if ((cur_shift & ControlMask) && (cur_shift & alt_mask)) {
-        if (strstr(XServerVendor(dpy), "XFree86") != NULL) {
-          if (strcmp(key1, "KP_Add") == 0) {
-            if (!appres.secure) system("xvidtune -next");
-          } else if (strcmp(key1, "KP_Subtract") == 0) {
-            if (!appres.secure) system("xvidtune -prev");
-          }
+    if (need_insert_blank && strlen(key1) == 1 && !ispunct(*key1) && !isspace(*key1))
+      SendKeyPressedEvent(' ', 0, 0);
+    PressKey(key1, cur_shift);
+
+    if ((cur_shift & ControlMask) && (cur_shift & alt_mask)) {
+      if (strstr(XServerVendor(dpy), "XFree86") != NULL) {
+        if (strcmp(key1, "KP_Add") == 0) {
+          if (!appres.secure) system("xvidtune -next");
+        } else if (strcmp(key1, "KP_Subtract") == 0) {
+          if (!appres.secure) system("xvidtune -prev");
         }
       }
     }
-    if (!appres.shift_lock)
-      shift_state &= ~ShiftMask;
-    if (!appres.modifiers_lock)
-      shift_state &= ~(ControlMask | alt_mask | meta_mask | super_mask);
-    if (!appres.altgr_lock)
-      shift_state &= ~altgr_mask;
   }
   RefreshShiftState(FALSE);
   need_insert_blank = FALSE;
@@ -1931,6 +1074,15 @@ static void KeyPressed(Widget w, char *key, char *data)
   }
 }
 
+/*
+ * "\[name]" in the string sent is handled as if the key is pressed
+ * on the screen, for the function keys defined by the user.
+ */
+static void PressKeyHook(const char *key)
+{
+  KeyPressed(None, (char *)key, NULL);
+}
+
 
 /*
  * Redefine keyboard layout.
@@ -2201,6 +1353,867 @@ static void Autoclick(void)
 
 
 
+/*
+ * Light-weight startup path.
+ *
+ * When xvkbd is invoked only to send a string, the toolkit is not
+ * required at all:  the display will be opened with XOpenDisplay(),
+ * and values for application_resources[] will be taken from the
+ * resource database built from RESOURCE_MANAGER property of the
+ * display and the command line options, without resource converters.
+ * The toolkit is still initialized when Editres is required
+ * (-widget and -list).
+ */
+static XrmOptionDescRec light_options[] = {
+  { "-display", ".display", XrmoptionSepArg, NULL },
+  { "-xrm", NULL, XrmoptionResArg, NULL },
+};
+
+/*
+ * Options the toolkit adds to options[] in XtVaAppInitialize(),
+ * for the command line to be read as the toolkit would read it.
+ */
+static XrmOptionDescRec toolkit_options[] = {
+  { "+rv", NULL, XrmoptionNoArg, NULL },
+  { "+synchronous", NULL, XrmoptionNoArg, NULL },
+  { "-background", NULL, XrmoptionSepArg, NULL },
+  { "-bd", NULL, XrmoptionSepArg, NULL },
+  { "-bg", NULL, XrmoptionSepArg, NULL },
+  { "-bordercolor", NULL, XrmoptionSepArg, NULL },
+  { "-borderwidth", NULL, XrmoptionSepArg, NULL },
+  { "-bw", NULL, XrmoptionSepArg, NULL },
+  { "-display", NULL, XrmoptionSepArg, NULL },
+  { "-fg", NULL, XrmoptionSepArg, NULL },
+  { "-fn", NULL, XrmoptionSepArg, NULL },
+  { "-font", NULL, XrmoptionSepArg, NULL },
+  { "-foreground", NULL, XrmoptionSepArg, NULL },
+  { "-geometry", NULL, XrmoptionSepArg, NULL },
+  { "-iconic", NULL, XrmoptionNoArg, NULL },
+  { "-name", NULL, XrmoptionSepArg, NULL },
+  { "-reverse", NULL, XrmoptionNoArg, NULL },
+  { "-rv", NULL, XrmoptionNoArg, NULL },
+  { "-selectionTimeout", NULL, XrmoptionSepArg, NULL },
+  { "-synchronous", NULL, XrmoptionNoArg, NULL },
+  { "-title", NULL, XrmoptionSepArg, NULL },
+  { "-xnllanguage", NULL, XrmoptionSepArg, NULL },
+  { "-xrm", NULL, XrmoptionResArg, NULL },
+  { "-xtsessionID", NULL, XrmoptionSepArg, NULL },
+};
+
+static struct timeval start_time;
+
+/*
+ * Find the option which the argument selects, accepting a unique
+ * abbreviation as XrmParseCommand() does.  Returns NULL if the
+ * argument is not an option, or is ambiguous.
+ */
+static const XrmOptionDescRec *MatchOption(const char *arg)
+{
+  const XrmOptionDescRec *desc, *found = NULL;
+  size_t len = strlen(arg);
+  int matches = 0, i, j;
+
+  for (i = 0; i < XtNumber(options) + XtNumber(toolkit_options); i++) {
+    if (i < XtNumber(options)) {
+      desc = &options[i];
+    } else {
+      desc = &toolkit_options[i - XtNumber(options)];
+      /* options of the application take place of those of the toolkit */
+      for (j = 0; j < XtNumber(options) && strcmp(options[j].option, desc->option) != 0; j++)
+	;
+      if (j < XtNumber(options)) continue;
+    }
+    if (strcmp(arg, desc->option) == 0) return desc;
+    if (0 < len && strncmp(arg, desc->option, len) == 0) {
+      found = desc;
+      matches++;
+    }
+  }
+  return (matches == 1) ? found : NULL;
+}
+
+/*
+ * TRUE if the option (by its full name) is in the command line,
+ * skipping the arguments of the options.
+ */
+static Boolean HasOption(int argc, char *argv[], const char *name)
+{
+  const XrmOptionDescRec *desc;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if ((desc = MatchOption(argv[i])) == NULL) continue;
+    if (strcmp(desc->option, name) == 0) return TRUE;
+    switch (desc->argKind) {
+    case XrmoptionSepArg:
+    case XrmoptionResArg:
+    case XrmoptionSkipArg:
+      i++;
+      break;
+    case XrmoptionSkipNArgs:
+      i += (int)(long)desc->value;
+      break;
+    case XrmoptionSkipLine:
+      return FALSE;
+    default:
+      break;
+    }
+  }
+  return FALSE;
+}
+
+static Boolean UseLightStartup(int argc, char *argv[])
+{
+  if (HasOption(argc, argv, "-dry-run")) return TRUE;
+  if (HasOption(argc, argv, "-widget") || HasOption(argc, argv, "-list"))
+    return FALSE;
+  return (HasOption(argc, argv, "-text") || HasOption(argc, argv, "-file")
+	  || HasOption(argc, argv, "-follow") || HasOption(argc, argv, "-calibrate")
+	  || HasOption(argc, argv, "-record") || HasOption(argc, argv, "-replay"));
+}
+
+/*
+ * Delay measured with -calibrate is used unless -delay is specified.
+ */
+static Boolean DelaySpecified(int argc, char *argv[])
+{
+  return HasOption(argc, argv, "-delay");
+}
+
+static Boolean StringToBoolean(const char *name, const char *str)
+{
+  if (strcasecmp(str, "true") == 0 || strcasecmp(str, "yes") == 0
+      || strcasecmp(str, "on") == 0 || strcmp(str, "1") == 0)
+    return TRUE;
+  if (strcasecmp(str, "false") != 0 && strcasecmp(str, "no") != 0
+      && strcasecmp(str, "off") != 0 && strcmp(str, "0") != 0)
+    fprintf(stderr, "%s: illegal boolean value for %s: %s\n",
+	    PROGRAM_NAME, name, str);
+  return FALSE;
+}
+
+/*
+ * Set values of appres from the resource database, in the same
+ * way as XtGetApplicationResources() does for application_resources[].
+ */
+static void LoadResources(XrmDatabase db, const char *name)
+{
+  XtResource *res;
+  char res_name[100], res_class[100];
+  char *str_type;
+  XrmValue value;
+  const char *str;
+  char *addr;
+  int i;
+
+  for (i = 0; i < XtNumber(application_resources); i++) {
+    res = &application_resources[i];
+    addr = (char *)&appres + res->resource_offset;
+
+    snprintf(res_name, sizeof(res_name), "%s.%s", name, res->resource_name);
+    snprintf(res_class, sizeof(res_class), "XVkbd.%s", res->resource_class);
+    if (db != NULL && XrmGetResource(db, res_name, res_class, &str_type, &value)) {
+      str = (const char *)value.addr;
+    } else if (strcmp(res->default_type, XtRImmediate) == 0) {
+      if (strcmp(res->resource_type, XtRBoolean) == 0)
+	*(Boolean *)addr = (Boolean)(long)res->default_addr;
+      else if (strcmp(res->resource_type, XtRInt) == 0)
+	*(int *)addr = (int)(long)res->default_addr;
+      else
+	*(String *)addr = (String)res->default_addr;
+      continue;
+    } else {
+      str = (const char *)res->default_addr;
+    }
+
+    if (strcmp(res->resource_type, XtRBoolean) == 0)
+      *(Boolean *)addr = StringToBoolean(res->resource_name, str);
+    else if (strcmp(res->resource_type, XtRInt) == 0)
+      *(int *)addr = atoi(str);
+    else if (strcmp(res->resource_type, XtRFloat) == 0)
+      *(float *)addr = atof(str);
+    else
+      *(String *)addr = (String)str;
+  }
+}
+
+static Display *LightInitialize(int *argc, char *argv[])
+{
+  XrmOptionDescRec *opts;
+  XrmDatabase cmd_db = NULL, db = NULL;
+  const char *name;
+  char *str_type;
+  XrmValue value;
+  char res_name[100];
+  char *display_name = NULL;
+  Display *my_dpy;
+
+  name = strrchr(argv[0], '/');
+  name = (name != NULL) ? name + 1 : argv[0];
+
+  XrmInitialize();
+  opts = malloc(sizeof(options) + sizeof(light_options));
+  memcpy(opts, options, sizeof(options));
+  memcpy(opts + XtNumber(options), light_options, sizeof(light_options));
+  XrmParseCommand(&cmd_db, opts, XtNumber(options) + XtNumber(light_options),
+		  name, argc, argv);
+  free(opts);
+
+  snprintf(res_name, sizeof(res_name), "%s.dryRun", name);
+  if (XrmGetResource(cmd_db, res_name, "XVkbd.DryRun", &str_type, &value)) {
+    /* no display is opened for dry run */
+    LoadResources(cmd_db, name);
+    return NULL;
+  }
+
+  snprintf(res_name, sizeof(res_name), "%s.display", name);
+  if (XrmGetResource(cmd_db, res_name, "XVkbd.Display", &str_type, &value))
+    display_name = (char *)value.addr;
+
+  my_dpy = XOpenDisplay(display_name);
+  if (my_dpy == NULL) {
+    fprintf(stderr, "%s: cannot open display \"%s\"\n",
+	    PROGRAM_NAME, XDisplayName(display_name));
+    exit(1);
+  }
+
+  if (XResourceManagerString(my_dpy) != NULL)
+    db = XrmGetStringDatabase(XResourceManagerString(my_dpy));
+  XrmMergeDatabases(cmd_db, &db);
+  LoadResources(db, name);
+
+  return my_dpy;
+}
+
+static double ElapsedTime(struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_usec - since->tv_usec) / 1000.0;
+}
+
+/*
+ * Lines of the file are read in a thread into a ring, so that waiting
+ * for the input doesn't delay the keys.  The ring has one reader and
+ * one sender, each of which only moves its own index, and the
+ * semaphores count the filled and vacant slots.  A NULL line marks
+ * the end of the file.  The reader also parses the lines (escape
+ * sequences and UTF-8), which doesn't depend on the keymap; only
+ * planning of the keys is left to the sender, as the keymap may be
+ * changed while sending.  The reader doesn't take the signals, so
+ * that they interrupt the sender.
+ */
+#define FILE_RING_SIZE 64
+
+static struct {
+  FILE *fp;
+  char *line[FILE_RING_SIZE];
+  XvkbdText text[FILE_RING_SIZE];  /* parsed line */
+  unsigned int head;  /* next slot to be filled by the reader */
+  unsigned int tail;  /* next slot to be sent */
+  sem_t filled;
+  sem_t vacant;
+} file_ring;
+
+static void *ReadFileThread(void *arg)
+{
+  char *line;
+  XvkbdText text;
+  size_t size;
+
+  do {
+    line = NULL;
+    text = NULL;
+    size = 0;
+    if (getline(&line, &size, file_ring.fp) < 0) {
+      free(line);
+      line = NULL;
+    } else {
+      text = XvkbdParseString(line);
+    }
+    while (sem_wait(&file_ring.vacant) != 0 && errno == EINTR) ;
+    file_ring.line[file_ring.head % FILE_RING_SIZE] = line;
+    file_ring.text[file_ring.head++ % FILE_RING_SIZE] = text;
+    sem_post(&file_ring.filled);
+  } while (line != NULL);
+  return NULL;
+}
+
+/*
+ * With -checkpoint, the offset in the file up to which the lines have
+ * been sent without errors, a hash of the file up to there and the keys
+ * held with "\{+keysym}" are saved in FILE.checkpoint about once a
+ * second, and -resume continues from there after xvkbd or the target
+ * failed.  The line being sent at the failure is sent again from its
+ * start.  Modifiers such as "\S" don't need to be saved, as they apply
+ * only within a line.
+ */
+#define CHECKPOINT_INTERVAL  1000  /* ms */
+#define CHECKPOINT_MAGIC     "xvkbd-checkpoint 1"
+#define CHECKPOINT_MAX_HELD  16
+
+static struct {
+  Boolean active;
+  char *path;
+  unsigned long long offset;  /* bytes of the file sent without errors */
+  unsigned long long hash;    /* of the bytes up to the offset */
+  char *held[CHECKPOINT_MAX_HELD];
+  int num_held;
+  struct timeval saved;
+} checkpoint;
+
+static unsigned long long HashInput(unsigned long long hash, const char *data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;  /* FNV-1a */
+  }
+  return hash;
+}
+
+/*
+ * Follow "\{+keysym}" and "\{-keysym}" in the line to know which keys
+ * are left pressed.
+ */
+static void TrackHeldKeys(const char *line)
+{
+  const char *cp, *end;
+  char key[100];
+  size_t len;
+  int i;
+
+  for (cp = line; *cp != '\0'; cp++) {
+    if (*cp != '\\' || cp[1] == '\0') continue;
+    cp++;
+    if (*cp != '{' || (cp[1] != '+' && cp[1] != '-')) continue;
+    end = strchr(cp, '}');
+    if (end == NULL) break;
+    len = end - cp - 2;
+    if (sizeof(key) <= len) len = sizeof(key) - 1;
+    strncpy(key, cp + 2, len);
+    key[len] = '\0';
+    for (i = 0; i < checkpoint.num_held; i++) {
+      if (strcmp(checkpoint.held[i], key) == 0) break;
+    }
+    if (cp[1] == '+' && i == checkpoint.num_held && i < CHECKPOINT_MAX_HELD) {
+      checkpoint.held[checkpoint.num_held++] = strdup(key);
+    } else if (cp[1] == '-' && i < checkpoint.num_held) {
+      free(checkpoint.held[i]);
+      checkpoint.held[i] = checkpoint.held[--checkpoint.num_held];
+    }
+    cp = end;
+  }
+}
+
+/*
+ * Write the checkpoint to a temporary file and rename it, so that the
+ * previous checkpoint is kept if xvkbd dies while writing.
+ */
+static void SaveCheckpoint(void)
+{
+  char tmp[PATH_MAX];
+  FILE *fp;
+  int i;
+
+  gettimeofday(&checkpoint.saved, NULL);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint.path);
+  fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "%s: can't write the checkpoint: %s\n", PROGRAM_NAME, tmp);
+    return;
+  }
+  fprintf(fp, "%s\noffset %llu\nhash %016llx\nheld", CHECKPOINT_MAGIC,
+	  checkpoint.offset, checkpoint.hash);
+  for (i = 0; i < checkpoint.num_held; i++) fprintf(fp, " %s", checkpoint.held[i]);
+  fprintf(fp, "\n");
+  if (fclose(fp) != 0 || rename(tmp, checkpoint.path) != 0) {
+    fprintf(stderr, "%s: can't write the checkpoint: %s\n", PROGRAM_NAME, checkpoint.path);
+    unlink(tmp);
+  } else if (appres.debug) {
+    fprintf(stderr, "xvkbd: checkpoint at byte %llu\n", checkpoint.offset);
+  }
+}
+
+/*
+ * Read the checkpoint, check that the file wasn't changed up to the
+ * offset (which leaves fp at the offset), and press the held keys again.
+ */
+static void LoadCheckpoint(FILE *fp)
+{
+  char buf[1000], held[1000], *cp, *key;
+  unsigned long long hash, offset;
+  size_t n;
+  FILE *cfp;
+
+  cfp = fopen(checkpoint.path, "r");
+  if (cfp == NULL) {
+    fprintf(stderr, "%s: can't read the checkpoint: %s\n", PROGRAM_NAME, checkpoint.path);
+    exit(1);
+  }
+  if (fgets(buf, sizeof(buf), cfp) == NULL || strcmp(buf, CHECKPOINT_MAGIC "\n") != 0
+      || fscanf(cfp, "offset %llu\nhash %llx\n", &checkpoint.offset, &hash) != 2
+      || fgets(held, sizeof(held), cfp) == NULL || strncmp(held, "held", 4) != 0) {
+    fprintf(stderr, "%s: broken checkpoint: %s\n", PROGRAM_NAME, checkpoint.path);
+    exit(1);
+  }
+  fclose(cfp);
+
+  for (offset = 0; offset < checkpoint.offset; offset += n) {
+    n = checkpoint.offset - offset < sizeof(buf) ? checkpoint.offset - offset : sizeof(buf);
+    n = fread(buf, 1, n, fp);
+    if (n == 0) break;
+    checkpoint.hash = HashInput(checkpoint.hash, buf, n);
+  }
+  if (offset != checkpoint.offset || checkpoint.hash != hash) {
+    fprintf(stderr, "%s: the file was changed since the checkpoint: %s\n",
+	    PROGRAM_NAME, checkpoint.path);
+    exit(1);
+  }
+  if (appres.debug)
+    fprintf(stderr, "xvkbd: resuming at byte %llu\n", checkpoint.offset);
+
+  for (key = strtok_r(held + 4, " \n", &cp); key != NULL; key = strtok_r(NULL, " \n", &cp)) {
+    snprintf(buf, sizeof(buf), "\\{+%s}", key);
+    TrackHeldKeys(buf);
+    XvkbdSendString(session, buf);
+  }
+}
+
+static void StartCheckpoint(const char *file, FILE *fp)
+{
+  if (fp == stdin) {
+    fprintf(stderr, "%s: -checkpoint and -resume can't be used with stdin\n", PROGRAM_NAME);
+    exit(1);
+  }
+  checkpoint.active = TRUE;
+  checkpoint.path = malloc(strlen(file) + sizeof(".checkpoint"));
+  sprintf(checkpoint.path, "%s.checkpoint", file);
+  checkpoint.offset = 0;
+  checkpoint.hash = 0xcbf29ce484222325ULL;
+  checkpoint.num_held = 0;
+  if (appres.resume) LoadCheckpoint(fp);
+  gettimeofday(&checkpoint.saved, NULL);
+}
+
+/*
+ * Send a line of the file, and advance the checkpoint over it when it
+ * was sent without errors.  text is the line parsed by the reader
+ * thread, or NULL.  Returns FALSE if sending should be stopped.
+ */
+static Boolean SendFileLine(const char *line, XvkbdText text)
+{
+  size_t len;
+  int result;
+
+  if (text != NULL) result = XvkbdSendParsed(session, text);
+  else result = XvkbdSendString(session, line);
+  if (result != XVKBD_OK) return !checkpoint.active;
+  if (checkpoint.active && !interrupted) {
+    len = strlen(line);
+    checkpoint.offset += len;
+    checkpoint.hash = HashInput(checkpoint.hash, line, len);
+    TrackHeldKeys(line);
+    if (CHECKPOINT_INTERVAL <= ElapsedTime(&checkpoint.saved)) SaveCheckpoint();
+  }
+  return TRUE;
+}
+
+/*
+ * Remove the checkpoint when the whole file was sent, or save where
+ * sending was stopped.
+ */
+static void EndCheckpoint(Boolean completed)
+{
+  if (!checkpoint.active) return;
+  if (completed) {
+    unlink(checkpoint.path);
+  } else {
+    SaveCheckpoint();
+    fprintf(stderr, "%s: stopped at byte %llu, continue with -resume\n",
+	    PROGRAM_NAME, checkpoint.offset);
+  }
+  while (0 < checkpoint.num_held) free(checkpoint.held[--checkpoint.num_held]);
+  free(checkpoint.path);
+  checkpoint.active = FALSE;
+}
+
+/*
+ * Send contents of the file specified with -file ("-" for stdin).
+ * When the text may be pasted, whole contents will be sent at once
+ * so that long runs won't be split at each line, except with
+ * -checkpoint which needs the lines.
+ */
+static void SendFile(const char *file)
+{
+  FILE *fp;
+  char buf[1000];
+  char *text;
+  XvkbdText parsed;
+  size_t len, size, n;
+  pthread_t thread;
+  sigset_t mask, last_mask;
+  int result;
+  Boolean completed = FALSE, failed = FALSE;
+
+  if (strcmp(file, "-") == 0) {
+    fp = stdin;
+  } else {
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "%s: can't read the file: %s\n", PROGRAM_NAME, file);
+      exit(1);
+    }
+  }
+  if ((appres.checkpoint || appres.resume) && strlen(appres.dry_run) == 0)
+    StartCheckpoint(file, fp);
+  if (strcmp(appres.paste, "never") != 0 && !checkpoint.active) {
+    size = sizeof(buf);
+    text = malloc(size);
+    len = 0;
+    while ((n = fread(text + len, 1, size - len - 1, fp)) != 0) {
+      len += n;
+      if (len == size - 1) text = realloc(text, size *= 2);
+    }
+    text[len] = '\0';
+    XvkbdSendString(session, text);
+    free(text);
+  } else {
+    file_ring.fp = fp;
+    file_ring.head = file_ring.tail = 0;
+    sem_init(&file_ring.filled, 0, 0);
+    sem_init(&file_ring.vacant, 0, FILE_RING_SIZE);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &last_mask);
+    result = pthread_create(&thread, NULL, ReadFileThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &last_mask, NULL);
+    if (result != 0) {
+      while (!interrupted && !failed && fgets(buf, sizeof(buf), fp) != NULL)
+	failed = !SendFileLine(buf, NULL);
+      completed = feof(fp);
+    } else {
+      while (!interrupted && !failed) {
+	while (sem_wait(&file_ring.filled) != 0 && !interrupted) ;
+	if (interrupted) break;
+	text = file_ring.line[file_ring.tail % FILE_RING_SIZE];
+	parsed = file_ring.text[file_ring.tail++ % FILE_RING_SIZE];
+	sem_post(&file_ring.vacant);
+	if (text == NULL) {
+	  completed = TRUE;
+	  break;
+	}
+	failed = !SendFileLine(text, parsed);
+	XvkbdFreeText(parsed);
+	free(text);
+      }
+      if (interrupted || failed) pthread_cancel(thread);
+      pthread_join(thread, NULL);
+      for (; file_ring.tail != file_ring.head; file_ring.tail++) {
+	XvkbdFreeText(file_ring.text[file_ring.tail % FILE_RING_SIZE]);
+	free(file_ring.line[file_ring.tail % FILE_RING_SIZE]);
+      }
+    }
+    sem_destroy(&file_ring.filled);
+    sem_destroy(&file_ring.vacant);
+  }
+  if (fp != stdin) fclose(fp);
+  if (checkpoint.active) {
+    EndCheckpoint(completed && !interrupted);
+    if (failed) exit(1);
+  }
+}
+
+/*
+ * Length of the data which can be sent now, without splitting an
+ * escape sequence or a UTF-8 character at the end of the data.
+ * Modifiers such as "\S" are kept with the following character.
+ */
+static size_t CompleteLength(const char *buf, size_t len)
+{
+  size_t i, cut, n;
+  const char *cp;
+  unsigned char ch;
+
+  i = cut = 0;
+  while (i < len) {
+    if (buf[i] == '\\') {
+      if (len <= i + 1) break;
+      switch (buf[i + 1]) {
+      case '[':
+      case '{':
+      case '<':
+	cp = memchr(buf + i + 2, (buf[i + 1] == '[') ? ']' : (buf[i + 1] == '{') ? '}' : '>',
+		    len - i - 2);
+	if (cp == NULL) return cut;
+	i = cp - buf + 1;
+	break;
+      case 'S': case 'C': case 'A': case 'M': case 'W':
+	i += 2;
+	continue;
+      case 'D':
+      case 'm':
+	if (len <= i + 2) return cut;
+	i += 3;
+	break;
+      case 'x':
+      case 'y':
+	for (n = i + 2; n < len && (isdigit(buf[n]) || buf[n] == '+' || buf[n] == '-'); n++) ;
+	if (len <= n) return cut;
+	i = n;
+	break;
+      default:
+	i += 2;
+	break;
+      }
+    } else {
+      ch = buf[i];
+      n = (ch < 0xC0) ? 1 : (ch < 0xE0) ? 2 : (ch < 0xF0) ? 3 : 4;
+      if (len < i + n) return cut;
+      i += n;
+    }
+    cut = i;
+  }
+  return cut;
+}
+
+/*
+ * Follow mode (-follow FILE, "-" for stdin).
+ * Data appended to the file (or written to the FIFO) is sent as soon
+ * as it arrives, waiting for it with inotify (or poll for FIFOs and
+ * stdin).  The file is read from its end, and from the top again if
+ * it is truncated.  A FIFO is opened for writing too, so that it is
+ * kept open while there are no writers.  With -stats, number of the
+ * chunks and time from arrival of the data until it is sent
+ * are reported at the end.
+ */
+static void FollowFile(const char *file)
+{
+  int fd, notify_fd;
+  struct stat st;
+  struct pollfd pfd;
+  struct inotify_event events[16];
+  struct timeval arrival;
+  char *buf, saved;
+  size_t size, len, sent;
+  ssize_t n;
+  Boolean regular, eof;
+  int chunks;
+  double latency, total_latency, max_latency;
+
+  notify_fd = -1;
+  regular = FALSE;
+  if (strcmp(file, "-") == 0) {
+    fd = 0;
+  } else {
+    if (stat(file, &st) == 0) {
+      regular = S_ISREG(st.st_mode);
+      fd = open(file, regular ? O_RDONLY : (O_RDWR | O_NONBLOCK));
+    } else {
+      fd = -1;
+    }
+    if (fd < 0) {
+      fprintf(stderr, "%s: can't read the file: %s\n", PROGRAM_NAME, file);
+      exit(1);
+    }
+    if (regular) {
+      lseek(fd, 0, SEEK_END);
+      notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (notify_fd < 0 || inotify_add_watch(notify_fd, file, IN_MODIFY) < 0) {
+	fprintf(stderr, "%s: can't watch the file: %s\n", PROGRAM_NAME, file);
+	exit(1);
+      }
+    }
+  }
+
+  size = 8192;
+  buf = malloc(size);
+  len = 0;
+  eof = FALSE;
+  chunks = 0;
+  total_latency = max_latency = 0;
+  pfd.fd = (notify_fd != -1) ? notify_fd : fd;
+  pfd.events = POLLIN;
+  while (!interrupted && !eof) {
+    if (poll(&pfd, 1, -1) < 0) continue;
+    gettimeofday(&arrival, NULL);
+    if (notify_fd != -1) {
+      while (0 < read(notify_fd, events, sizeof(events))) ;
+      if (fstat(fd, &st) == 0 && st.st_size < lseek(fd, 0, SEEK_CUR)) {
+	if (appres.debug) fprintf(stderr, "xvkbd: %s truncated\n", file);
+	lseek(fd, 0, SEEK_SET);
+      }
+    }
+    do {
+      if (size - len < 4096) buf = realloc(buf, size *= 2);
+      n = read(fd, buf + len, size - len - 1);
+      if (0 < n) len += n;
+    } while (regular && 0 < n);
+    if (n == 0 && !regular) eof = TRUE;
+
+    sent = eof ? len : CompleteLength(buf, len);
+    if (sent == 0) continue;
+    saved = buf[sent];
+    buf[sent] = '\0';
+    XvkbdSendString(session, buf);
+    buf[sent] = saved;
+    memmove(buf, buf + sent, len - sent);
+    len -= sent;
+
+    latency = ElapsedTime(&arrival);
+    total_latency += latency;
+    if (max_latency < latency) max_latency = latency;
+    chunks++;
+  }
+  free(buf);
+  if (notify_fd != -1) close(notify_fd);
+  if (fd != 0) close(fd);
+
+  if (appres.stats && 0 < chunks)
+    fprintf(stderr, "%s: %d chunks, latency from arrival to sent: average %.3f ms, max %.3f ms\n",
+	    PROGRAM_NAME, chunks, total_latency / chunks, max_latency);
+}
+
+/*
+ * Batch mode (-batch FILE, "-" for stdin).
+ * Each line of the file is a record of four fields separated with TAB:
+ *
+ *   window <TAB> widget <TAB> delay <TAB> string
+ *
+ * window and widget are as for -window and -widget, and delay is as
+ * for -delay; empty field (or "-") means the default, i.e. the input
+ * focus, no widget and the delay specified in the command line.
+ * A line without TAB is a string to be sent to the input focus.
+ * Empty lines and lines beginning with "#" are ignored.
+ *
+ * All records are sent over one connection with one keymap read, and
+ * result of each record is reported to the stdout as:
+ *
+ *   line-number <TAB> "ok" <TAB> milli-seconds
+ *   line-number <TAB> "error" <TAB> milli-seconds <TAB> message
+ *
+ * Returns number of the records failed.
+ */
+static int SendBatch(const char *file)
+{
+  FILE *fp;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  char *field[4], *cp;
+  const char *error;
+  int lineno, num_fields, default_delay, failed, result, i;
+  struct timeval record_start;
+  Window window, child, widget;
+
+  if (strcmp(file, "-") == 0) {
+    fp = stdin;
+  } else {
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "%s: can't read the file: %s\n", PROGRAM_NAME, file);
+      exit(1);
+    }
+  }
+
+  default_delay = appres.text_delay;
+  failed = 0;
+  for (lineno = 1; !interrupted && (len = getline(&line, &line_size, fp)) != -1; lineno++) {
+    if (0 < len && line[len - 1] == '\n') line[--len] = '\0';
+    if (len == 0 || line[0] == '#') continue;
+
+    gettimeofday(&record_start, NULL);
+    num_fields = 4;
+    if (strchr(line, '\t') == NULL) {
+      field[0] = field[1] = field[2] = "";
+      field[3] = line;
+    } else {
+      cp = line;
+      for (num_fields = 0; num_fields < 4 && cp != NULL; num_fields++) {
+	field[num_fields] = cp;
+	if (num_fields < 3 && (cp = strchr(cp, '\t')) != NULL) *cp++ = '\0';
+      }
+    }
+
+    error = NULL;
+    window = None;
+    child = None;
+    appres.text_delay = default_delay;
+    if (num_fields < 4) {
+      error = "malformed record";
+    } else {
+      for (i = 0; i < 3; i++) {
+	if (strcmp(field[i], "-") == 0) field[i] = "";
+      }
+      if (strlen(field[0]) != 0 && (window = XvkbdFindWindow(session, field[0])) == None)
+	error = "no such window";
+    }
+    if (error == NULL) {
+      if (strlen(field[1]) != 0) {
+	if (window == None || toplevel == NULL) {
+	  error = "widget requires window";
+	} else {
+	  child = FindWidget(toplevel, window, field[1]);
+	  if (child == None) error = "no such widget";
+	}
+      }
+      if (error == NULL && strlen(field[2]) != 0) {
+	if (!isdigit(field[2][0])) error = "illegal delay";
+	else appres.text_delay = atoi(field[2]);
+      }
+    }
+
+    if (error == NULL) {
+      XvkbdSetWindow(session, window, child);
+      result = XvkbdSendString(session, field[3]);
+      /* the cached widget tree is not checked with a round trip, so
+	 find the widget again if its window seems to have gone */
+      if (result != XVKBD_OK && child != None && ForgetWidgetTree(window)
+	  && (widget = FindWidget(toplevel, window, field[1])) != None && widget != child) {
+	XvkbdSetWindow(session, window, widget);
+	result = XvkbdSendString(session, field[3]);
+      }
+      if (result != XVKBD_OK) error = "couldn't send events to the window";
+    }
+
+    if (error == NULL) {
+      fprintf(stdout, "%d\tok\t%.3f\n", lineno, ElapsedTime(&record_start));
+    } else {
+      fprintf(stdout, "%d\terror\t%.3f\t%s\n", lineno, ElapsedTime(&record_start), error);
+      failed++;
+    }
+    fflush(stdout);
+  }
+  free(line);
+  if (fp != stdin) fclose(fp);
+
+  XvkbdSetWindow(session, None, None);
+  appres.text_delay = default_delay;
+  return failed;
+}
+
+/*
+ * Send a key of the calibration pattern, to the window if not None.
+ */
+static int SendCalibrationKey(Window window, KeySym keysym)
+{
+  if (window != None) XvkbdSetWindow(session, window, None);
+  return XvkbdSendKeysym(session, keysym, 0);
+}
+
+/*
+ * Restore the keymap changed by the session at exit.
+ */
+static void CloseSession(void)
+{
+  XvkbdClose(session);
+  session = NULL;
+}
+
 /*
  * The main program.
  */
@@ -2212,39 +2225,55 @@ int main(int argc, char *argv[]){
 	};
 	
 	Boolean open_keypad_panel = FALSE;
-	char ch;
-	Window child;
+	Boolean light_startup;
+	Boolean delay_specified;
+	Window window, child;
 	int op, ev, err;
+	int delay;
+	
+	gettimeofday(&start_time, NULL);
 	
 	argc1 = argc;
 	argv1 = malloc(sizeof(char *) * (argc1 + 5));
 	memcpy(argv1, argv, sizeof(char *) * argc1);
 	argv1[argc1] = NULL;
 	
+	light_startup = UseLightStartup(argc, argv);
+	delay_specified = DelaySpecified(argc, argv);
+	if(light_startup){
+		dpy = LightInitialize(&argc, argv);
+	}else{
 #ifdef USE_I18N
-	XtSetLanguageProc(NULL, NULL, NULL);
+		XtSetLanguageProc(NULL, NULL, NULL);
 #endif
+		
+		toplevel = XtVaAppInitialize(
+			NULL, "XVkbd",
+			options, XtNumber(options),
+			&argc, argv, fallback_resources, NULL
+		);
+		
+		dpy = XtDisplay(toplevel);
+		app_con = XtWidgetToApplicationContext(toplevel);
+	}
 	
-	toplevel = XtVaAppInitialize(
-		NULL, "XVkbd",
-		options, XtNumber(options),
-		&argc, argv, fallback_resources, NULL
-	);
-	
-	dpy = XtDisplay(toplevel);
-	app_con = XtWidgetToApplicationContext(toplevel);
-	
-	target_dpy = dpy;
+	if(dpy != NULL) XSetErrorHandler(MyErrorHandler);
+	session = XvkbdOpenDisplay(dpy);
+	press_key_hook = PressKeyHook;
+	read_keymap_hook = RefreshKeymapKeys;
+	if(toplevel != NULL) own_window = XtWindow(toplevel);
 	
 	if(1 < argc){
 		fprintf(stderr, "%s: illegal option: %s\n\n", PROGRAM_NAME, argv[1]);
 	}
 	
-	XtGetApplicationResources(
-		toplevel, &appres,
-		application_resources, XtNumber(application_resources),
-		NULL, 0
-	);
+	if(!light_startup){
+		XtGetApplicationResources(
+			toplevel, &appres,
+			application_resources, XtNumber(application_resources),
+			NULL, 0
+		);
+	}
 	
 	if(appres.version){
 		fprintf(stdout, "%s\n", appres.description);
@@ -2261,17 +2290,124 @@ int main(int argc, char *argv[]){
 		appres.keypad_only = FALSE;
 		open_keypad_panel = TRUE;
 	}
+	if(strlen(appres.dry_run) != 0){
+		appres.keypad_keysym = TRUE;
+		if(strlen(appres.text) != 0){
+			XvkbdSendString(session, appres.text);
+		}else if(strlen(appres.file) != 0){
+			SendFile(appres.file);
+		}else{
+			fprintf(stderr, "%s: -dry-run requires -text or -file\n", PROGRAM_NAME);
+			exit(1);
+		}
+		PrintDryRunSummary();
+		if(appres.stats){
+			fprintf(stderr, "%s: total time: %.3f ms\n", PROGRAM_NAME, ElapsedTime(&start_time));
+		}
+		exit(0);
+	}
+	
 	if(1 || appres.no_sync){
 		XSync(dpy, FALSE);
-		XSetErrorHandler(MyErrorHandler);
 	}
 	
-	focused_subwindow = focused_window;
-	MappingModified(None, NULL, NULL, NULL);
+	window = None;
+	if(strlen(appres.window) != 0){
+		window = XvkbdFindWindow(session, appres.window);
+		if(window == None){
+			fprintf(stderr, "%s: no such window: window=%s\n", PROGRAM_NAME, appres.window);
+			exit(1);
+		}
+	}
+	
+	atexit(CloseSession);
+	signal(SIGINT, SignalHandler);
+	signal(SIGTERM, SignalHandler);
+	signal(SIGHUP, SignalHandler);
+	
+	child = None;
+	if(window != None && (appres.list_widgets || strlen(appres.widget) != 0)){
+		child = FindWidget(toplevel, window, appres.widget);
+	}
+	XvkbdSetWindow(session, window, child);
+	
+	if(strlen(appres.batch) != 0){
+		int failed;
+		
+		appres.keypad_keysym = TRUE;
+		failed = SendBatch(appres.batch);
+		if(appres.stats){
+			fprintf(stderr, "%s: total time: %.3f ms\n", PROGRAM_NAME, ElapsedTime(&start_time));
+		}
+		if(interrupted) exit(128 + interrupted);
+		exit(failed == 0 ? 0 : 1);
+	}
+	
+	if(appres.calibrate){
+		appres.keypad_keysym = TRUE;
+		delay = Calibrate(dpy, window, SendCalibrationKey);
+		if(interrupted) exit(128 + interrupted);
+		exit(delay < 0 ? 1 : 0);
+	}
+	
+	if(strlen(appres.record) != 0){
+		long events;
+		
+		events = RecordSession(dpy, appres.record);
+		if(0 <= events && appres.stats){
+			fprintf(stderr, "%s: %ld events recorded\n", PROGRAM_NAME, events);
+		}
+		exit(events < 0 ? 1 : 0);
+	}
+	
+	if(strlen(appres.replay) != 0){
+		long events;
+		
+		events = Replay(dpy, appres.replay, appres.replay_speed);
+		if(0 <= events && appres.stats){
+			fprintf(stderr, "%s: %ld events replayed, total time: %.3f ms\n", PROGRAM_NAME,
+				events, ElapsedTime(&start_time));
+		}
+		if(interrupted) exit(128 + interrupted);
+		exit(events < 0 || 0 < send_errors ? 1 : 0);
+	}
+	
+	if(!delay_specified && (strlen(appres.follow) != 0
+				|| strlen(appres.text) != 0 || strlen(appres.file) != 0)){
+		delay = CalibratedDelay(dpy, window);
+		if(0 <= delay){
+			if(appres.debug) fprintf(stderr, "xvkbd: calibrated delay: %d ms\n", delay);
+			appres.text_delay = delay;
+		}
+	}
+	
+	if(strlen(appres.follow) != 0){
+		appres.keypad_keysym = TRUE;
+		if(appres.stats){
+			need_read_keymap = FALSE;
+			ReadKeymap();
+			fprintf(stderr, "%s: startup time: %.3f ms (%s)\n", PROGRAM_NAME,
+				ElapsedTime(&start_time), light_startup ? "light" : "toolkit");
+		}
+		FollowFile(appres.follow);
+		if(interrupted) exit(128 + interrupted);
+		exit(0);
+	}
 	
-	if(strlen(appres.text) != 0){
+	if(strlen(appres.text) != 0 || strlen(appres.file) != 0){
 		appres.keypad_keysym = TRUE;
-		SendString(appres.text);
+		if(appres.stats){
+			need_read_keymap = FALSE;
+			ReadKeymap();
+			fprintf(stderr, "%s: startup time: %.3f ms (%s)\n", PROGRAM_NAME,
+				ElapsedTime(&start_time), light_startup ? "light" : "toolkit");
+		}
+		if(strlen(appres.text) != 0) XvkbdSendString(session, appres.text);
+		else SendFile(appres.file);
+		if(appres.stats){
+			fprintf(stderr, "%s: total time: %.3f ms\n", PROGRAM_NAME, ElapsedTime(&start_time));
+		}
+		if(interrupted) exit(128 + interrupted);
 		// printf("success\n");
 		exit(0);
 	}